@@ -0,0 +1,509 @@
+// Headless batch runner: runs many independent cartridge sessions across all
+// cores and reports throughput and final state hashes for each. With golden
+// hashes in the job file, it's also a regression test: emulation is
+// deterministic, so the same ROM, input and frame count always hash the same.
+//
+// usage: GamePersonBatch [-j threads] [-b bios | -n] [-g golden file] jobfile
+//
+// -n runs every job without a boot ROM, starting at 0x100 in the state the
+// boot ROM would have left behind, for when there's no BIOS to hand (CI).
+//
+// Each non-empty line of the job file that doesn't start with '#' is
+//   <rom> <frames> [input script] [option...]
+//
+// An input script has lines of "<frame> <buttons>", where buttons is "none"
+// or names joined with '+' (right, left, up, down, a, b, select, start).
+// The buttons are held from that frame until the next line.
+//
+// The options are:
+//   until=serial:<text>  stop once the ROM has sent text out of the serial
+//                        port, as Blargg's tests do; it fails if that hasn't
+//                        happened by the last frame
+//   until=break          stop at the first ld b, b, as Mooneye's tests do, and
+//                        pass only if b, c, d, e, h and l are 3, 5, 8, 13,
+//                        21 and 34
+//   check=<frame>[:<fb>:<ram>]
+//                        hash the framebuffer and RAM once that many frames
+//                        have run, and fail unless they match the hashes
+//                        given, if any
+//   min_fps=<fps>        fail if it ran slower than that
+//
+// The run stops and completion signals are checked between frames. -g writes
+// the job file back out with the hashes of every check filled in from this
+// run, to record golden values.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpu.h"
+#include "romimage.h"
+#include "util.h"
+#include "pool.h"
+
+struct InputEvent
+{
+	unsigned int frame;
+	uint8_t buttons;
+};
+
+struct Check
+{
+	unsigned int frame;
+	bool golden; // whether fb and ram are known
+	uint64_t fb, ram;
+
+	// results
+	bool reached;
+	uint64_t got_fb, got_ram;
+};
+
+struct Job
+{
+	std::string rom;
+	unsigned int frames;
+	std::string input_name;
+	std::vector<InputEvent> input;
+	std::string until_serial; // stop once this has been sent, if it's not empty
+	bool until_break;
+	std::vector<Check> checks;
+	double min_fps;
+
+	// results
+	bool ok;
+	std::string error;
+	unsigned int frames_run;
+	double seconds;
+	uint64_t fb_hash;
+	uint64_t ram_hash;
+	uint64_t cycles;
+	uint64_t skipped; // cycles spent in HALT or idle loops, which cost nothing
+	std::string serial;
+};
+
+static bool parse_buttons(std::string s, uint8_t &buttons)
+{
+	static const char *names[8] = { "right", "left", "up", "down", "a", "b", "select", "start" };
+
+	buttons = 0;
+	if(s == "none")
+	{
+		return true;
+	}
+
+	std::stringstream ss(s);
+	std::string name;
+	while(std::getline(ss, name, '+'))
+	{
+		int i = 0;
+		for(; i < 8; i++)
+		{
+			if(name == names[i])
+			{
+				buttons |= 1 << i;
+				break;
+			}
+		}
+		if(i == 8)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static void load_input(std::string name, std::vector<InputEvent> &input)
+{
+	std::ifstream f(name);
+	if(!f.good())
+	{
+		throw util::LoadException("couldn't open input script '" + name + "'");
+	}
+
+	std::string line;
+	while(std::getline(f, line))
+	{
+		if(line.empty() || line[0] == '#')
+		{
+			continue;
+		}
+
+		std::stringstream ss(line);
+		InputEvent ev;
+		std::string buttons;
+		if(!(ss >> ev.frame >> buttons) || !parse_buttons(buttons, ev.buttons))
+		{
+			throw util::LoadException("bad line in input script '" + name + "': " + line);
+		}
+		input.push_back(ev);
+	}
+}
+
+static std::string hex(uint64_t v)
+{
+	char buf[17];
+	snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)v);
+	return buf;
+}
+
+static bool parse_hash(std::string s, uint64_t &v)
+{
+	char *end;
+	v = strtoull(s.c_str(), &end, 16);
+	return !s.empty() && *end == 0;
+}
+
+static bool parse_option(std::string option, Job *job)
+{
+	size_t eq = option.find('=');
+	std::string name = option.substr(0, eq), value = option.substr(eq + 1);
+	if(name == "until" && value == "break")
+	{
+		job->until_break = true;
+	}
+	else if(name == "until" && value.compare(0, 7, "serial:") == 0 && value.size() > 7)
+	{
+		job->until_serial = value.substr(7);
+	}
+	else if(name == "check")
+	{
+		Check check = {};
+		std::stringstream ss(value);
+		std::string frame, fb, ram;
+		std::getline(ss, frame, ':');
+		check.frame = atoi(frame.c_str());
+		if(check.frame == 0)
+		{
+			return false;
+		}
+		if(std::getline(ss, fb, ':'))
+		{
+			if(!std::getline(ss, ram) || !parse_hash(fb, check.fb) || !parse_hash(ram, check.ram))
+			{
+				return false;
+			}
+			check.golden = true;
+		}
+		job->checks.push_back(check);
+	}
+	else if(name == "min_fps")
+	{
+		job->min_fps = atof(value.c_str());
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+// The job as a job file line, with the hashes its checks got this time.
+static std::string golden_line(Job *job)
+{
+	std::string line = job->rom + " " + std::to_string(job->frames);
+	if(!job->input_name.empty())
+	{
+		line += " " + job->input_name;
+	}
+	if(job->until_break)
+	{
+		line += " until=break";
+	}
+	if(!job->until_serial.empty())
+	{
+		line += " until=serial:" + job->until_serial;
+	}
+	size_t i = 0;
+	for(; i < job->checks.size(); i++)
+	{
+		Check &check = job->checks[i];
+		line += " check=" + std::to_string(check.frame);
+		if(check.reached)
+		{
+			line += ":" + hex(check.got_fb) + ":" + hex(check.got_ram);
+		}
+	}
+	if(job->min_fps > 0)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), " min_fps=%g", job->min_fps);
+		line += buf;
+	}
+	return line;
+}
+
+// Has the ROM said it's done? Sets job->error if it says it failed.
+static bool finished(CPU *c, Job *job)
+{
+	if(job->until_break && c->breakpoints != 0)
+	{
+		if(c->regs.bc.b != 3 || c->regs.bc.c != 5 || c->regs.de.d != 8 || c->regs.de.e != 13 ||
+			c->regs.hl.h != 21 || c->regs.hl.l != 34)
+		{
+			job->ok = false;
+			job->error = "stopped at ld b, b without the passing registers";
+		}
+		return true;
+	}
+	return !job->until_serial.empty() && c->serial_out.find(job->until_serial) != std::string::npos;
+}
+
+// An empty bios path runs without one.
+static void run_job(std::string bios, Job *job)
+{
+	job->ok = false;
+	job->frames_run = 0;
+	job->seconds = 0;
+	job->fb_hash = job->ram_hash = 0;
+	job->cycles = job->skipped = 0;
+
+	CPU *c;
+	try
+	{
+		c = new CPU(bios.empty() ? nullptr : RomImage::open(bios), RomImage::open(job->rom));
+	}
+	catch(util::LoadException &e)
+	{
+		job->error = e.what();
+		return;
+	}
+
+	size_t next_input = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	job->ok = true;
+	size_t next_check = 0;
+	bool done = false;
+	for(; job->frames_run < job->frames && !done; job->frames_run++)
+	{
+		while(next_input < job->input.size() && job->input[next_input].frame <= job->frames_run)
+		{
+			c->buttons = job->input[next_input].buttons;
+			next_input++;
+		}
+
+		if(c->run_frame())
+		{
+			job->ok = false;
+			job->error = c->error.empty() ? "emulation stopped" : c->error;
+			break;
+		}
+
+		// Checks are in frame order.
+		while(next_check < job->checks.size() && job->checks[next_check].frame == job->frames_run + 1)
+		{
+			Check &check = job->checks[next_check++];
+			check.reached = true;
+			c->hash_state(check.got_fb, check.got_ram, true); // golden hashes are of ARGB8888 frames
+		}
+
+		done = finished(c, job);
+	}
+
+	job->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	c->hash_state(job->fb_hash, job->ram_hash);
+	job->cycles = c->cycles;
+	job->skipped = c->halted_cycles + c->idle_cycles;
+	job->serial = c->serial_out;
+
+	if(job->ok)
+	{
+		size_t i = 0;
+		for(; i < job->checks.size() && job->ok; i++)
+		{
+			Check &check = job->checks[i];
+			if(!check.reached)
+			{
+				job->ok = false;
+				job->error = "stopped before the check at frame " + std::to_string(check.frame);
+			}
+			else if(check.golden && (check.got_fb != check.fb || check.got_ram != check.ram))
+			{
+				job->ok = false;
+				job->error = "check at frame " + std::to_string(check.frame) + " hashed fb=" + hex(check.got_fb) +
+					" ram=" + hex(check.got_ram) + ", not fb=" + hex(check.fb) + " ram=" + hex(check.ram);
+			}
+		}
+	}
+	if(job->ok && (job->until_break || !job->until_serial.empty()) && !done)
+	{
+		job->ok = false;
+		job->error = "no completion signal";
+	}
+	double fps = job->seconds > 0 ? job->frames_run / job->seconds : 0.0;
+	if(job->ok && fps < job->min_fps)
+	{
+		job->ok = false;
+		job->error = "ran at " + std::to_string((int)fps) + " fps, under min_fps";
+	}
+
+	delete c;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int threads = std::thread::hardware_concurrency();
+	std::string bios = "gb.bios";
+	const char *jobfile = nullptr;
+	const char *golden = nullptr;
+
+	int i = 1;
+	for(; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "-j") && i + 1 < argc)
+		{
+			threads = atoi(argv[++i]);
+		}
+		else if(!strcmp(argv[i], "-b") && i + 1 < argc)
+		{
+			bios = argv[++i];
+		}
+		else if(!strcmp(argv[i], "-n"))
+		{
+			bios = "";
+		}
+		else if(!strcmp(argv[i], "-g") && i + 1 < argc)
+		{
+			golden = argv[++i];
+		}
+		else
+		{
+			jobfile = argv[i];
+		}
+	}
+
+	if(jobfile == nullptr)
+	{
+		printf("usage: %s [-j threads] [-b bios | -n] [-g golden file] jobfile\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<Job*> jobs;
+	try
+	{
+		std::ifstream f(jobfile);
+		if(!f.good())
+		{
+			throw util::LoadException(std::string("couldn't open job file '") + jobfile + "'");
+		}
+
+		std::string line;
+		while(std::getline(f, line))
+		{
+			if(line.empty() || line[0] == '#')
+			{
+				continue;
+			}
+
+			std::stringstream ss(line);
+			std::string word;
+			Job *job = new Job();
+			jobs.push_back(job);
+			if(!(ss >> job->rom >> job->frames))
+			{
+				throw util::LoadException("bad line in job file: " + line);
+			}
+			while(ss >> word)
+			{
+				if(word.find('=') != std::string::npos)
+				{
+					if(!parse_option(word, job))
+					{
+						throw util::LoadException("bad option in job file: " + word);
+					}
+				}
+				else if(job->input_name.empty())
+				{
+					job->input_name = word;
+					load_input(word, job->input);
+				}
+				else
+				{
+					throw util::LoadException("bad line in job file: " + line);
+				}
+			}
+			std::sort(job->checks.begin(), job->checks.end(), [](const Check &a, const Check &b) { return a.frame < b.frame; });
+		}
+	}
+	catch(util::LoadException &e)
+	{
+		printf("%s\n", e.what());
+		size_t j = 0;
+		for(; j < jobs.size(); j++)
+		{
+			delete jobs[j];
+		}
+		return 1;
+	}
+
+	WorkStealingPool pool(threads);
+	size_t j = 0;
+	for(; j < jobs.size(); j++)
+	{
+		pool.submit(std::bind(run_job, bios, jobs[j]));
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	pool.run();
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	uint64_t total_frames = 0;
+	double busy = 0;
+	int failed = 0;
+
+	FILE *golden_file = nullptr;
+	if(golden != nullptr && (golden_file = fopen(golden, "w")) == nullptr)
+	{
+		printf("couldn't write golden file '%s'\n", golden);
+	}
+
+	for(j = 0; j < jobs.size(); j++)
+	{
+		Job *job = jobs[j];
+		if(job->ok)
+		{
+			printf("%zu %s frames=%u time=%.3fs fps=%.1f idle=%.1f%% fb=%016llx ram=%016llx\n", j, job->rom.c_str(),
+				job->frames_run, job->seconds, job->seconds > 0 ? job->frames_run / job->seconds : 0.0,
+				job->cycles > 0 ? 100.0 * job->skipped / job->cycles : 0.0,
+				(unsigned long long)job->fb_hash, (unsigned long long)job->ram_hash);
+		}
+		else
+		{
+			printf("%zu %s failed after %u frames: %s\n", j, job->rom.c_str(), job->frames_run, job->error.c_str());
+			failed++;
+		}
+
+		if(!job->ok && !job->serial.empty())
+		{
+			std::string serial = job->serial;
+			std::replace(serial.begin(), serial.end(), '\n', ' ');
+			printf("%zu serial output: %s\n", j, serial.c_str());
+		}
+		if(golden_file != nullptr)
+		{
+			fprintf(golden_file, "%s\n", golden_line(job).c_str());
+		}
+
+		total_frames += job->frames_run;
+		busy += job->seconds;
+		delete job;
+	}
+
+	if(golden_file != nullptr)
+	{
+		fclose(golden_file);
+	}
+
+	printf("%zu jobs (%d failed) on %u threads: %llu frames in %.3fs, %.1f frames/s (%.1f per thread)\n",
+		jobs.size(), failed, pool.size(), (unsigned long long)total_frames, wall,
+		wall > 0 ? total_frames / wall : 0.0, busy > 0 ? total_frames / busy : 0.0);
+
+	return failed != 0;
+}
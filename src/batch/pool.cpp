@@ -0,0 +1,94 @@
+#include "pool.h"
+
+WorkStealingPool::WorkStealingPool(unsigned int threads)
+{
+	if(threads == 0)
+	{
+		threads = 1;
+	}
+
+	unsigned int i = 0;
+	for(; i < threads; i++)
+	{
+		queues.push_back(new Queue());
+	}
+	next_queue = 0;
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	size_t i = 0;
+	for(; i < queues.size(); i++)
+	{
+		delete queues[i];
+	}
+}
+
+unsigned int WorkStealingPool::size()
+{
+	return queues.size();
+}
+
+void WorkStealingPool::submit(Job job)
+{
+	Queue *q = queues[next_queue];
+	next_queue = (next_queue + 1) % queues.size();
+
+	std::lock_guard<std::mutex> l(q->lock);
+	q->jobs.push_back(job);
+}
+
+bool WorkStealingPool::take(unsigned int self, Job &job)
+{
+	{
+		Queue *q = queues[self];
+		std::lock_guard<std::mutex> l(q->lock);
+		if(!q->jobs.empty())
+		{
+			job = q->jobs.back();
+			q->jobs.pop_back();
+			return true;
+		}
+	}
+
+	size_t i = 1;
+	for(; i < queues.size(); i++)
+	{
+		Queue *victim = queues[(self + i) % queues.size()];
+		std::lock_guard<std::mutex> l(victim->lock);
+		if(!victim->jobs.empty())
+		{
+			job = victim->jobs.front();
+			victim->jobs.pop_front();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void WorkStealingPool::worker(unsigned int self)
+{
+	// Jobs never submit more jobs, so once every queue is empty we're done.
+	Job job;
+	while(take(self, job))
+	{
+		job();
+	}
+}
+
+void WorkStealingPool::run()
+{
+	std::vector<std::thread> threads;
+
+	unsigned int i = 0;
+	for(; i < queues.size(); i++)
+	{
+		threads.push_back(std::thread(&WorkStealingPool::worker, this, i));
+	}
+
+	for(i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <stddef.h>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs a fixed set of independent jobs on a group of threads. Each thread
+// owns a deque and takes from its back; once that's empty, it steals from
+// the front of the others, so long jobs don't leave cores idle at the end.
+class WorkStealingPool
+{
+public:
+	typedef std::function<void()> Job;
+
+	WorkStealingPool(unsigned int threads);
+	~WorkStealingPool();
+
+	// Queue a job. Jobs are spread round-robin over the threads.
+	void submit(Job job);
+
+	// Run everything submitted so far and return once it has all finished.
+	void run();
+
+	unsigned int size();
+
+private:
+	struct Queue
+	{
+		std::mutex lock;
+		std::deque<Job> jobs;
+	};
+
+	std::vector<Queue*> queues;
+	size_t next_queue;
+
+	bool take(unsigned int self, Job &job);
+	void worker(unsigned int self);
+};
@@ -0,0 +1,147 @@
+// Compares running many identical machines one after another against running
+// them in lockstep groups, on a synthetic ROM.
+//
+// usage: GamePersonLockstepBench [-n instances] [-c cycles per instance]
+//
+// Prints one line of key=value pairs per variant and mode.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "cpu.h"
+#include "lockstep.h"
+#include "romimage.h"
+#include "util.h"
+#include "synthrom.h"
+
+static std::vector<CPU*> make_cpus(const std::vector<uint8_t> &rom, int n, bool diverge)
+{
+	std::shared_ptr<const RomImage> image = RomImage::wrap(rom.data(), rom.size());
+	std::vector<CPU*> cpus;
+	int i = 0;
+	for(; i < n; i++)
+	{
+		CPU *c = new CPU(nullptr, image);
+		if(diverge)
+		{
+			c->wram[0x1000] = i * 3; // 0xd000, the workload's spin count
+		}
+		cpus.push_back(c);
+	}
+	return cpus;
+}
+
+static uint64_t hash_cpus(std::vector<CPU*> &cpus)
+{
+	uint64_t h = util::hash_buffer(nullptr, 0);
+	size_t i = 0;
+	for(; i < cpus.size(); i++)
+	{
+		cpus[i]->regs.af.f = cpus[i]->get_f();
+		h = util::hash_buffer(cpus[i]->wram, 0x2000, h);
+		h = util::hash_buffer((uint8_t*)&cpus[i]->regs, sizeof(cpus[i]->regs), h);
+		h = util::hash_buffer((uint8_t*)&cpus[i]->cycles, sizeof(cpus[i]->cycles), h);
+	}
+	return h;
+}
+
+static void free_cpus(std::vector<CPU*> &cpus)
+{
+	size_t i = 0;
+	for(; i < cpus.size(); i++)
+	{
+		delete cpus[i];
+	}
+}
+
+static void report(const char *variant, const char *mode, int n, uint64_t cycles, uint64_t instructions, double seconds, const char *extra)
+{
+	printf("bench=lockstep variant=%s mode=%s instances=%d lanes=%d cycles=%llu seconds=%.4f cycles_per_s=%.0f instr_per_s=%.0f%s\n",
+		variant, mode, n, GP_LOCKSTEP_LANES, (unsigned long long)cycles, seconds,
+		cycles / seconds, instructions / seconds, extra);
+}
+
+static void bench(const char *variant, bool diverge, int n, uint64_t budget)
+{
+	std::vector<uint8_t> rom = synthrom::workload();
+	typedef std::chrono::steady_clock clock;
+
+	// step() by hand first, to count instructions and get the reference state.
+	std::vector<CPU*> ref = make_cpus(rom, n, diverge);
+	uint64_t instructions = 0;
+	int i = 0;
+	for(; i < n; i++)
+	{
+		while(ref[i]->cycles < budget)
+		{
+			ref[i]->step();
+			instructions++;
+		}
+	}
+	uint64_t ref_hash = hash_cpus(ref);
+	free_cpus(ref);
+
+	std::vector<CPU*> cpus = make_cpus(rom, n, diverge);
+	clock::time_point start = clock::now();
+	for(i = 0; i < n; i++)
+	{
+		cpus[i]->run(budget);
+	}
+	double scalar = std::chrono::duration<double>(clock::now() - start).count();
+	free_cpus(cpus);
+	report(variant, "scalar", n, budget * n, instructions, scalar, "");
+
+	// A group is over-aligned for plain new in C++11, so keep each on the stack.
+	cpus = make_cpus(rom, n, diverge);
+	uint64_t vector_instructions = 0, scalar_instructions = 0;
+	double lockstep = 0;
+	for(i = 0; i < n; i += GP_LOCKSTEP_LANES)
+	{
+		LockstepGroup group(&cpus[i], n - i < GP_LOCKSTEP_LANES ? n - i : GP_LOCKSTEP_LANES);
+
+		start = clock::now();
+		group.run(budget);
+		lockstep += std::chrono::duration<double>(clock::now() - start).count();
+
+		vector_instructions += group.vector_instructions;
+		scalar_instructions += group.scalar_instructions;
+	}
+
+	char extra[128];
+	snprintf(extra, sizeof(extra), " vector_fraction=%.3f speedup=%.2f match=%d",
+		(double)vector_instructions / (vector_instructions + scalar_instructions), scalar / lockstep,
+		hash_cpus(cpus) == ref_hash);
+	report(variant, "lockstep", n, budget * n, instructions, lockstep, extra);
+	free_cpus(cpus);
+}
+
+int main(int argc, char **argv)
+{
+	int n = GP_LOCKSTEP_LANES;
+	uint64_t budget = 20000000;
+
+	int i = 1;
+	for(; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "-n") && i + 1 < argc)
+		{
+			n = atoi(argv[++i]);
+		}
+		else if(!strcmp(argv[i], "-c") && i + 1 < argc)
+		{
+			budget = strtoull(argv[++i], nullptr, 0);
+		}
+		else
+		{
+			printf("usage: %s [-n instances] [-c cycles per instance]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	bench("converged", false, n, budget);
+	bench("divergent", true, n, budget);
+	return 0;
+}
@@ -0,0 +1,435 @@
+// Microbenchmarks for the core: CPU::step on synthetic instruction mixes,
+// run() on the same mixes with whatever engine this build has, read8/write8
+// per memory region, GBScreen drawing, whole frames, and making CPUs. Every
+// ROM is assembled in memory, so nothing has to be on disk.
+//
+// usage: GamePersonBench [-t seconds] [-r repeats] [group...]
+//
+// The groups are step, run, memory, screen, frame and instance, all of them by
+// default.
+// Each measurement runs for about the given time (0.2s), repeats times (5).
+// Prints a bench=build line saying how the core was built, then one line of
+// key=value pairs per measurement with the best and median of the repeats,
+// so results from different commits can be lined up and compared. The same
+// goes for builds: with GP_EAGER_FLAGS, say, the step and run lines for the
+// alu mix show what working out every flag as it's set would cost.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+#include "pixels.h"
+#include "romimage.h"
+#include "screen.h"
+#include "util.h"
+#include "synthrom.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_per_run = 0.2;
+static int repeats = 5;
+unsigned int sink; // where reads go, so they aren't optimised away
+
+struct Timing
+{
+	double best; // seconds per unit
+	double median;
+};
+
+// Calls body(batch), which does batch units of work, until seconds_per_run
+// has passed, repeats times over.
+template<typename F> static Timing measure(uint64_t batch, F body)
+{
+	std::vector<double> runs;
+	int r = 0;
+	for(; r < repeats; r++)
+	{
+		uint64_t units = 0;
+		double elapsed = 0;
+		bench_clock::time_point start = bench_clock::now();
+		while(elapsed < seconds_per_run)
+		{
+			body(batch);
+			units += batch;
+			elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+		}
+		runs.push_back(elapsed / units);
+	}
+	std::sort(runs.begin(), runs.end());
+	return Timing { runs[0], runs[runs.size() / 2] };
+}
+
+static const char *engine()
+{
+#if defined(GP_JIT)
+	return "jit";
+#elif defined(GP_BLOCK_CACHE)
+	return "blocks";
+#elif defined(GP_THREADED_DISPATCH)
+	return "threaded";
+#else
+	return "step";
+#endif
+}
+
+static CPU *make_cpu(const std::vector<uint8_t> &rom)
+{
+	return new CPU(nullptr, rom.data(), rom.size());
+}
+
+// CPU::step alone, so without events: instructions per second.
+static bool bench_step()
+{
+	std::vector<std::string> mixes = synthrom::mixes();
+	mixes.push_back("workload");
+
+	size_t m = 0;
+	for(; m < mixes.size(); m++)
+	{
+		std::vector<uint8_t> rom = mixes[m] == "workload" ? synthrom::workload() : synthrom::mix(mixes[m]);
+		CPU *c = make_cpu(rom);
+		bool failed = false;
+		uint64_t instructions = 0, start_cycles = c->cycles;
+
+		Timing t = measure(100000, [&](uint64_t n) {
+			uint64_t i = 0;
+			for(; i < n; i++)
+			{
+				failed = c->step() || failed;
+			}
+			instructions += n;
+		});
+
+		printf("bench=step mix=%s instr_per_s=%.0f instr_per_s_median=%.0f ns_per_instr=%.3f cycles_per_instr=%.2f\n",
+			mixes[m].c_str(), 1 / t.best, 1 / t.median, t.best * 1e9, (double)(c->cycles - start_cycles) / instructions);
+		delete c;
+		if(failed)
+		{
+			printf("bench=step mix=%s failed\n", mixes[m].c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+// CPU::run, events and all, through this build's engine: emulated cycles per
+// second, and how many times faster than the real thing that is.
+static bool bench_run()
+{
+	std::vector<std::string> mixes = synthrom::mixes();
+	mixes.push_back("workload");
+
+	size_t m = 0;
+	for(; m < mixes.size(); m++)
+	{
+		std::vector<uint8_t> rom = mixes[m] == "workload" ? synthrom::workload() : synthrom::mix(mixes[m]);
+		CPU *c = make_cpu(rom);
+		bool failed = false;
+
+		Timing t = measure(CYCLES_PER_SECOND / 100, [&](uint64_t n) {
+			failed = c->run(n) || failed;
+		});
+
+		printf("bench=run mix=%s engine=%s cycles_per_s=%.0f cycles_per_s_median=%.0f realtime=%.1f\n",
+			mixes[m].c_str(), engine(), 1 / t.best, 1 / t.median, 1 / t.best / CYCLES_PER_SECOND);
+		delete c;
+		if(failed)
+		{
+			printf("bench=run mix=%s failed\n", mixes[m].c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+struct Region
+{
+	const char *name;
+	uint16_t start, end; // reads anywhere in start-end
+	uint16_t write_start, write_end;
+	const uint16_t *io; // or only these, if set
+	size_t io_count;
+};
+
+// Registers that read and write without side effects beyond their own state.
+static const uint16_t io_reads[] = { 0xff00, 0xff04, 0xff05, 0xff06, 0xff07, 0xff0f, 0xff40, 0xff41, 0xff42, 0xff43, 0xff44, 0xff45, 0xff47, 0xff48, 0xff49, 0xffff };
+static const uint16_t io_writes[] = { 0xff42, 0xff43, 0xff45, 0xff47, 0xff48, 0xff49, 0xff4a, 0xff4b };
+
+// read8 and write8 as called from outside the CPU, per region. ROM writes
+// select the bank that's already there, so they take the bank switching path
+// without remapping anything; VRAM writes include tile data, which the screen
+// watches.
+static bool bench_memory()
+{
+	static const Region regions[] =
+	{
+		{ "rom", 0x0000, 0x7fff, 0x2000, 0x3fff, nullptr, 0 },
+		{ "vram", 0x8000, 0x9fff, 0x8000, 0x9fff, nullptr, 0 },
+		{ "cart_ram", 0xa000, 0xbfff, 0xa000, 0xbfff, nullptr, 0 },
+		{ "wram", 0xc000, 0xdfff, 0xc000, 0xdfff, nullptr, 0 },
+		{ "echo", 0xe000, 0xfdff, 0xe000, 0xfdff, nullptr, 0 },
+		{ "oam", 0xfe00, 0xfe9f, 0xfe00, 0xfe9f, nullptr, 0 },
+		{ "io", 0, 0, 0, 0, io_reads, sizeof(io_reads) / sizeof(io_reads[0]) },
+		{ "hram", 0xff80, 0xfffe, 0xff80, 0xfffe, nullptr, 0 }
+	};
+
+	std::vector<uint8_t> rom = synthrom::mix("memory");
+	CPU *c = make_cpu(rom);
+	c->write8(0x0000, 0x0a); // cartridge RAM on
+
+	srand(1);
+	uint16_t reads[4096], writes[4096];
+	size_t r = 0;
+	for(; r < sizeof(regions) / sizeof(regions[0]); r++)
+	{
+		const Region &region = regions[r];
+		int i = 0;
+		for(; i < 4096; i++)
+		{
+			if(region.io != nullptr)
+			{
+				reads[i] = region.io[rand() % region.io_count];
+				writes[i] = io_writes[rand() % (sizeof(io_writes) / sizeof(io_writes[0]))];
+			}
+			else
+			{
+				reads[i] = region.start + rand() % (region.end - region.start + 1);
+				writes[i] = region.write_start + rand() % (region.write_end - region.write_start + 1);
+			}
+		}
+		bool rom_writes = region.write_end < 0x8000;
+
+		Timing read = measure(4096, [&](uint64_t n) {
+			uint64_t j = 0;
+			for(; j < n; j++)
+			{
+				sink += c->read8(reads[j & 4095]);
+			}
+		});
+		Timing write = measure(4096, [&](uint64_t n) {
+			uint64_t j = 0;
+			for(; j < n; j++)
+			{
+				c->write8(writes[j & 4095], rom_writes ? 1 : j);
+			}
+		});
+
+		printf("bench=memory region=%s read_ns=%.3f read_ns_median=%.3f write_ns=%.3f write_ns_median=%.3f\n",
+			region.name, read.best * 1e9, read.median * 1e9, write.best * 1e9, write.median * 1e9);
+	}
+
+	delete c;
+	return true;
+}
+
+// Drawing on its own: a whole frame with the decoded tiles cached and with
+// every tile decoded again, and single scanlines.
+static bool bench_screen()
+{
+	std::vector<uint8_t> vram(0x2000);
+	srand(2);
+	size_t i = 0;
+	for(; i < vram.size(); i++)
+	{
+		vram[i] = rand();
+	}
+
+	static const struct { const char *tiles; uint8_t lcdc; } modes[] =
+	{
+		{ "8000", 0x91 },
+		{ "8800", 0x81 }
+	};
+
+	for(i = 0; i < 2; i++)
+	{
+		GBScreen screen(vram.data());
+		screen.write(0xff47, 0xe4);
+		screen.write(0xff40, modes[i].lcdc);
+		screen.write(0xff42, 5);
+		screen.write(0xff43, 3);
+		screen.refresh();
+
+		Timing warm = measure(1, [&](uint64_t n) {
+			uint64_t j = 0;
+			for(; j < n; j++)
+			{
+				screen.refresh();
+			}
+		});
+		Timing cold = measure(1, [&](uint64_t n) {
+			uint64_t j = 0;
+			for(; j < n; j++)
+			{
+				screen.invalidate_tiles();
+				screen.refresh();
+			}
+		});
+		int y = 0;
+		Timing line = measure(VBLANK_START, [&](uint64_t n) {
+			uint64_t j = 0;
+			for(; j < n; j++)
+			{
+				screen.render_line(y);
+				y = y + 1 < VBLANK_START ? y + 1 : 0;
+			}
+		});
+
+		printf("bench=screen tiles=%s kernels=%s refresh_us=%.2f refresh_us_median=%.2f refresh_cold_us=%.2f refresh_cold_us_median=%.2f line_ns=%.1f line_ns_median=%.1f\n",
+			modes[i].tiles, screen.kernels->name, warm.best * 1e6, warm.median * 1e6, cold.best * 1e6, cold.median * 1e6,
+			line.best * 1e9, line.median * 1e9);
+	}
+	return true;
+}
+
+// Everything together: run_frame() with the LCD on, so every frame is drawn.
+static bool bench_frame()
+{
+	std::vector<std::string> mixes = synthrom::mixes();
+
+	size_t m = 0;
+	for(; m < mixes.size(); m++)
+	{
+		std::vector<uint8_t> rom = synthrom::mix(mixes[m]);
+		CPU *c = make_cpu(rom);
+		bool failed = false;
+		uint64_t frames = 0, start_cycles = c->cycles;
+
+		Timing t = measure(10, [&](uint64_t n) {
+			uint64_t j = 0;
+			for(; j < n; j++)
+			{
+				failed = c->run_frame() || failed;
+			}
+			frames += n;
+		});
+
+		double cycles_per_frame = (double)(c->cycles - start_cycles) / frames;
+		printf("bench=frame mix=%s engine=%s frames_per_s=%.1f frames_per_s_median=%.1f us_per_frame=%.2f realtime=%.1f\n",
+			mixes[m].c_str(), engine(), 1 / t.best, 1 / t.median, t.best * 1e6, cycles_per_frame / t.best / CYCLES_PER_SECOND);
+		delete c;
+		if(failed)
+		{
+			printf("bench=frame mix=%s failed\n", mixes[m].c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+// Getting a CPU to run: constructing one from a ROM it copies, constructing
+// one from an image every CPU shares, and resetting one that already exists.
+static bool bench_instance()
+{
+	std::vector<uint8_t> rom = synthrom::workload();
+	std::shared_ptr<const RomImage> image = RomImage::wrap(rom.data(), rom.size());
+
+	Timing copied = measure(100, [&](uint64_t n) {
+		uint64_t j = 0;
+		for(; j < n; j++)
+		{
+			delete new CPU(nullptr, rom.data(), rom.size());
+		}
+	});
+	Timing shared = measure(100, [&](uint64_t n) {
+		uint64_t j = 0;
+		for(; j < n; j++)
+		{
+			delete new CPU(nullptr, image);
+		}
+	});
+	CPU *c = new CPU(nullptr, image);
+	Timing reset = measure(100, [&](uint64_t n) {
+		uint64_t j = 0;
+		for(; j < n; j++)
+		{
+			c->reset();
+		}
+	});
+	delete c;
+
+	printf("bench=instance rom_kb=%u copy_us=%.2f copy_us_median=%.2f shared_us=%.2f shared_us_median=%.2f reset_us=%.2f reset_us_median=%.2f\n",
+		(unsigned int)(rom.size() / 1024), copied.best * 1e6, copied.median * 1e6, shared.best * 1e6, shared.median * 1e6,
+		reset.best * 1e6, reset.median * 1e6);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct { const char *name; bool (*run)(); } groups[] =
+	{
+		{ "step", bench_step },
+		{ "run", bench_run },
+		{ "memory", bench_memory },
+		{ "screen", bench_screen },
+		{ "frame", bench_frame },
+		{ "instance", bench_instance }
+	};
+	const size_t num_groups = sizeof(groups) / sizeof(groups[0]);
+	std::vector<bool> selected(num_groups, false);
+	bool any = false;
+
+	int i = 1;
+	for(; i < argc; i++)
+	{
+		size_t g = 0;
+		while(g < num_groups && strcmp(argv[i], groups[g].name) != 0)
+		{
+			g++;
+		}
+
+		if(!strcmp(argv[i], "-t") && i + 1 < argc)
+		{
+			seconds_per_run = atof(argv[++i]);
+		}
+		else if(!strcmp(argv[i], "-r") && i + 1 < argc)
+		{
+			repeats = atoi(argv[++i]) > 0 ? atoi(argv[i]) : 1;
+		}
+		else if(g < num_groups)
+		{
+			selected[g] = any = true;
+		}
+		else
+		{
+			printf("usage: %s [-t seconds] [-r repeats] [step|run|memory|screen|frame|instance...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	printf("bench=build engine=%s kernels=%s profile=%d flags=%s seconds=%.2f repeats=%d\n", engine(), pixels::best().name,
+#ifdef GP_PROFILE
+		1,
+#else
+		0,
+#endif
+#ifdef GP_EAGER_FLAGS
+		"eager",
+#else
+		"lazy",
+#endif
+		seconds_per_run, repeats);
+
+	bool ok = true;
+	size_t g = 0;
+	for(; g < num_groups; g++)
+	{
+		if(!any || selected[g])
+		{
+			try
+			{
+				ok = groups[g].run() && ok;
+			}
+			catch(util::LoadException &e)
+			{
+				printf("%s\n", e.what());
+				return 1;
+			}
+		}
+	}
+	return !ok;
+}
@@ -0,0 +1,164 @@
+// Times each set of pixel kernels this CPU can run: decoding tiles,
+// expanding a scanline of colour indices to 8, 16 and 32-bit pixels, drawing
+// whole scanlines with GBScreen, and converting its frame to each Format.
+// Every set's output is checked against plain C.
+//
+// usage: GamePersonPixelBench [-n iterations]
+//
+// Prints one line of key=value pairs per kernel set.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "pixels.h"
+#include "screen.h"
+#include "util.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double nanos(bench_clock::time_point start, int n)
+{
+	return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count() / n;
+}
+
+int main(int argc, char **argv)
+{
+	int iterations = 20000;
+
+	int i = 1;
+	for(; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "-n") && i + 1 < argc)
+		{
+			iterations = atoi(argv[++i]);
+		}
+		else
+		{
+			printf("usage: %s [-n iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	std::vector<uint8_t> vram(0x2000);
+	srand(1);
+	for(i = 0; i < 0x2000; i++)
+	{
+		vram[i] = rand();
+	}
+
+	uint8_t indices[160];
+	for(i = 0; i < 160; i++)
+	{
+		indices[i] = rand() & 3;
+	}
+	const uint8_t palette8[4] = { 0, 1, 2, 3 };
+	const uint16_t palette16[4] = { 0xffff, 0xad55, 0x8c51, 0x0000 };
+	const uint32_t palette32[4] = { 0xffffffff, 0xffaaaaaa, 0xff888888, 0xff000000 };
+	const pixels::Format *formats[3] = { &pixels::GRAY8, &pixels::RGB565, &pixels::ARGB8888 };
+
+	std::vector<const pixels::Kernels*> sets = pixels::available();
+	uint64_t ref_tiles = 0, ref_line = 0, ref_frame = 0, ref_convert = 0;
+	bool all_match = true;
+
+	size_t s = 0;
+	for(; s < sets.size(); s++)
+	{
+		const pixels::Kernels *k = sets[s];
+		uint8_t tiles[NUM_TILES][64];
+		uint8_t line8[160];
+		uint16_t line16[160];
+		uint32_t line32[160];
+
+		bench_clock::time_point start = bench_clock::now();
+		int n = 0;
+		for(; n < iterations / 10; n++)
+		{
+			for(i = 0; i < NUM_TILES; i++)
+			{
+				k->decode_tile(&vram[i * 16], tiles[i]);
+			}
+		}
+		double decode = nanos(start, (iterations / 10) * NUM_TILES);
+		uint64_t tiles_hash = util::hash_buffer(&tiles[0][0], sizeof(tiles));
+
+		// Each call feeds the next, to keep them from being folded together.
+		start = bench_clock::now();
+		for(n = 0; n < iterations; n++)
+		{
+			k->expand8(indices, palette8, line8, 160);
+			indices[n % 160] ^= line8[n % 160] & 1;
+		}
+		double expand8 = nanos(start, iterations);
+		start = bench_clock::now();
+		for(n = 0; n < iterations; n++)
+		{
+			k->expand16(indices, palette16, line16, 160);
+			indices[n % 160] ^= line16[n % 160] & 1;
+		}
+		double expand16 = nanos(start, iterations);
+		start = bench_clock::now();
+		for(n = 0; n < iterations; n++)
+		{
+			k->expand32(indices, palette32, line32, 160);
+			indices[n % 160] ^= line32[n % 160] & 1;
+		}
+		double expand32 = nanos(start, iterations);
+		k->expand8(indices, palette8, line8, 160);
+		k->expand16(indices, palette16, line16, 160);
+		k->expand32(indices, palette32, line32, 160);
+		uint64_t line_hash = util::hash_buffer(line8, sizeof(line8));
+		line_hash = util::hash_buffer((uint8_t*)line16, sizeof(line16), line_hash);
+		line_hash = util::hash_buffer((uint8_t*)line32, sizeof(line32), line_hash);
+
+		// Whole scanlines through the screen, tile cache warm.
+		GBScreen screen(vram.data());
+		screen.kernels = k;
+		screen.write(0xff47, 0xe4);
+		screen.write(0xff40, 0x91);
+		screen.write(0xff43, 3);
+		screen.refresh();
+		start = bench_clock::now();
+		for(n = 0; n < iterations; n++)
+		{
+			screen.render_line(n % VBLANK_START);
+		}
+		double scanline = nanos(start, iterations);
+		uint64_t frame_hash = util::hash_buffer(screen.fb, 160 * 144);
+
+		// The frame to each format, as a frontend would to show it.
+		std::vector<uint32_t> out(160 * 144);
+		double convert[3];
+		uint64_t convert_hash = 0;
+		int f = 0;
+		for(; f < 3; f++)
+		{
+			start = bench_clock::now();
+			for(n = 0; n < iterations / VBLANK_START; n++)
+			{
+				screen.convert(*formats[f], out.data());
+			}
+			convert[f] = nanos(start, iterations / VBLANK_START);
+			convert_hash = util::hash_buffer((uint8_t*)out.data(), 160 * 144 * formats[f]->bytes, convert_hash);
+		}
+
+		if(s == 0)
+		{
+			ref_tiles = tiles_hash;
+			ref_line = line_hash;
+			ref_frame = frame_hash;
+			ref_convert = convert_hash;
+		}
+		bool match = tiles_hash == ref_tiles && line_hash == ref_line && frame_hash == ref_frame && convert_hash == ref_convert;
+		all_match = all_match && match;
+
+		printf("bench=pixels kernels=%s decode_tile_ns=%.2f expand8_line_ns=%.2f expand16_line_ns=%.2f expand32_line_ns=%.2f render_line_ns=%.2f "
+			"convert_gray8_us=%.2f convert_rgb565_us=%.2f convert_argb8888_us=%.2f match=%d%s\n",
+			k->name, decode, expand8, expand16, expand32, scanline, convert[0] / 1000, convert[1] / 1000, convert[2] / 1000,
+			match, k == &pixels::best() ? " selected=1" : "");
+	}
+
+	return !all_match;
+}
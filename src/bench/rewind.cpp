@@ -0,0 +1,151 @@
+// Measures the rewind buffer: what a minute of history costs in memory, and
+// how long recording a frame and going back take.
+//
+// usage: GamePersonRewindBench [-f frames] [-m ring MB] [-k keyframe interval] [rom [bios]]
+//
+// Without a ROM, runs the synthetic workload. The BIOS defaults to gb.bios. Prints one line of key=value
+// pairs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+#include "rewind.h"
+#include "util.h"
+#include "synthrom.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double micros(bench_clock::time_point start)
+{
+	return std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+}
+
+static uint64_t state_hash(CPU *c, std::vector<uint8_t> &buf)
+{
+	c->save_state(buf.data(), buf.size());
+	return util::hash_buffer(buf.data(), buf.size());
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int frames = 60 * 60;
+	size_t ring_mb = 64;
+	unsigned int keyframe_interval = 60;
+	const char *rom = nullptr;
+	const char *bios = nullptr;
+
+	int i = 1;
+	for(; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "-f") && i + 1 < argc)
+		{
+			frames = atoi(argv[++i]);
+		}
+		else if(!strcmp(argv[i], "-m") && i + 1 < argc)
+		{
+			ring_mb = atoi(argv[++i]);
+		}
+		else if(!strcmp(argv[i], "-k") && i + 1 < argc)
+		{
+			keyframe_interval = atoi(argv[++i]);
+		}
+		else if(argv[i][0] != '-' && rom == nullptr)
+		{
+			rom = argv[i];
+		}
+		else if(argv[i][0] != '-' && bios == nullptr)
+		{
+			bios = argv[i];
+		}
+		else
+		{
+			printf("usage: %s [-f frames] [-m ring MB] [-k keyframe interval] [rom [bios]]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	CPU *c;
+	try
+	{
+		if(rom != nullptr)
+		{
+			c = new CPU(bios != nullptr ? bios : "gb.bios", rom);
+		}
+		else
+		{
+			std::vector<uint8_t> cart = synthrom::workload();
+			c = new CPU(nullptr, cart.data(), cart.size());
+		}
+	}
+	catch(util::LoadException &e)
+	{
+		printf("%s\n", e.what());
+		return 1;
+	}
+
+	RewindBuffer rewind(c, ring_mb << 20, frames, keyframe_interval);
+	std::vector<uint8_t> buf(c->save_state_size());
+	std::vector<uint64_t> hashes;
+
+	// Record, keeping a hash of every frame to check going back against.
+	double push = 0;
+	unsigned int f = 0;
+	for(; f < frames; f++)
+	{
+		if(c->run_frame())
+		{
+			break;
+		}
+		hashes.push_back(state_hash(c, buf));
+
+		bench_clock::time_point start = bench_clock::now();
+		rewind.push();
+		push += micros(start);
+	}
+	frames = f;
+
+	size_t used = rewind.memory_used();
+	unsigned int held = rewind.frames();
+	unsigned int oldest = frames - 1 - held; // the frame going all the way back reaches
+	bool match = true;
+
+	// A long seek, a short one, then single steps the rest of the way.
+	double seek_long = 0, seek_short = 0;
+	unsigned int long_frames = 600 < held / 2 ? 600 : held / 2;
+	bench_clock::time_point start = bench_clock::now();
+	rewind.seek_back(long_frames);
+	seek_long = micros(start);
+	match = match && state_hash(c, buf) == hashes[oldest + rewind.frames()];
+
+	unsigned int short_frames = 60 < rewind.frames() / 2 ? 60 : rewind.frames() / 2;
+	start = bench_clock::now();
+	rewind.seek_back(short_frames);
+	seek_short = micros(start);
+	match = match && state_hash(c, buf) == hashes[oldest + rewind.frames()];
+
+	double step = 0;
+	unsigned int steps = 0;
+	while(rewind.frames() > 0)
+	{
+		start = bench_clock::now();
+		rewind.step_back();
+		step += micros(start);
+		steps++;
+		match = match && state_hash(c, buf) == hashes[oldest + rewind.frames()];
+	}
+
+	double per_frame = held > 0 ? (double)used / held : 0;
+	printf("bench=rewind rom=%s frames=%u held=%u state_bytes=%zu keyframe_interval=%u bytes_used=%zu bytes_per_frame=%.1f "
+		"mb_per_minute=%.3f push_us=%.2f step_back_us=%.2f seek_%u_us=%.2f seek_%u_us=%.2f match=%d\n",
+		rom != nullptr ? rom : "synthetic", frames, held, buf.size(), keyframe_interval, used, per_frame,
+		per_frame * 60 * 60 / (1024 * 1024), frames > 0 ? push / frames : 0.0, steps > 0 ? step / steps : 0.0,
+		long_frames, seek_long, short_frames, seek_short, match);
+
+	delete c;
+	return !match;
+}
@@ -0,0 +1,186 @@
+#include "synthrom.h"
+#include "util.h"
+
+#define CODE_START 0x150
+
+RomBuilder::RomBuilder()
+{
+}
+
+uint16_t RomBuilder::here()
+{
+	return CODE_START + code.size();
+}
+
+void RomBuilder::emit(std::initializer_list<uint8_t> bytes)
+{
+	code.insert(code.end(), bytes);
+}
+
+void RomBuilder::label(std::string name)
+{
+	labels[name] = here();
+}
+
+void RomBuilder::jr(uint8_t op, std::string target)
+{
+	code.push_back(op);
+	fixups.push_back(Fixup { code.size(), target, true });
+	code.push_back(0);
+}
+
+void RomBuilder::abs(uint8_t op, std::string target)
+{
+	code.push_back(op);
+	fixups.push_back(Fixup { code.size(), target, false });
+	code.push_back(0);
+	code.push_back(0);
+}
+
+std::vector<uint8_t> RomBuilder::build(size_t size)
+{
+	size_t i = 0;
+	for(; i < fixups.size(); i++)
+	{
+		Fixup &fix = fixups[i];
+		if(labels.count(fix.target) == 0)
+		{
+			throw util::LoadException("synthetic rom: no label '" + fix.target + "'");
+		}
+
+		uint16_t target = labels[fix.target];
+		if(fix.relative)
+		{
+			int ofs = target - (CODE_START + (int)fix.at + 1);
+			if(ofs < -128 || ofs > 127)
+			{
+				throw util::LoadException("synthetic rom: jr to '" + fix.target + "' is out of range");
+			}
+			code[fix.at] = (uint8_t)ofs;
+		}
+		else
+		{
+			code[fix.at] = target & 0xff;
+			code[fix.at + 1] = target >> 8;
+		}
+	}
+
+	if(CODE_START + code.size() > size)
+	{
+		throw util::LoadException("synthetic rom: code doesn't fit");
+	}
+
+	std::vector<uint8_t> rom(size, 0);
+	rom[0x100] = 0xc3; // jp CODE_START
+	rom[0x101] = CODE_START & 0xff;
+	rom[0x102] = CODE_START >> 8;
+	std::copy(code.begin(), code.end(), rom.begin() + CODE_START);
+	return rom;
+}
+
+std::vector<uint8_t> synthrom::workload()
+{
+	RomBuilder rom;
+	rom.emit({ 0x31, 0xfe, 0xdf }); // ld sp, 0xdffe
+
+	rom.label("start");
+	rom.emit({ 0x21, 0x00, 0xc0, 0x06, 0x20 }); // ld hl, 0xc000; ld b, 0x20
+	rom.label("fill");
+	rom.emit({ 0x78, 0x22, 0x05 }); // ld a, b; ldi (hl), a; dec b
+	rom.jr(0x20, "fill");
+
+	rom.emit({ 0x11, 0x00, 0xc0, 0x0e, 0x10, 0x21, 0x80, 0xc0 }); // ld de, 0xc000; ld c, 0x10; ld hl, 0xc080
+	rom.label("mix");
+	rom.emit({ 0x1a, 0x86, 0x77, 0x23, 0x13 }); // ld a, (de); add a, (hl); ld (hl), a; inc hl; inc de
+	rom.abs(0xcd, "scramble");
+	rom.emit({ 0x0d }); // dec c
+	rom.jr(0x20, "mix");
+
+	rom.emit({ 0xfa, 0x00, 0xd0, 0x47, 0x04 }); // ld a, (0xd000); ld b, a; inc b
+	rom.label("spin");
+	rom.emit({ 0x05 }); // dec b
+	rom.jr(0x20, "spin");
+	rom.jr(0x18, "start");
+
+	rom.label("scramble");
+	rom.emit({ 0xc5, 0x47, 0xcb, 0x37, 0xa9 }); // push bc; ld b, a; swap a; xor c
+	rom.emit({ 0xcb, 0x11, 0xcb, 0x19, 0xe6, 0x0f, 0xb0 }); // rl c; rr c; and 0x0f; or b
+	rom.emit({ 0xc1, 0xf5, 0xf1, 0xc9 }); // pop bc; push af; pop af; ret
+
+	return rom.build();
+}
+
+std::vector<std::string> synthrom::mixes()
+{
+	return { "alu", "memory", "branch", "cb" };
+}
+
+std::vector<uint8_t> synthrom::mix(const std::string &name)
+{
+	RomBuilder rom;
+	rom.emit({ 0x31, 0xfe, 0xdf }); // ld sp, 0xdffe
+	rom.emit({ 0x3e, 0xe4, 0xe0, 0x47, 0x3e, 0x91, 0xe0, 0x40 }); // ld a, 0xe4; ldh (0x47), a; ld a, 0x91; ldh (0x40), a
+
+	if(name == "alu")
+	{
+		rom.emit({ 0x0e, 0x5a }); // ld c, 0x5a
+		rom.label("start");
+		rom.emit({ 0x06, 0x80 }); // ld b, 0x80
+		rom.label("loop");
+		rom.emit({ 0x78, 0xa9, 0xa1, 0xb0, 0x2f, 0x90, 0x17 }); // ld a, b; xor c; and c; or b; cpl; sub b; rla
+		rom.emit({ 0x4f, 0x0c, 0x3d, 0xe6, 0x7f, 0xfe, 0x55, 0xb1 }); // ld c, a; inc c; dec a; and 0x7f; cp 0x55; or c
+		rom.emit({ 0x05 }); // dec b
+		rom.jr(0x20, "loop");
+		rom.jr(0x18, "start");
+	}
+	else if(name == "memory")
+	{
+		rom.emit({ 0x3e, 0x0a, 0xea, 0x00, 0x00 }); // ld a, 0x0a; ld (0x0000), a: cartridge RAM on
+		rom.label("start");
+		rom.emit({ 0x21, 0x00, 0xc0, 0x11, 0x00, 0xa0, 0x06, 0x80 }); // ld hl, 0xc000; ld de, 0xa000; ld b, 0x80
+		rom.label("loop");
+		rom.emit({ 0x1a, 0x2f, 0x77, 0x7e, 0x22, 0x12, 0x13 }); // ld a, (de); cpl; ld (hl), a; ld a, (hl); ldi (hl), a; ld (de), a; inc de
+		rom.emit({ 0xe0, 0x80, 0xf0, 0x80, 0xea, 0x00, 0xd8, 0xfa, 0x00, 0xd8 }); // ldh (0x80), a; ldh a, (0x80); ld (0xd800), a; ld a, (0xd800)
+		rom.emit({ 0x05 }); // dec b
+		rom.jr(0x20, "loop");
+		rom.jr(0x18, "start");
+	}
+	else if(name == "branch")
+	{
+		rom.label("start");
+		rom.emit({ 0x0e, 0x80 }); // ld c, 0x80
+		rom.label("loop");
+		rom.abs(0xcd, "sub"); // call sub
+		rom.emit({ 0xc5, 0xd1 }); // push bc; pop de
+		rom.abs(0xc3, "next"); // jp next
+		rom.label("next");
+		rom.abs(0x21, "back"); // ld hl, back
+		rom.emit({ 0xe9 }); // jp (hl)
+		rom.label("back");
+		rom.emit({ 0x0d }); // dec c
+		rom.jr(0x20, "loop");
+		rom.jr(0x18, "start");
+		rom.label("sub");
+		rom.emit({ 0xe5, 0xe1, 0xc9 }); // push hl; pop hl; ret
+	}
+	else if(name == "cb")
+	{
+		rom.label("start");
+		rom.emit({ 0x16, 0x80 }); // ld d, 0x80
+		rom.label("loop");
+		rom.emit({ 0xcb, 0x37, 0xcb, 0x11, 0xcb, 0x18, 0xcb, 0x7c }); // swap a; rl c; rr b; bit 7, h
+		rom.emit({ 0xcb, 0xdf, 0xcb, 0x9f, 0xcb, 0xc4, 0xcb, 0x84 }); // set 3, a; res 3, a; set 0, h; res 0, h
+		rom.emit({ 0x15 }); // dec d
+		rom.jr(0x20, "loop");
+		rom.jr(0x18, "start");
+	}
+	else
+	{
+		throw util::LoadException("synthetic rom: no mix called '" + name + "'");
+	}
+
+	std::vector<uint8_t> cart = rom.build();
+	cart[0x147] = 0x03; // MBC1+RAM+battery
+	cart[0x149] = 0x02; // 8KB
+	return cart;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <vector>
+
+// Assembles small cartridges in memory, so benchmarks don't depend on ROM
+// files. Code starts at 0x150, with the usual jp there at the 0x100 entry
+// point, and the cartridge is meant to be run without a BIOS.
+class RomBuilder
+{
+public:
+	RomBuilder();
+
+	void emit(std::initializer_list<uint8_t> bytes);
+	void label(std::string name);
+
+	void jr(uint8_t op, std::string target); // jr/jr nz/jr z to a label
+	void abs(uint8_t op, std::string target); // jp/call to a label
+
+	std::vector<uint8_t> build(size_t size = 0x8000);
+
+private:
+	struct Fixup
+	{
+		size_t at;
+		std::string target;
+		bool relative;
+	};
+
+	std::vector<uint8_t> code;
+	std::map<std::string, uint16_t> labels;
+	std::vector<Fixup> fixups;
+
+	uint16_t here();
+};
+
+namespace synthrom
+{
+	// A loop of register, ALU, memory and call/stack work that never stops.
+	// Each pass also spins for (0xd000) extra iterations, so poking different
+	// values there makes otherwise identical machines diverge.
+	std::vector<uint8_t> workload();
+
+	// Loops that each lean on one kind of instruction, for timing the CPU
+	// on: "alu", "memory", "branch" and "cb". They switch the LCD on first,
+	// so running whole frames of them draws too. The cartridge is an MBC1
+	// with 8KB of RAM.
+	std::vector<std::string> mixes();
+	std::vector<uint8_t> mix(const std::string &name);
+}
@@ -0,0 +1,206 @@
+#include "cartridge.h"
+#include "savestate.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+GBCartridge::GBCartridge(const uint8_t *rom, size_t rom_size)
+{
+	uint8_t type = rom_size > 0x147 ? rom[0x147] : 0;
+	uint8_t ram_code = rom_size > 0x149 ? rom[0x149] : 0;
+
+	if(type >= 0x01 && type <= 0x03)
+	{
+		mapper = MBC1;
+	}
+	else if(type >= 0x0f && type <= 0x13)
+	{
+		mapper = MBC3;
+	}
+	else if(type >= 0x19 && type <= 0x1e)
+	{
+		mapper = MBC5;
+	}
+	else
+	{
+		if(type != 0x00 && type != 0x08 && type != 0x09)
+		{
+			printf("unsupported cartridge type %02x, running it without a mapper\n", type);
+		}
+		mapper = NONE;
+	}
+
+	static const size_t ram_sizes[6] = { 0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000 };
+	ram_size = ram_code < 6 ? ram_sizes[ram_code] : 0;
+	ram = nullptr;
+	if(ram_size != 0)
+	{
+		ram = (uint8_t*)malloc(ram_size);
+		memset(ram, 0xff, ram_size);
+	}
+	ram_banks = ram_size > 0x2000 ? ram_size / 0x2000 : 1;
+
+	rom_banks = 2;
+	while(rom_banks * 0x4000 < rom_size)
+	{
+		rom_banks *= 2;
+	}
+
+	ram_enable = mapper == NONE; // without a mapper, there's nothing to enable it with
+	rom_bank = 1;
+	ram_bank = 0;
+	mode = 0;
+	memset(rtc, 0, sizeof(rtc));
+}
+
+GBCartridge::~GBCartridge()
+{
+	free(ram);
+}
+
+bool GBCartridge::write(uint16_t virt, uint8_t v)
+{
+	if(mapper == NONE)
+	{
+		return false;
+	}
+
+	size_t old_size, new_size;
+	size_t old_low = rom_offset(0), old_high = rom_offset(1);
+	uint8_t *old_ram = ram_window(old_size);
+
+	if(virt < 0x2000)
+	{
+		ram_enable = (v & 0xf) == 0xa;
+	}
+	else if(virt < 0x4000)
+	{
+		if(mapper == MBC1)
+		{
+			rom_bank = (v & 0x1f) != 0 ? v & 0x1f : 1;
+		}
+		else if(mapper == MBC3)
+		{
+			rom_bank = (v & 0x7f) != 0 ? v & 0x7f : 1;
+		}
+		else if(virt < 0x3000) // MBC5, low eight bits
+		{
+			rom_bank = (rom_bank & 0x100) | v;
+		}
+		else // MBC5, ninth bit
+		{
+			rom_bank = (rom_bank & 0xff) | ((v & 1) << 8);
+		}
+	}
+	else if(virt < 0x6000)
+	{
+		ram_bank = mapper == MBC1 ? v & 3 : v & 0xf;
+	}
+	else if(mapper == MBC1)
+	{
+		mode = v & 1;
+	}
+	// MBC3 latches its clock through 6000-7fff, which only matters to a clock that runs.
+
+	uint8_t *new_ram = ram_window(new_size);
+	return rom_offset(0) != old_low || rom_offset(1) != old_high || new_ram != old_ram;
+}
+
+size_t GBCartridge::rom_offset(int window)
+{
+	size_t bank;
+	if(window == 0)
+	{
+		bank = mapper == MBC1 && mode == 1 ? ram_bank << 5 : 0;
+	}
+	else if(mapper == NONE)
+	{
+		bank = 1;
+	}
+	else if(mapper == MBC1)
+	{
+		bank = (ram_bank << 5) | rom_bank;
+	}
+	else
+	{
+		bank = rom_bank;
+	}
+	return (bank & (rom_banks - 1)) * 0x4000;
+}
+
+uint8_t *GBCartridge::ram_window(size_t &size)
+{
+	size = 0;
+	if(!ram_enable || ram == nullptr || (mapper == MBC3 && ram_bank >= 8))
+	{
+		return nullptr;
+	}
+
+	size_t bank = ram_bank;
+	if(mapper == MBC1 && mode == 0)
+	{
+		bank = 0;
+	}
+	else if(mapper == NONE)
+	{
+		bank = 0;
+	}
+
+	size = ram_size < 0x2000 ? ram_size : 0x2000;
+	return ram + (bank & (ram_banks - 1)) * 0x2000;
+}
+
+uint8_t GBCartridge::read_ram(uint16_t virt)
+{
+	size_t size;
+	uint8_t *window = ram_window(size);
+	if(window != nullptr && (size_t)(virt - 0xa000) < size)
+	{
+		return window[virt - 0xa000];
+	}
+	else if(mapper == MBC3 && ram_enable && ram_bank >= 8 && ram_bank <= 0xc)
+	{
+		return rtc[ram_bank - 8];
+	}
+	return 0xff;
+}
+
+void GBCartridge::write_ram(uint16_t virt, uint8_t v)
+{
+	size_t size;
+	uint8_t *window = ram_window(size);
+	if(window != nullptr && (size_t)(virt - 0xa000) < size)
+	{
+		window[virt - 0xa000] = v;
+	}
+	else if(mapper == MBC3 && ram_enable && ram_bank >= 8 && ram_bank <= 0xc)
+	{
+		rtc[ram_bank - 8] = v;
+	}
+}
+
+void GBCartridge::save_state(StateWriter &w)
+{
+	if(ram_size != 0)
+	{
+		w.put(ram, ram_size);
+	}
+	w.put(ram_enable);
+	w.put(rom_bank);
+	w.put(ram_bank);
+	w.put(mode);
+	w.put(rtc, sizeof(rtc));
+}
+
+void GBCartridge::load_state(StateReader &r)
+{
+	if(ram_size != 0)
+	{
+		r.get(ram, ram_size);
+	}
+	r.get(ram_enable);
+	r.get(rom_bank);
+	r.get(ram_bank);
+	r.get(mode);
+	r.get(rtc, sizeof(rtc));
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+class StateWriter;
+class StateReader;
+
+// The memory bank controller and external RAM, picked from the cartridge
+// header. Nothing here copies banks around: a bank switch only changes the
+// offsets below, and the CPU points its page table at the new banks, so
+// banked ROM and RAM read as fast as any other memory.
+//
+// MBC3's clock registers can be selected, read and written, but don't tick.
+class GBCartridge
+{
+public:
+	GBCartridge(const uint8_t *rom, size_t rom_size);
+	~GBCartridge();
+
+	enum Mapper
+	{
+		NONE,
+		MBC1,
+		MBC3,
+		MBC5
+	};
+
+	Mapper mapper;
+
+	// A write to the control registers at 0x0000-0x7fff. Returns true if
+	// different banks are mapped now.
+	bool write(uint16_t virt, uint8_t v);
+
+	// Where in the ROM the bank at 0x0000-0x3fff (window 0) or 0x4000-0x7fff
+	// (window 1) starts. May be past the end of an undersized image.
+	size_t rom_offset(int window);
+
+	// The external RAM mapped at 0xa000, of which size bytes are backed, or
+	// nullptr while it's disabled or a clock register is selected.
+	uint8_t *ram_window(size_t &size);
+
+	// 0xa000-0xbfff accesses the page table doesn't cover.
+	uint8_t read_ram(uint16_t virt);
+	void write_ram(uint16_t virt, uint8_t v);
+
+	void save_state(StateWriter &w);
+	void load_state(StateReader &r);
+
+	uint8_t *ram;
+	size_t ram_size;
+
+private:
+	size_t rom_banks; // a power of two, so bank numbers wrap with a mask
+	size_t ram_banks;
+
+	bool ram_enable;
+	uint16_t rom_bank; // as written; MBC1 keeps its upper two bits in ram_bank
+	uint8_t ram_bank;
+	uint8_t mode; // MBC1 banking mode
+	uint8_t rtc[5]; // MBC3 seconds, minutes, hours, day low, day high
+};
@@ -0,0 +1,179 @@
+#include "blockcache.h"
+#include <string.h>
+
+const uint8_t op_length[0x100] =
+{
+	1,3,1,1,1,1,2,1,3,1,1,1,1,1,2,1, // 0x00
+	2,3,1,1,1,1,2,1,2,1,1,1,1,1,2,1, // 0x10
+	2,3,1,1,1,1,2,1,2,1,1,1,1,1,2,1, // 0x20
+	2,3,1,1,1,1,2,1,2,1,1,1,1,1,2,1, // 0x30
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0x40
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0x50
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0x60
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0x70
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0x80
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0x90
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0xa0
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0xb0
+	1,1,3,3,3,1,2,1,1,1,3,2,3,3,2,1, // 0xc0
+	1,1,3,1,3,1,2,1,1,1,3,1,3,1,2,1, // 0xd0
+	2,1,1,1,1,1,2,1,2,1,3,1,1,1,2,1, // 0xe0
+	2,1,1,1,1,1,2,1,2,1,3,1,1,1,2,1  // 0xf0
+};
+
+// Does the instruction end a block? Anything that may change pc other than by
+// falling through, plus the illegal opcodes, which stop emulation.
+static bool ends_block(uint8_t op)
+{
+	switch(op)
+	{
+		case 0x10: // stop
+		case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // jr
+		case 0x76: // halt
+		case 0xc0: case 0xc8: case 0xc9: case 0xd0: case 0xd8: case 0xd9: // ret, reti
+		case 0xc2: case 0xc3: case 0xca: case 0xd2: case 0xda: case 0xe9: // jp
+		case 0xc4: case 0xcc: case 0xcd: case 0xd4: case 0xdc: // call
+		case 0xc7: case 0xcf: case 0xd7: case 0xdf: case 0xe7: case 0xef: case 0xf7: case 0xff: // rst
+		case 0xd3: case 0xdb: case 0xdd: case 0xe3: case 0xe4: case 0xeb: case 0xec: case 0xed: case 0xf4: case 0xfc: case 0xfd:
+		case 0xf3: case 0xfb: // di, ei
+			return true;
+		default:
+			return false;
+	}
+}
+
+BlockCache::BlockCache()
+{
+	memset(recent_host, 0, sizeof(recent_host));
+	memset(recent, 0, sizeof(recent));
+}
+
+BlockCache::~BlockCache()
+{
+	clear();
+}
+
+void BlockCache::clear()
+{
+	std::unordered_map<uint8_t*, Page*>::iterator it = pages.begin();
+	for(; it != pages.end(); it++)
+	{
+		int i = 0;
+		for(; i < 0x100; i++)
+		{
+			delete it->second->entry[i];
+		}
+		delete it->second;
+	}
+	pages.clear();
+	flush_retired();
+
+	memset(recent_host, 0, sizeof(recent_host));
+	memset(recent, 0, sizeof(recent));
+}
+
+Block *BlockCache::find(uint8_t *host_page, uint16_t pc)
+{
+	uint8_t idx = pc >> 8;
+	if(recent_host[idx] != host_page)
+	{
+		std::unordered_map<uint8_t*, Page*>::iterator it = pages.find(host_page);
+		if(it == pages.end())
+		{
+			return nullptr;
+		}
+		recent_host[idx] = host_page;
+		recent[idx] = it->second;
+	}
+
+	return recent[idx]->entry[pc & 0xff];
+}
+
+Block *BlockCache::decode(uint8_t *host_page, uint16_t pc)
+{
+	Block *b = new Block;
+	unsigned int ofs = pc & 0xff;
+
+	while(ofs < 0x100)
+	{
+		uint8_t op = host_page[ofs];
+		unsigned int len = op_length[op];
+
+		if(ofs + len > 0x100) // operands are in the next page
+		{
+			break;
+		}
+
+		MicroOp u;
+		u.op = op;
+		u.imm8 = len > 1 ? host_page[ofs + 1] : 0;
+		u.imm16 = len > 2 ? host_page[ofs + 1] | (host_page[ofs + 2] << 8) : 0;
+		b->ops.push_back(u);
+
+		ofs += len;
+		if(ends_block(op))
+		{
+			break;
+		}
+	}
+
+	if(b->ops.empty())
+	{
+		delete b;
+		return nullptr;
+	}
+
+	MicroOp end;
+	end.op = MicroOp::BLOCK_END;
+	end.imm8 = 0;
+	end.imm16 = 0;
+	b->ops.push_back(end);
+
+	Page *&p = pages[host_page];
+	if(p == nullptr)
+	{
+		p = new Page;
+		memset(p->entry, 0, sizeof(p->entry));
+	}
+	p->entry[pc & 0xff] = b;
+
+	return b;
+}
+
+void BlockCache::invalidate(uint8_t *host_page)
+{
+	std::unordered_map<uint8_t*, Page*>::iterator it = pages.find(host_page);
+	if(it == pages.end())
+	{
+		return;
+	}
+
+	int i = 0;
+	for(; i < 0x100; i++)
+	{
+		if(it->second->entry[i] != nullptr)
+		{
+			retired.push_back(it->second->entry[i]);
+		}
+	}
+	delete it->second;
+	pages.erase(it);
+
+	for(i = 0; i < 0x100; i++)
+	{
+		if(recent_host[i] == host_page)
+		{
+			recent_host[i] = nullptr;
+		}
+	}
+}
+
+void BlockCache::flush_retired()
+{
+	size_t i = 0;
+	for(; i < retired.size(); i++)
+	{
+		delete retired[i];
+	}
+	retired.clear();
+}
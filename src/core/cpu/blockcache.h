@@ -0,0 +1,65 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+
+// Instruction lengths in bytes, by opcode; 0xcb counts its bitop as an
+// immediate. The JIT decodes with the same table.
+extern const uint8_t op_length[0x100];
+
+// One decoded instruction. op is the opcode byte, imm8/imm16 are its operands
+// as they would have been fetched from pc+1.
+struct MicroOp
+{
+	enum
+	{
+		BLOCK_END = 0x100 // sentinel after the last instruction
+	};
+
+	uint16_t op;
+	uint8_t imm8;
+	uint16_t imm16;
+};
+
+// A run of straight-line code, ending at the first instruction that can
+// change pc (or at the end of its 256-byte page).
+struct Block
+{
+	std::vector<MicroOp> ops;
+};
+
+// Decoded blocks, keyed by the host pointer of the page they were decoded
+// from. Since every ROM bank and RAM page has its own host memory, this is
+// the same as keying on (bank, pc), and remapping a page needs no flush.
+// Measured, this is no faster than threaded dispatch (slower on branchy
+// code); it's kept to compare against, not as a speedup.
+class BlockCache
+{
+public:
+	BlockCache();
+	~BlockCache();
+
+	Block *find(uint8_t *host_page, uint16_t pc);
+	Block *decode(uint8_t *host_page, uint16_t pc);
+
+	// Drop every block decoded from host_page. The blocks are only freed by
+	// flush_retired(), so one that is still executing stays valid.
+	void invalidate(uint8_t *host_page);
+	void flush_retired();
+
+	// Drop and free every block at once, when nothing is executing.
+	void clear();
+
+private:
+	struct Page
+	{
+		Block *entry[0x100];
+	};
+
+	std::unordered_map<uint8_t*, Page*> pages;
+	std::vector<Block*> retired;
+
+	// Small direct-mapped cache in front of pages, indexed by pc >> 8.
+	uint8_t *recent_host[0x100];
+	Page *recent[0x100];
+};
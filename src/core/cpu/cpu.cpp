@@ -1,1015 +1,1045 @@
 #include "cpu.h"
+#include "blockcache.h"
+#include "cartridge.h"
+#include "jit_x64.h"
+#include "profiler.h"
+#include "romimage.h"
+#include "savestate.h"
+#include "timer.h"
 #include "util.h"
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <iostream>
 
-CPU::CPU()
+// The files are mapped, and shared with any other CPU that has them open.
+CPU::CPU(std::string bios_path, std::string cart_path) : CPU(RomImage::open(bios_path), RomImage::open(cart_path))
 {
-	size_t s = util::load_buffer("gb.bios", bios);
-	if(s != 256)
+}
+
+CPU::CPU(const uint8_t *bios_data, const uint8_t *cart_data, size_t cart_size) :
+	CPU(bios_data != nullptr ? RomImage::copy(bios_data, 256) : nullptr, RomImage::copy(cart_data, cart_size))
+{
+}
+
+// The images are used as they are, however they were loaded, so any number
+// of CPUs can be made from one without touching the disk or copying it.
+CPU::CPU(std::shared_ptr<const RomImage> bios_image, std::shared_ptr<const RomImage> cart_image)
+{
+	use_images(bios_image, cart_image);
+	init();
+}
+
+void CPU::use_images(std::shared_ptr<const RomImage> new_bios, std::shared_ptr<const RomImage> new_cart)
+{
+	if(new_bios && new_bios->size() != 256)
 	{
 		throw util::LoadException("BIOS has wrong size!");
 	}
 
-	flags.bios_enabled = true;
-
-	memset(&regs, 0, sizeof(regs));
+	bios_image = new_bios;
+	bios = new_bios ? const_cast<uint8_t*>(new_bios->data()) : nullptr;
+	cart_image = new_cart;
+	cart = const_cast<uint8_t*>(new_cart->data());
+	cart_size = new_cart->size();
+}
 
+// Everything that's allocated once per CPU; power_on() sets it all up.
+void CPU::init()
+{
 	vram = (uint8_t*)malloc(0x2000);
 	wram = (uint8_t*)malloc(0x4000);
 	hram = (uint8_t*)malloc(126);
 
-	cart_size = util::load_buffer("cart.bin", cart);
+	screen = new GBScreen(vram);
+	timer = new GBTimer();
+	cartridge = nullptr;
+
+#ifdef GP_BLOCK_CACHE
+	blocks = new BlockCache();
+#else
+	blocks = nullptr;
+#endif
+
+#ifdef GP_PROFILE
+	profiler = nullptr; // power_on() makes it
+#endif
+
+	jit = nullptr;
+#ifdef GP_JIT
+	jit = new JitX64(this);
+	if(!jit->ok())
+	{
+		delete jit;
+		jit = nullptr;
+	}
+#endif
+
+	regnums[0] = &regs.bc.b;
+	regnums[1] = &regs.bc.c;
+	regnums[2] = &regs.de.d;
+	regnums[3] = &regs.de.e;
+	regnums[4] = &regs.hl.h;
+	regnums[5] = &regs.hl.l;
+	regnums[6] = nullptr; // (hl)
+	regnums[7] = &regs.af.a;
+
+	power_on();
+}
+
+void CPU::reset()
+{
+	power_on();
+}
+
+// Compiled code is only for ROM, so it's kept unless the images change.
+void CPU::reset(std::shared_ptr<const RomImage> bios_image, std::shared_ptr<const RomImage> cart_image)
+{
+	bool same = bios_image == this->bios_image && cart_image == this->cart_image;
+	use_images(bios_image, cart_image);
+#ifdef GP_JIT
+	if(jit != nullptr && !same)
+	{
+		jit->flush();
+	}
+#else
+	(void)same;
+#endif
+	power_on();
+}
+
+void CPU::power_on()
+{
+#ifdef GP_PROFILE
+	// Each run from power on is profiled on its own, as if by a new CPU, so
+	// its cycle totals, samples and ROM size always go together.
+	delete profiler;
+#endif
+
+	flags.bios_enabled = bios != nullptr;
+
+	memset(&regs, 0, sizeof(regs));
+
+	memset(vram, 0, 0x2000);
+	memset(wram, 0, 0x4000);
+	memset(hram, 0, 126);
+
 	cycles = 0;
 
-	screen = new GBScreen(vram);
+	screen->reset();
+	*timer = GBTimer();
+	delete cartridge; // its RAM goes with it, as it would without a battery
+	cartridge = new GBCartridge(cart, cart_size);
+
+	events = Scheduler();
+	frames = 0;
+	dma_source = 0;
+	dma_active = false;
+	serial_data = 0;
+	serial_control = 0;
+	serial_out.clear();
+	breakpoints = 0;
+	error.clear();
+	events.schedule(Scheduler::LINE, cycles + CYCLES_PER_LINE);
+	events.schedule(Scheduler::DRAW, cycles + OAM_CYCLES);
+
+	map_pages();
+	if(blocks != nullptr)
+	{
+		blocks->clear(); // RAM changed under them without going through write8
+	}
+
+	buttons = 0;
+	joypad_select = 0x30;
 
 	int_enable = false;
-	interrupts[VBlank] = 0;
-	interrupts[Stat] = 0;
-	interrupts[Timer] = 0;
-	interrupts[Serial] = 0;
-	interrupts[Joypad] = 0;
+	int_flags = 0;
+	int_enable_master = false;
+	old_en = false;
+	run_deadline = 0;
+
+	halted = false;
+	halted_cycles = idle_cycles = 0;
+	loop_head = 0;
+	loop_state = LOOP_NONE;
+	jit_loop_exit = false;
+
+	if(!flags.bios_enabled)
+	{
+		regs.af.full = 0x01b0;
+		regs.bc.full = 0x0013;
+		regs.de.full = 0x00d8;
+		regs.hl.full = 0x014d;
+		regs.sp = 0xfffe;
+		regs.pc = 0x0100;
+		screen->write(0xff40, 0x91);
+		screen->write(0xff47, 0xfc);
+	}
+	set_f(regs.af.f);
+
+	cart_hash = 0;
+	StateWriter counter(nullptr);
+	write_state(counter);
+	state_size = sizeof(SaveStateHeader) + counter.size;
+
+#ifdef GP_PROFILE
+	profiler = new Profiler(this);
+#endif
 }
 
 CPU::~CPU()
 {
+#ifdef GP_PROFILE
+	delete profiler;
+#endif
+
 	free(vram);
 	free(wram);
 	free(hram);
-	free(bios);
-	free(cart);
 
 	delete screen;
+	delete timer;
+	delete cartridge;
+	delete blocks;
+#ifdef GP_JIT
+	delete jit;
+#endif
 }
 
-uint8_t CPU::read8(uint16_t virt)
+void CPU::map_pages()
 {
-	if(virt < 0x100 && flags.bios_enabled)
+	memset(read_map, 0, sizeof(read_map));
+	memset(write_map, 0, sizeof(write_map));
+	memset(write_watch, 0, sizeof(write_watch));
+
+	map_cart();
+
+	size_t p = 0x80;
+	for(; p <= 0x9f; p++)
 	{
-		return bios[virt];
+		read_map[p] = write_map[p] = vram + (p - 0x80) * 0x100;
 	}
-	else if(virt <= cart_size)
+
+	for(p = 0x80; p <= 0x97; p++)
 	{
-		return cart[virt];
+		write_watch[p] = WATCH_TILES;
+		write_map[p] = nullptr;
 	}
-	else if(virt >= 0x8000 && virt <= 0x9fff)
+
+	for(p = 0xc0; p <= 0xdf; p++)
 	{
-		return vram[virt - 0x8000];
+		read_map[p] = write_map[p] = wram + (p - 0xc0) * 0x100;
 	}
-	else if(virt >= 0xc000 && virt <= 0xdfff)
+
+	for(p = 0xe0; p <= 0xfd; p++) // wram mirror
 	{
-		return wram[virt - 0xc000];
+		read_map[p] = write_map[p] = wram + (p - 0xe0) * 0x100;
 	}
-	else if(virt >= 0xe000 && virt <= 0xfdff) // wram mirror
+}
+
+// Points 0x0000-0x7fff and 0xa000-0xbfff at the banks the cartridge has
+// selected. This is all a bank switch costs; blocks and compiled code are
+// looked up by host page, so the ones for other banks stay cached.
+void CPU::map_cart()
+{
+	int window = 0;
+	for(; window < 2; window++)
 	{
-		return wram[virt - 0xe000];
+		size_t base = cartridge->rom_offset(window);
+		int p = 0;
+		for(; p < 0x40; p++)
+		{
+			size_t offset = base + p * 0x100;
+			read_map[window * 0x40 + p] = offset + 0x100 <= cart_size ? cart + offset : nullptr; // a partial last page stays on the slow path
+		}
 	}
-	else if(virt == 0xff00)
+
+	if(flags.bios_enabled)
 	{
-		return 0; // todo: joypad
+		read_map[0] = bios;
 	}
-	else if(virt >= 0xff40 && virt <= 0xff4f) // this is the LCD!
+
+	size_t size;
+	uint8_t *ram = cartridge->ram_window(size);
+	int p = 0xa0;
+	for(; p <= 0xbf; p++)
 	{
-		return screen->read(virt);
+		size_t offset = (p - 0xa0) * 0x100;
+		uint8_t *page = ram != nullptr && offset + 0x100 <= size ? ram + offset : nullptr;
+		if(read_map[p] == page)
+		{
+			continue;
+		}
+
+		if(write_watch[p] & WATCH_CODE) // writes to the old bank won't be seen from now on
+		{
+			blocks->invalidate(read_map[p]);
+		}
+		read_map[p] = write_map[p] = page;
+		write_watch[p] = 0;
 	}
-	else if(virt >= 0xff80 && virt <= 0xfffe)
+
+	run_deadline = 0; // the running code may have been switched out
+}
+
+void CPU::set_write_watch(uint8_t *host_page, uint8_t flag, bool on)
+{
+	int p = 0;
+	for(; p < 0x100; p++) // the page may be mapped more than once (echo ram)
 	{
-		return hram[virt - 0xff80];
+		if(read_map[p] != host_page)
+		{
+			continue;
+		}
+
+		if(on)
+		{
+			write_watch[p] |= flag;
+		}
+		else
+		{
+			write_watch[p] &= ~flag;
+		}
+		write_map[p] = write_watch[p] ? nullptr : host_page;
 	}
-	else if(virt == 0xffff)
+}
+
+uint8_t CPU::read8(uint16_t virt)
+{
+	uint8_t *page = read_map[virt >> 8];
+	if(page != nullptr)
 	{
-		return int_enable;
+		return page[virt & 0xff];
 	}
-	else
+	if(virt >= 0xff80 && virt != 0xffff) // HRAM, which shares its page with I/O
 	{
-		printf("unhandled read8 at %04x, pc = %04x\n", virt, regs.pc);
-		exit(0);
+		return hram[virt - 0xff80];
 	}
+	return read_slow(virt);
 }
 
 void CPU::write8(uint16_t virt, uint8_t v)
 {
-	if(virt >= 0x8000 && virt <= 0x9fff)
+	uint8_t *page = write_map[virt >> 8];
+	if(page != nullptr)
 	{
-		vram[virt - 0x8000] = v;
+		page[virt & 0xff] = v;
+		return;
 	}
-	else if(virt >= 0xc000 && virt <= 0xdfff)
+	if(virt >= 0xff80 && virt != 0xffff)
 	{
-		wram[virt - 0xc000] = v;
+		hram[virt - 0xff80] = v;
+		return;
 	}
-	else if(virt >= 0xe000 && virt <= 0xfdff) // wram mirror
+	write_slow(virt, v);
+}
+
+uint16_t CPU::read16(uint16_t virt)
+{
+	uint8_t *page = read_map[virt >> 8];
+	if(page != nullptr && (virt & 0xff) != 0xff)
 	{
-		wram[virt - 0xe000] = v;
+		return page[virt & 0xff] | (page[(virt & 0xff) + 1] << 8);
 	}
-	else if(virt >= 0xff80 && virt <= 0xfffe)
+	return read8(virt) | (read8(virt + 1) << 8);
+}
+
+void CPU::write16(uint16_t virt, uint16_t v)
+{
+	uint8_t *page = write_map[virt >> 8];
+	if(page != nullptr && (virt & 0xff) != 0xff)
 	{
-		hram[virt - 0xff80] = v;
+		page[virt & 0xff] = v & 0xff;
+		page[(virt & 0xff) + 1] = v >> 8;
+		return;
 	}
-	else if(virt >= 0xff40 && virt <= 0xff4f) // this is the LCD!
+	write8(virt, v & 0xff);
+	write8(virt + 1, v >> 8);
+}
+
+uint8_t CPU::read_slow(uint16_t virt)
+{
+	if(virt < 0x8000)
 	{
-		screen->write(virt, v);
+		size_t offset = cartridge->rom_offset(virt >> 14) + (virt & 0x3fff);
+		return offset < cart_size ? cart[offset] : 0xff;
 	}
-	else if(virt == 0xff50)
+	else if(virt >= 0xa000 && virt <= 0xbfff)
 	{
-		if(v == 1)
-		{
-			flags.bios_enabled = false;
-		}
+		return cartridge->read_ram(virt);
 	}
-	else if(virt == 0xff0f) // int flags
+	else if(virt == 0xff00) // joypad, pressed buttons read as 0
 	{
-		int_flags = v;
-		int i = 0;
-		for(; i < NUM_INTERRUPTS; i++)
+		uint8_t v = 0xcf | joypad_select;
+		if(!(joypad_select & 0x10))
 		{
-			if(v & (1 << i)) // need to queue interrupt?
-			{
-				interrupts[(InterruptType)i]++;
-			}
+			v &= ~(buttons & 0xf);
+		}
+		if(!(joypad_select & 0x20))
+		{
+			v &= ~(buttons >> 4);
 		}
+		return v;
 	}
-	else if(virt == 0xffff)
+	else if(virt >= 0xfe00 && virt <= 0xfe9f)
 	{
-		int_enable = v;
+		return dma_active ? 0xff : screen->oam[virt - 0xfe00];
 	}
-	else
+	else if(virt >= 0xfea0 && virt <= 0xfeff) // unusable
 	{
-		printf("unhandled write8 of %02x at %04x, pc = %04x\n", v, virt, regs.pc);
+		return 0xff;
 	}
-}
-
-uint16_t CPU::read16(uint16_t virt)
-{
-	if(virt < 0x100  && flags.bios_enabled)
+	else if(virt == 0xff01)
+	{
+		return serial_data;
+	}
+	else if(virt == 0xff02)
+	{
+		return serial_control | 0x7e;
+	}
+	else if(virt >= 0xff04 && virt <= 0xff07)
 	{
-		return bios[virt] | (bios[virt+1] << 8);
+		return timer->read(virt, cycles);
 	}
-	else if(virt <= cart_size)
+	else if(virt == 0xff0f)
 	{
-		return cart[virt] | (cart[virt+1] << 8);
+		return int_flags | 0xe0;
 	}
-	else if(virt >= 0x8000 && virt <= 0x9fff)
+	else if(virt == 0xff46)
 	{
-		return vram[virt - 0x8000] | (vram[virt - 0x8000 + 1] << 8);
+		return dma_source;
 	}
-	else if(virt >= 0xc000 && virt <= 0xdfff)
+	else if((virt >= 0xff10 && virt <= 0xff3f) || virt == 0xff4a || virt == 0xff4b) // sound, WY and WX
 	{
-		return wram[virt - 0xc000] | (wram[virt - 0xc000 + 1] << 8);
+		fail("unhandled read8 at %04x, pc = %04x", virt, regs.pc);
+		return 0xff;
 	}
-	else if(virt >= 0xe000 && virt <= 0xfdff) // wram mirror
+	else if(virt >= 0xff40 && virt <= 0xff4f) // this is the LCD!
 	{
-		return wram[virt - 0xe000] | (wram[virt - 0xe000 + 1] << 8);
+		return screen->read(virt, cycles);
 	}
 	else if(virt >= 0xff80 && virt <= 0xfffe)
 	{
-		return hram[virt - 0xff80] | (hram[virt - 0xff80 + 1] << 8);
+		return hram[virt - 0xff80];
 	}
-	else
+	else if(virt == 0xffff)
 	{
-		printf("unhandled read16 at %04x, pc = %04x\n", virt, regs.pc);
-		exit(0);
+		return int_enable;
+	}
+	else // nothing there
+	{
+		return 0xff;
 	}
 }
 
-void CPU::write16(uint16_t virt, uint16_t v)
+void CPU::write_slow(uint16_t virt, uint8_t v)
 {
-	if(virt >= 0x8000 && virt <= 0x9fff)
+	uint8_t p = virt >> 8;
+	if(write_watch[p] != 0)
+	{
+		uint8_t *page = read_map[p];
+		if(write_watch[p] & WATCH_CODE) // self-modifying code
+		{
+			blocks->invalidate(page);
+			set_write_watch(page, WATCH_CODE, false);
+			run_deadline = 0; // the running block may be one we just dropped
+		}
+		if(write_watch[p] & WATCH_TILES)
+		{
+			screen->tile_written(virt - 0x8000);
+		}
+		page[virt & 0xff] = v;
+	}
+	else if(virt >= 0xff80 && virt <= 0xfffe)
 	{
-		vram[virt - 0x8000] = v & 0xff;
-		vram[virt - 0x8000 + 1] = v >> 8;
+		hram[virt - 0xff80] = v;
 	}
-	else if(virt >= 0xc000 && virt <= 0xdfff)
+	else if(virt < 0x8000) // bank switching
 	{
-		wram[virt - 0xc000] = v & 0xff;
-		wram[virt - 0xc000 + 1] = v >> 8;
+		if(cartridge->write(virt, v))
+		{
+			map_cart();
+		}
 	}
-	else if(virt >= 0xe000 && virt <= 0xfdff) // wram mirror
+	else if(virt >= 0xa000 && virt <= 0xbfff)
 	{
-		wram[virt - 0xe000] = v & 0xff;
-		wram[virt - 0xe000 + 1] = v >> 8;
+		cartridge->write_ram(virt, v);
 	}
-	else if(virt >= 0xff80 && virt <= 0xfffe)
+	else if(virt >= 0xfe00 && virt <= 0xfe9f)
 	{
-		hram[virt - 0xff80] = v & 0xff;
-		hram[virt - 0xff80 + 1] = v >> 8;
+		if(!dma_active)
+		{
+			screen->oam[virt - 0xfe00] = v;
+		}
 	}
-	else
+	else if(virt >= 0xfea0 && virt <= 0xfeff) // unusable
 	{
-		printf("unhandled write16 of %04x at %04x, pc = %04x\n", v, virt, regs.pc);
 	}
+	else if(virt >= 0xff04 && virt <= 0xff07)
+	{
+		timer->write(virt, v, cycles);
+		schedule(Scheduler::TIMER, timer->next_overflow());
+	}
+	else if(virt == 0xff46) // OAM DMA: copied in one go, but OAM stays busy for as long as the real copy takes
+	{
+		dma_source = v;
+		int i = 0;
+		for(; i < 0xa0; i++)
+		{
+			screen->oam[i] = read8((v << 8) + i);
+		}
+		dma_active = true;
+		schedule(Scheduler::DMA, cycles + 0xa0 * 4);
+	}
+	else if(virt >= 0xff40 && virt <= 0xff4f) // this is the LCD!
+	{
+		screen->write(virt, v);
+		schedule_hblank();
+	}
+	else if(virt == 0xff01)
+	{
+		serial_data = v;
+	}
+	else if(virt == 0xff02)
+	{
+		serial_control = v;
+		schedule(Scheduler::SERIAL, (v & 0x81) == 0x81 ? cycles + SERIAL_CYCLES : Scheduler::NEVER);
+	}
+	else if(virt == 0xff00)
+	{
+		joypad_select = v & 0x30;
+	}
+	else if(virt == 0xff50)
+	{
+		if(v == 1 && flags.bios_enabled)
+		{
+			flags.bios_enabled = false;
+			map_cart();
+		}
+	}
+	else if(virt == 0xff0f) // int flags
+	{
+		run_deadline = 0;
+		int_flags = v & IRQ_MASK;
+	}
+	else if(virt == 0xffff)
+	{
+		run_deadline = 0;
+		int_enable = v;
+	}
+	// Anything else is dropped: writes to unmapped I/O do nothing, and the
+	// boot ROM and most games write the sound registers, which aren't
+	// emulated. Reading those back stops emulation instead.
+}
+
+void CPU::fail(const char *format, ...)
+{
+	char buf[128];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+
+	if(error.empty())
+	{
+		error = buf;
+	}
+	run_deadline = 0;
 }
 
-void CPU::update_zero_flag(uint16_t v)
+// Would process_interrupts() do anything right now?
+bool CPU::interrupt_pending()
 {
-	if(v == 0)
+	return int_enable_master && (int_flags & int_enable & IRQ_MASK);
+}
+
+// Calls the handler for the lowest requested and enabled interrupt, which
+// is the one with the highest priority, at 0x40 + 8 * its bit. IME goes off
+// until the handler's reti or ei.
+bool CPU::process_interrupts()
+{
+	unsigned int pending = int_flags & int_enable & IRQ_MASK;
+	if(!int_enable_master || pending == 0)
 	{
-		regs.af.f |= Flag::Z;
+		return false;
 	}
-	else
+
+#if defined(__GNUC__)
+	int n = __builtin_ctz(pending);
+#else
+	int n = 0;
+	while(!(pending & (1 << n)))
 	{
-		regs.af.f &= ~Flag::Z;
+		n++;
 	}
+#endif
+
+	int_flags &= ~(1 << n);
+	int_enable_master = false;
+	old_en = false;
+	run_deadline = 0;
+
+	regs.sp -= 2;
+	write16(regs.sp, regs.pc);
+	regs.pc = 0x40 + 8 * n;
+	cycles += 20;
+	return true;
 }
 
-void CPU::process_interrupts()
+// The 0xcb-prefixed opcodes come in rows of 16, where the two halves of a row
+// are usually a pair of operations (rl/rr, swap/srl, ...) on b,c,d,e,h,l,(hl),a.
+#define CB_ROW(lo, hi) lo,lo,lo,lo,lo,lo,lo,lo, hi,hi,hi,hi,hi,hi,hi,hi
+#define CB_TABLE(unhandled, rl, rr, swap, bit, res, set) \
+	CB_ROW(unhandled, unhandled), /* rlc/rrc */ \
+	CB_ROW(rl, rr), \
+	CB_ROW(unhandled, unhandled), /* sla/sra */ \
+	CB_ROW(swap, unhandled), /* swap/srl */ \
+	CB_ROW(bit, bit), CB_ROW(bit, bit), CB_ROW(bit, bit), CB_ROW(bit, bit), \
+	CB_ROW(res, res), CB_ROW(res, res), CB_ROW(res, res), CB_ROW(res, res), \
+	CB_ROW(set, set), CB_ROW(set, set), CB_ROW(set, set), CB_ROW(set, set)
+
+// Handlers for CB opcodes share the main switch in step(), above the 8-bit opcode range.
+enum CBGroup
+{
+	CB_UNHANDLED = 0x100,
+	CB_RL,
+	CB_RR,
+	CB_SWAP,
+	CB_BIT,
+	CB_RES,
+	CB_SET
+};
+
+static const uint16_t cb_groups[0x100] =
+{
+	CB_TABLE(CB_UNHANDLED, CB_RL, CB_RR, CB_SWAP, CB_BIT, CB_RES, CB_SET)
+};
+
+#define IMM8() read8(regs.pc+1)
+#define IMM16() read16(regs.pc+1)
+
+bool CPU::step()
 {
-	if(int_enable_master)
+#ifdef GP_PROFILE
+	if(cycles >= profiler->window())
 	{
-		int i = 0;
-		for(; i < NUM_INTERRUPTS; i++)
+		return step_profiled();
+	}
+#endif
+
+	if(halted)
+	{
+		if(!(int_flags & int_enable & IRQ_MASK))
 		{
-			if(interrupts[(InterruptType)i] != 0)
-			{
-				interrupts[(InterruptType)i]--;
-				printf("todo: trigger interrupt\n");
-			}
+			skip_halt();
+			return false;
 		}
+		halted = false;
 	}
-}
 
-bool CPU::step()
-{
-	if(old_en != false) // delay for one cycle.
+	if(old_en != false && process_interrupts()) // IME takes effect an instruction late
 	{
-		process_interrupts();
-		screen->process_interrupts();
+		return false;
 	}
 
 	old_en = int_enable_master;
 
-	uint8_t instr = read8(regs.pc);
-
-	bool jump = false;
-
-	switch(instr)
-	{
-		case 0:
-			// nop.
-		break;
-
-		case 0x01: // ld bc, nn
-			regs.bc.full = read16(regs.pc+1);
-			regs.pc += 2;
-			cycles += 12;
-		break;
-
-		case 0x02: // ld (bc), a
-			regs.af.a = read8(regs.bc.full);
-			cycles += 8;
-		break;
-
-		case 0x03: // inc bc
-			regs.bc.full++;
-			cycles += 8;
-		break;
-
-		case 0x04: // inc b
-			regs.bc.b++;
-			cycles += 4;
-		break;
-
-		case 0x05: // dec b
-			regs.bc.b--;
-			update_zero_flag(regs.bc.b);
-			cycles += 4;
-		break;
-
-		case 0x06: // ld b, n
-			regs.bc.b = read8(regs.pc+1);
-			regs.pc++;
-			cycles += 8;
-		break;
-
-		case 0x0b: // dec bc
-			regs.bc.full--;
-			cycles += 8;
-		break;
-
-		case 0x0c: // inc c
-			regs.bc.c++;
-			cycles += 4;
-		break;
-
-		case 0x0d: // dec c
-			regs.bc.c--;
-			update_zero_flag(regs.bc.c);
-			cycles += 4;
-		break;
-
-		case 0x0e: // ld c, n
-			regs.bc.c = read8(regs.pc+1);
-			regs.pc++;
-			cycles += 8;
-		break;
-
-		case 0x11: // ld de, nn
-			regs.de.full = read16(regs.pc+1);
-			regs.pc += 2;
-			cycles += 12;
-		break;
-
-		case 0x12: // ld (de), a
-			write8(regs.de.full, regs.af.a);
-			cycles += 8;
-		break;
-
-		case 0x13: // inc de
-			regs.de.full++;
-			cycles += 8;
-		break;
-
-		case 0x15: // dec d
-			regs.de.d--;
-			update_zero_flag(regs.de.d);
-			cycles += 4;
-		break;
-
-		case 0x16: // ld d, n
-			regs.de.d = read8(regs.pc+1);
-			regs.pc++;
-			cycles += 8;
-		break;
-
-		case 0x17: // rla
-		{
-			bool c = regs.af.a & 0x80;
-			regs.af.a = (regs.af.f & Flag::C ? 1 : 0) | (regs.af.a << 1);
-			if(c)
-			{ regs.af.f |= Flag::C; }
-			else
-			{ regs.af.f &= ~Flag::C; }
-			cycles += 4;
-		}
-		break;
+	int op = read8(regs.pc);
+	uint8_t bitop = 0;
+	uint8_t *r = nullptr;
+
+dispatch:
+	switch(op)
+	{
+#define OPCODE(n, ...) case n: { __VA_ARGS__ }
+#define CB_OPCODE(group, ...) case group: { __VA_ARGS__ }
+#define UNHANDLED_OPCODE(...) default: { __VA_ARGS__ }
+#define NEXT regs.pc++; break
+#define NEXT_JUMP break
+#define CB_DISPATCH(n) op = cb_groups[n]; goto dispatch
+#define FAIL return true
+#include "opcodes.inc"
+#undef OPCODE
+#undef CB_OPCODE
+#undef UNHANDLED_OPCODE
+#undef NEXT
+#undef NEXT_JUMP
+#undef CB_DISPATCH
+#undef FAIL
+	}
+
+	return false;
+}
 
-		case 0x18: // jr n, relative jump
+#ifdef GP_PROFILE
+// step(), telling the profiler what it ran and every memory access that made
+// other than fetching it. step() and run() use this for the few instructions
+// around each sample, with nothing skipping ahead in the meantime, so idle
+// loops run instruction by instruction and can be sampled like any other code.
+#define read8(virt) read8(profiler->read(virt, 1))
+#define read16(virt) read16(profiler->read(virt, 2))
+#define write8(virt, v) write8(profiler->write(virt, 1), v)
+#define write16(virt, v) write16(profiler->write(virt, 2), v)
+#undef IMM8
+#undef IMM16
+#define IMM8() (read8)(regs.pc+1)
+#define IMM16() (read16)(regs.pc+1)
+
+bool CPU::step_profiled()
+{
+	uint64_t start = cycles;
+	run_deadline = cycles;
+
+	if(halted)
+	{
+		if(!(int_flags & int_enable & IRQ_MASK))
 		{
-			int8_t ofs = (int8_t)read8(regs.pc+1);
-			regs.pc++;
-			regs.pc += ofs;
-			cycles += 12;
+			skip_halt();
+			profiler->end(start, 0);
+			return false;
 		}
-		break;
+		halted = false;
+	}
 
-		case 0x19: // add hl, de
-			regs.hl.full += regs.de.full;
-			cycles += 12;
-		break;
+	profiler->begin(Profiler::IRQ, regs.pc);
+	if(old_en != false && process_interrupts())
+	{
+		profiler->end(start, cycles - start);
+		return false;
+	}
 
-		case 0x1a: // ld a, (de)
-			regs.af.a = read8(regs.de.full);
-			cycles += 8;
-		break;
+	old_en = int_enable_master;
 
-		case 0x1d: // dec e
-			regs.de.e--;
-			update_zero_flag(regs.de.e);
-			cycles += 4;
-		break;
+	int op = (read8)(regs.pc);
+	profiler->begin(op == 0xcb ? 0x100 + (read8)(regs.pc + 1) : op, regs.pc);
+	uint8_t bitop = 0;
+	uint8_t *r = nullptr;
 
-		case 0x1e: // ld e, n
-			regs.de.e = read8(regs.pc+1);
-			regs.pc++;
-			cycles += 8;
-		break;
+dispatch:
+	switch(op)
+	{
+#define OPCODE(n, ...) case n: { __VA_ARGS__ }
+#define CB_OPCODE(group, ...) case group: { __VA_ARGS__ }
+#define UNHANDLED_OPCODE(...) default: { __VA_ARGS__ }
+#define NEXT regs.pc++; break
+#define NEXT_JUMP break
+#define CB_DISPATCH(n) op = cb_groups[n]; goto dispatch
+#define FAIL return true
+#include "opcodes.inc"
+#undef OPCODE
+#undef CB_OPCODE
+#undef UNHANDLED_OPCODE
+#undef NEXT
+#undef NEXT_JUMP
+#undef CB_DISPATCH
+#undef FAIL
+	}
 
+	profiler->end(start, cycles - start);
+	return false;
+}
 
-		case 0x20: // jnz, r8
+#undef read8
+#undef read16
+#undef write8
+#undef write16
+#undef IMM8
+#undef IMM16
+#define IMM8() read8(regs.pc+1)
+#define IMM16() read16(regs.pc+1)
+#endif
+
+bool CPU::run_frame()
+{
+	uint64_t frame = frames;
+	while(frames == frame)
+	{
+		if(cycles >= events.next())
 		{
-			int8_t ofs = (int8_t)read8(regs.pc+1);
-			regs.pc++;
-
-			if((regs.af.f & Flag::Z) == 0)
-			{
-				//printf("c: %02x\n", regs.bc.c);
-				//printf("ofs %i\n", ofs);
-				regs.pc += ofs;
-				cycles += 12;
-			}
-			else
-			{
-				cycles += 8;
-			}
+			dispatch_events();
 		}
-		break;
-
-		case 0x21: // ld hl, nn
-			regs.hl.full = read16(regs.pc+1);
-			regs.pc+=2;
-			cycles += 12;
-		break;
-
-		case 0x22: // LDI  (HL),A
-			write8(regs.hl.full, regs.af.a);
-			regs.hl.full++;
-			cycles += 8;
-		break;
-
-		case 0x23: // inc hl
-			regs.hl.full++;
-			cycles += 8;
-		break;
-
-		case 0x24: // inc h
-			regs.hl.h++;
-			cycles += 4;
-		break;
-
-		case 0x28: // jz n, relative jump if zero
+		else if(run(events.next() - cycles))
 		{
-			int8_t ofs = (int8_t)read8(regs.pc+1);
-			regs.pc++;
-
-			if(regs.af.f & Flag::Z)
-			{
-				//printf("c: %02x\n", regs.bc.c);
-				//printf("ofs %i\n", ofs);
-				regs.pc += ofs;
-				cycles += 12;
-			}
-			else
-			{
-				cycles += 8;
-			}
+			return true;
 		}
-		break;
+	}
 
-		case 0x2a: // ld hl, (nn)
+	return false;
+}
+
+bool CPU::run(uint64_t cycle_budget)
+{
+	uint64_t end = cycles + cycle_budget;
+	loop_state = LOOP_NONE; // the buttons may have changed since
+
+	while(cycles < end)
+	{
+		if(!error.empty())
 		{
-			uint16_t n = read16(regs.pc+1);
-			regs.pc+=2;
-			regs.hl.full = read16(n);
-			cycles += 16;
+			return true;
 		}
-		break;
-
-		case 0x2e: // ld l, n
-			regs.hl.l = read8(regs.pc+1);
-			regs.pc++;
-			cycles += 8;
-		break;
-
-		case 0x2f: // cpl a
-			regs.af.a = ~regs.af.a;
-			cycles += 4;
-		break;
-
-		case 0x31: // ld sp, nn
-			regs.sp = read16(regs.pc+1);
-			regs.pc+=2;
-			cycles += 12;
-		break;
-
-		case 0x32: // ldd (hl), a
-			write8(regs.hl.full, regs.af.a);
-			regs.hl.full--;
-			cycles += 8;
-		break;
-
-		case 0x35:
-			write8(regs.hl.full, read8(regs.hl.full) - 1);
-			cycles += 12;
-		break;
-
-		case 0x36: // ld (hl), n
+		if(cycles >= events.next())
 		{
-			uint8_t v = read8(regs.pc+1);
-			regs.pc++;
-			write8(regs.hl.full, v);
-			cycles += 12;
+			dispatch_events();
 		}
-		break;
-
-		case 0x3d: // dec a
-			regs.af.a--;
-			update_zero_flag(regs.af.a);
-			cycles += 4;
-		break;
-
-		case 0x3e: // ld a, n
-			regs.af.a = read8(regs.pc+1);
-			regs.pc++;
-			cycles += 8;
-		break;
-
-		case 0x47:
-			regs.bc.b = regs.af.a;
-			cycles += 4;
-		break;
-
-		case 0x4f: // ld c, a
-			regs.bc.c = regs.af.a;
-			cycles += 4;
-		break;
-
-		case 0x56: // ld d,(hl)
-			regs.de.d = read8(regs.hl.full);
-			cycles += 8;
-		break;
-
-		case 0x57: // ld d, a
-			regs.de.d = regs.af.a;
-			cycles += 4;
-		break;
-
-		case 0x5e: // ld e,(hl)
-			regs.de.e = read8(regs.hl.full);
-			cycles += 8;
-		break;
-
-		case 0x5f: // ld e, a
-			regs.de.e = regs.af.a;
-			cycles += 4;
-		break;
-
-		case 0x67: // ld h, a
-			regs.hl.h = regs.af.a;
-			cycles += 4;
-		break;
-
-		case 0x77: // ld (hl), a
-			write8(regs.hl.full, regs.af.a);
-			cycles += 8;
-		break;
-
-		case 0x78: // ld a, b
-			regs.af.a = regs.bc.b;
-			cycles += 4;
-		break;
-
-		case 0x79: // ld a, c
-			regs.af.a = regs.bc.c;
-			cycles += 4;
-		break;
-
-		case 0x7b: // ld a, e
-			regs.af.a = regs.de.e;
-			cycles += 4;
-		break;
-
-		case 0x7c: // ld a, h
-			regs.af.a = regs.hl.h;
-			cycles += 4;
-		break;
-
-		case 0x7d: // ld a, l
-			regs.af.a = regs.hl.l;
-			cycles += 4;
-		break;
-
-		case 0x7e: // ld a, (hl)
-			regs.af.a = read8(regs.hl.full);
-			cycles += 8;
-		break;
-
-		case 0x7f: // ld a, a
-			regs.af.a = regs.af.a;
-			cycles += 4;
-		break;
-
-		case 0x86: // add a, (hl)
+
+		// Also as far as HALT and idle loops may skip ahead.
+		run_deadline = events.next() < end ? events.next() : end;
+
+#ifdef GP_PROFILE
+		// Step up to the profiler's next sample.
+		if(cycles >= profiler->window())
 		{
-			uint8_t val = read8(regs.hl.full);
-			regs.af.a += val;
-			update_zero_flag(regs.af.a);
-			cycles += 8;
+			if(step_profiled())
+			{
+				return true;
+			}
+			continue;
 		}
-		break;
-
-		case 0x87:
-			regs.af.a += regs.af.a;
-			cycles += 4;
-		break;
-
-		case 0x90: // sub b
-			regs.af.a -= regs.bc.b;
-			update_zero_flag(regs.af.a);
-			cycles += 4;
-		break;
-
-		case 0xa1: // and c
-			regs.af.a &= regs.bc.c;
-			cycles += 4;
-		break;
-
-		case 0xa7: // and a
-			regs.af.a &= regs.af.a;
-			cycles += 4;
-		break;
-
-		case 0xa9: // xor c
-			regs.af.a ^= regs.bc.c;
-			cycles += 4;
-		break;
-
-		case 0xaf: // xor a
-			regs.af.a = 0;
-			cycles += 4;
-		break;
-
-		case 0xb0: // or b
-			regs.af.a |= regs.bc.b;
-			cycles += 4;
-		break;
-
-		case 0xb1: // or c
-			regs.af.a |= regs.bc.c;
-			cycles += 4;
-		break;
-
-		case 0xbe: // cp (hl)
+		if(profiler->window() < run_deadline)
 		{
-			uint8_t val = read8(regs.hl.full);
-			update_zero_flag(regs.af.a - val);
-			cycles += 8;
+			run_deadline = profiler->window();
 		}
-		break;
-
-		case 0xc1: // pop bc
-			regs.bc.full = read16(regs.sp);
-			regs.sp += 2;
-			cycles += 12;
-		break;
-
-		case 0xc3: // jp nn, absolute jump
-			regs.pc = read16(regs.pc+1);
-			jump = true;
-			cycles += 12;
-		break;
-
-		case 0xc5: // push bc
-			regs.sp -= 2;
-			write16(regs.sp, regs.bc.full);
-			cycles += 16;
-		break;
-
-		case 0xc9: // ret
-			regs.pc = read16(regs.sp);
-			regs.sp += 2;
-			jump = true;
-			cycles += 16;
-		break;
-
-		case 0xca:
-			regs.pc = read16(regs.pc+1);
-			jump = true;
-			cycles += 12;
-		break;
-
-		case 0xcb: // BIT OPERATIONS
-		{
-			uint8_t bitop = read8(regs.pc+1);
-			regs.pc++;
+#endif
 
-			static uint8_t *regnums[0x8] = 
-			{
-				&regs.bc.b,
-				&regs.bc.c,
-				&regs.de.d,
-				&regs.de.e,
-				&regs.hl.h,
-				&regs.hl.l,
-				nullptr, // memory
-				&regs.af.a
-			};
-
-			uint8_t *r = regnums[(bitop&0xf) % 8];
-
-			switch(bitop & 0xf0)
+#if defined(GP_JIT) || defined(GP_BLOCK_CACHE) || defined(GP_THREADED_DISPATCH)
+		// The threaded loop skips the interrupt bookkeeping at the top of step(),
+		// so only enter it while that bookkeeping would do nothing anyway.
+		if(old_en == int_enable_master && !interrupt_pending() && !halted)
+		{
+#ifdef GP_JIT
+			if(jit != nullptr)
 			{
-				/*case 0x00:
-					// rlc/rrc
-					{
-						uint8_t *r = regnums[(bitop&0xf) % 8];
-						if((bitop & 0xf) < 0x8) // left
-						{
-							if(r == nullptr)
-							{
-
-							}
-							else
-							{
-								
-							}
-						}
-						else // right
-						{
-							if(r == nullptr)
-							{
-
-							}
-							else
-							{
-
-							}
-						}
-					}
-				break;*/
-
-				case 0x10:
-					{
-						// rl/rr
-						uint8_t v;
-						bool c = false;
-
-						if(r == nullptr) { v = read8(regs.hl.full); }
-						else { v = *r; }
-
-						if((bitop & 0xf) < 0x8) // left
-						{
-							c = (v & 0x80) == 0x80;
-							v = (regs.af.f & Flag::C ? 1 : 0) | (v << 1);
-						}
-						else // right
-						{
-							c = (v & 1) == 1;
-							v = (regs.af.f & Flag::C ? 0x80 : 0) | (v >> 1);
-						}
-						
-						if(c)
-						{
-							regs.af.f |= Flag::C;
-						}
-						else
-						{
-							regs.af.f &= ~Flag::C;
-						}
-
-						if(r == nullptr) { write8(regs.hl.full, v); }
-						else { *r = v; }
-					}
-				break;
-
-				/*case 0x20: // sla/rla
-					// rl/rr
-					if((bitop & 0xf) < 0x8) // left
-					{
-						uint8_t *r = regnums[(bitop&0xf) % 8];
-						if(r == nullptr)
-						{
-
-						}
-						else
-						{
-
-						}
-					}
-					else // right
-					{
-						uint8_t *r = regnums[(bitop&0xf) % 8];
-						if(r == nullptr)
-						{
-
-						}
-						else
-						{
-
-						}
-					}
-				break;*/
-
-
-				case 0x30: // swap/srl
-					if((bitop & 0xf) < 0x8) // swap
-					{
-						uint8_t tmp, v;
-
-						if(r == nullptr) { tmp = read8(regs.hl.full); }
-						else { tmp = *r; }
-
-						v = (tmp & 0xf) << 4 | (tmp & 0xf0) >> 4;
-
-						if(r == nullptr) { write8(regs.hl.full, v); }
-						else { *r = v; }
-					}
-					else // right
-					{
-						printf("unhandled bitop %02x at pc %04x\n", bitop, regs.pc);
-						return true;
-					}
-				break;
-
-				case 0x40: // bit
-				case 0x50:
-				case 0x60:
-				case 0x70:
+				if(run_jit())
 				{
-					uint8_t val;
-
-					if(r == nullptr) { val = read8(regs.hl.full); }
-					else { val = *r; }
-
-					uint8_t bit = (((bitop & 0xf0) / 0x10) - 4) * 2 + ((bitop&0xf)>7 ? 1 : 0);
-					if(val & (1 << bit))
-					{
-						regs.af.f &= ~Flag::Z; // Clear the zero flag.
-					}
-					else
-					{
-						regs.af.f |= Flag::Z;
-					}
-				}
-				break;
-
-				case 0x80: // res
-				case 0x90:
-				case 0xa0:
-				case 0xb0:
-				break;
-
-				case 0xc0: // set
-				case 0xd0:
-				case 0xe0:
-				case 0xf0:
-				break;
-
-				default:
-					printf("unhandled bitop %02x at pc %04x\n", bitop, regs.pc);
 					return true;
-				break;
+				}
+				continue;
 			}
-
-			cycles += 8;
-			if(r == nullptr) // (hl)
+#endif
+#if defined(GP_BLOCK_CACHE)
+			if(run_blocks())
+			{
+				return true;
+			}
+			continue;
+#elif defined(GP_THREADED_DISPATCH)
+			if(run_threaded())
 			{
-				cycles += 8;
+				return true;
 			}
+			continue;
+#endif
 		}
-		break;
-
-		case 0xcd: // call nn
+#endif
+		if(step())
 		{
-			regs.sp -= 2;
-			write16(regs.sp, regs.pc + 3);
-			regs.pc = read16(regs.pc + 1);
-			jump = true;
-
-			cycles += 24;
+			return true;
 		}
-		break;
+	}
 
-		case 0xd1: // pop de
-			regs.de.full = read16(regs.sp);
-			regs.sp += 2;
-			cycles += 12;
-		break;
+	return !error.empty();
+}
 
-		case 0xd5: // push de
-			regs.sp -= 2;
-			write16(regs.sp, regs.de.full);
-			cycles += 16;
-		break;
+#ifdef GP_THREADED_DISPATCH
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
 
-		case 0xdf: // rst 18h
+// Same opcode bodies as step(), but each handler jumps straight to the next
+// one through op_table instead of returning. Leaves when cycles reaches
+// run_deadline, which is also zeroed whenever interrupt state changes.
+bool CPU::run_threaded()
+{
+	static const void *op_table[0x100];
+	static const bool op_table_ready = ({
+		int i = 0;
+		for(; i < 0x100; i++)
 		{
-			printf("rst 18, pc: %04x\n", regs.pc);
-			regs.sp -= 2;
-			write16(regs.sp, regs.pc + 1);
-			regs.pc = 0x18;
-			jump = 1;
-			cycles += 16;
+			op_table[i] = &&op_unhandled;
 		}
-		break;
+#define OPCODE(n, ...) op_table[n] = &&op_##n;
+#define CB_OPCODE(group, ...)
+#define UNHANDLED_OPCODE(...)
+#include "opcodes.inc"
+#undef OPCODE
+#undef CB_OPCODE
+#undef UNHANDLED_OPCODE
+		true;
+	});
+	(void)op_table_ready;
+
+	static const void *const cb_table[0x100] =
+	{
+		CB_TABLE(&&cb_CB_UNHANDLED, &&cb_CB_RL, &&cb_CB_RR, &&cb_CB_SWAP, &&cb_CB_BIT, &&cb_CB_RES, &&cb_CB_SET)
+	};
+
+	uint8_t bitop = 0;
+	uint8_t *r = nullptr;
+
+#define DISPATCH() \
+	if(cycles >= run_deadline) \
+	{ \
+		return false; \
+	} \
+	goto *op_table[read8(regs.pc)]
+
+	DISPATCH();
+
+#define OPCODE(n, ...) op_##n: { __VA_ARGS__ }
+#define CB_OPCODE(group, ...) cb_##group: { __VA_ARGS__ }
+#define UNHANDLED_OPCODE(...) op_unhandled: { __VA_ARGS__ }
+#define NEXT regs.pc++; DISPATCH()
+#define NEXT_JUMP DISPATCH()
+#define CB_DISPATCH(n) goto *cb_table[n]
+#define FAIL return true
+#include "opcodes.inc"
+#undef OPCODE
+#undef CB_OPCODE
+#undef UNHANDLED_OPCODE
+#undef NEXT
+#undef NEXT_JUMP
+#undef CB_DISPATCH
+#undef FAIL
+#undef DISPATCH
+}
 
-		case 0xe0: // LD (FF00+n),A
-		{
-			uint8_t val = read8(regs.pc+1);
-			regs.pc++;
+#pragma GCC diagnostic pop
+#endif
 
-			write8(0xff00 + val, regs.af.a);
+#ifdef GP_BLOCK_CACHE
+#undef IMM8
+#undef IMM16
+#define IMM8() u->imm8
+#define IMM16() u->imm16
 
-			cycles += 12;
-		}
-		break;
-
-		case 0xe1: // pop hl
-			regs.hl.full = read16(regs.sp);
-			regs.sp += 2;
-			cycles += 12;
-		break;
-
-		case 0xe2: // LD (FF00+C),A
-			write8(0xff00 + regs.bc.c, regs.af.a);
-			cycles += 8;
-		break;
-
-		case 0xe5: // push hl
-			regs.sp -= 2;
-			write16(regs.sp, regs.hl.full);
-			cycles += 16;
-		break;
-
-		case 0xe6: // and n
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+// Executes pre-decoded blocks back to back until run_deadline, threading
+// from one micro-op's handler straight to the next. Code that can't be
+// cached (I/O pages, instructions straddling a page) goes through step().
+bool CPU::run_blocks()
+{
+	static const void *op_table[0x101];
+	static const bool op_table_ready = ({
+		int i = 0;
+		for(; i < 0x100; i++)
 		{
-			uint8_t v = read8(regs.pc + 1);
-			regs.pc++;
-			regs.af.a &= v;
-			cycles += 8;
+			op_table[i] = &&op_unhandled;
 		}
-		break;
+		op_table[MicroOp::BLOCK_END] = &&block_end;
+#define OPCODE(n, ...) op_table[n] = &&op_##n;
+#define CB_OPCODE(group, ...)
+#define UNHANDLED_OPCODE(...)
+#include "opcodes.inc"
+#undef OPCODE
+#undef CB_OPCODE
+#undef UNHANDLED_OPCODE
+		true;
+	});
+	(void)op_table_ready;
+
+	static const void *const cb_table[0x100] =
+	{
+		CB_TABLE(&&cb_CB_UNHANDLED, &&cb_CB_RL, &&cb_CB_RR, &&cb_CB_SWAP, &&cb_CB_BIT, &&cb_CB_RES, &&cb_CB_SET)
+	};
 
-		case 0xe9: // jp (hl)
-			regs.pc = regs.hl.full;
-			jump = true;
-			cycles += 4;
-		break;
+	blocks->flush_retired();
 
-		case 0xea: // LD (nn), A
-		{
-			uint16_t val = read16(regs.pc+1);
-			regs.pc+=2;
-			write8(val, regs.af.a);
-			cycles += 16;
-		}
-		break;
+	uint8_t bitop = 0;
+	uint8_t *r = nullptr;
+	const MicroOp *u = nullptr;
 
-		case 0xef: // rst 28h
+#define DISPATCH() \
+	if(cycles >= run_deadline) \
+	{ \
+		return false; \
+	} \
+	goto *op_table[u->op]
+
+next_block:
+	while(cycles < run_deadline)
+	{
+		uint8_t p = regs.pc >> 8;
+		uint8_t *host = read_map[p];
+		Block *b = nullptr;
+
+		if(host != nullptr)
 		{
-			printf("rst 28, pc: %04x\n", regs.pc);
-			regs.sp -= 2;
-			write16(regs.sp, regs.pc + 1);
-			regs.pc = 0x28;
-			jump = 1;
-			cycles += 16;
+			b = blocks->find(host, regs.pc);
+			if(b == nullptr)
+			{
+				b = blocks->decode(host, regs.pc);
+				if(b != nullptr && (write_map[p] != nullptr || write_watch[p] != 0)) // code in ram
+				{
+					set_write_watch(host, WATCH_CODE, true);
+				}
+			}
 		}
-		break;
 
-		case 0xf0: // LD A,(FF00+n)
+		if(b != nullptr)
 		{
-			uint8_t val = read8(regs.pc+1);
-			regs.pc++;
-			regs.af.a = read8(0xff00 + val);
-			cycles += 12;
+			u = &b->ops[0];
+			goto *op_table[u->op];
 		}
-		break;
-
-		case 0xf1:
-			regs.af.full = read16(regs.sp);
-			regs.sp += 2;
-			cycles += 12;
-		break;
-
-		case 0xf3: // di - disable interrupts
-			old_en = false;
-			int_enable_master = false;
-			cycles += 4;
-		break;
-
-		case 0xf5: // push af
-			regs.sp -= 2;
-			write16(regs.sp, regs.af.full);
-			cycles += 16;
-		break;
-
-		case 0xfa: // LD A,(nn)
+
+		if(step())
 		{
-			uint16_t addr = read16(regs.pc + 1);
-			regs.pc += 2;
-			regs.af.a = read8(addr);
-			cycles += 16;
+			return true;
 		}
-		break;
+	}
+	return false;
 
-		case 0xfb: // ei - enable interrupts
-			old_en = false;
-			int_enable_master = true;
-			cycles += 4;
-		break;
+block_end:
+	goto next_block;
+
+#define OPCODE(n, ...) op_##n: { __VA_ARGS__ }
+#define CB_OPCODE(group, ...) cb_##group: { __VA_ARGS__ }
+#define UNHANDLED_OPCODE(...) op_unhandled: { __VA_ARGS__ }
+#define NEXT regs.pc++; u++; DISPATCH()
+#define NEXT_JUMP u++; DISPATCH()
+#define CB_DISPATCH(n) goto *cb_table[n]
+#define FAIL return true
+#include "opcodes.inc"
+#undef OPCODE
+#undef CB_OPCODE
+#undef UNHANDLED_OPCODE
+#undef NEXT
+#undef NEXT_JUMP
+#undef CB_DISPATCH
+#undef FAIL
+#undef DISPATCH
+}
 
-		case 0xfe: // cp n
-		{
-			uint8_t v = read8(regs.pc+1);
-			regs.pc++;
-			update_zero_flag(regs.af.a - v);
-			cycles += 8;
-		}
-		break;
+#pragma GCC diagnostic pop
+#endif
 
-		case 0xff: // rst 38h
+#ifdef GP_JIT
+// Runs compiled blocks where the JIT has them and interprets everything else
+// one instruction at a time, until run_deadline.
+bool CPU::run_jit()
+{
+	while(cycles < run_deadline)
+	{
+		JitX64::BlockFn fn = jit->lookup(regs.pc);
+		if(fn != nullptr)
 		{
-			printf("rst 38, pc: %04x\n", regs.pc);
-			regs.sp -= 2;
-			write16(regs.sp, regs.pc + 1);
-			regs.pc = 0x38;
-			jump = 1;
-			cycles += 16;
+			fn(this);
+			if(jit_loop_exit)
+			{
+				// As the interpreter calls it, before NEXT moves onto the target.
+				jit_loop_exit = false;
+				regs.pc--;
+				loop_branch();
+				regs.pc++;
+			}
 		}
-		break;
-
-		default:
-			printf("unhandled opcode %02x at pc %04x\n", instr, regs.pc);
+		else if(step())
+		{
 			return true;
-		break;
+		}
 	}
 
-	if(!jump)
-	{
-		regs.pc++;
-	}
-	else
-	{
-		jump = false;
-	}
 	return false;
-}
\ No newline at end of file
+}
+#endif
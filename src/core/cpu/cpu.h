@@ -2,56 +2,332 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <exception>
-#include <map>
+#include <memory>
+#include <string>
 
 #include "screen.h"
+#include "scheduler.h"
+
+#define CYCLES_PER_SECOND 4194304
+#define IRQ_MASK 0x1f // the bits of IF and IE that exist, vblank (0) to joypad (4)
+#define IRQ_SERIAL (1 << 3)
+#define SERIAL_CYCLES (8 * 512) // to shift out a byte at 8192Hz
+
+class GBTimer;
+class GBCartridge;
+class BlockCache;
+class JitX64;
+class Profiler;
+class RomImage;
+class StateWriter;
+class StateReader;
 
 class CPU
 {
 public:
-	CPU();
+	// Each of these throws util::LoadException if an image can't be loaded
+	// or the BIOS isn't 256 bytes. A null BIOS starts at 0x100 in the state
+	// the boot ROM would have left behind.
+	CPU(std::string bios_path, std::string cart_path);
+	CPU(const uint8_t *bios_data, const uint8_t *cart_data, size_t cart_size); // copies them
+	CPU(std::shared_ptr<const RomImage> bios_image, std::shared_ptr<const RomImage> cart_image);
 	~CPU();
 
+	// Back to how it was when constructed, reusing everything allocated, so
+	// one CPU can run job after job. The second form swaps the images first.
+	void reset();
+	void reset(std::shared_ptr<const RomImage> bios_image, std::shared_ptr<const RomImage> cart_image);
+
 	bool step();
+	bool run(uint64_t cycle_budget);
+	bool run_frame(); // runs until the next VBlank starts
 
 	uint8_t read8(uint16_t virt);
 	void write8(uint16_t virt, uint8_t v);
 	uint16_t read16(uint16_t virt);
 	void write16(uint16_t virt, uint16_t v);
 
-	void update_zero_flag(uint16_t r);
+	// Flags are worked out lazily: the ALU ops only note what each flag
+	// depends on, and F is put together from that when something needs all of
+	// it (push af, a save state, the lockstep lanes). Conditional jumps only
+	// look at the flag they test. Built with GP_EAGER_FLAGS, the same calls
+	// set regs.af.f as they go instead, to measure against.
+	//
+	// So regs.af.f is only current right after regs.af.f = get_f().
+	uint8_t get_f()
+	{
+#ifdef GP_EAGER_FLAGS
+		return regs.af.f;
+#else
+		return (flag_z == 0 ? Flag::Z : 0) | (flag_n ? Flag::N : 0) | (flag_h & 0x10) << 1 | (flag_c >> 4 & Flag::C);
+#endif
+	}
+
+	void set_f(uint8_t f)
+	{
+#ifdef GP_EAGER_FLAGS
+		regs.af.f = f & 0xf0;
+#else
+		flag_z = !(f & Flag::Z);
+		flag_c = (f & Flag::C) << 4;
+		flag_n = f & Flag::N;
+		flag_h = (f & Flag::H) >> 1;
+#endif
+	}
+
+	// What an ALU op leaves in the flags: Z if z is 0, C if bit 8 of c is
+	// set, N as given and H if bit 4 of h is set. For adds and subtracts, h is
+	// both operands and the result xored together, which has the carry out of
+	// bit 3 in bit 4. The _keep variants leave the flags they name alone.
+	void alu_flags(uint8_t z, uint16_t c, bool n, uint8_t h)
+	{
+#ifdef GP_EAGER_FLAGS
+		regs.af.f = (z == 0 ? Flag::Z : 0) | (n ? Flag::N : 0) | (h & 0x10) << 1 | (c >> 4 & Flag::C);
+#else
+		flag_z = z;
+		flag_c = c;
+		flag_n = n;
+		flag_h = h;
+#endif
+	}
+
+	void alu_flags_keep_c(uint8_t z, bool n, uint8_t h)
+	{
+#ifdef GP_EAGER_FLAGS
+		regs.af.f = (regs.af.f & Flag::C) | (z == 0 ? Flag::Z : 0) | (n ? Flag::N : 0) | (h & 0x10) << 1;
+#else
+		flag_z = z;
+		flag_n = n;
+		flag_h = h;
+#endif
+	}
+
+	void alu_flags_keep_z(uint16_t c, bool n, uint8_t h)
+	{
+#ifdef GP_EAGER_FLAGS
+		regs.af.f = (regs.af.f & Flag::Z) | (n ? Flag::N : 0) | (h & 0x10) << 1 | (c >> 4 & Flag::C);
+#else
+		flag_c = c;
+		flag_n = n;
+		flag_h = h;
+#endif
+	}
+
+	void alu_flags_keep_zc(bool n, uint8_t h)
+	{
+#ifdef GP_EAGER_FLAGS
+		regs.af.f = (regs.af.f & (Flag::Z | Flag::C)) | (n ? Flag::N : 0) | (h & 0x10) << 1;
+#else
+		flag_n = n;
+		flag_h = h;
+#endif
+	}
+
+	bool zero_flag()
+	{
+#ifdef GP_EAGER_FLAGS
+		return regs.af.f & Flag::Z;
+#else
+		return flag_z == 0;
+#endif
+	}
+
+	// 1 if C is set, 0 otherwise
+	uint8_t carry_flag()
+	{
+#ifdef GP_EAGER_FLAGS
+		return (regs.af.f & Flag::C) >> 4;
+#else
+		return flag_c >> 8 & 1;
+#endif
+	}
+
+	// 8-bit ALU ops, which set the flags and return the result.
+	uint8_t add8(uint8_t a, uint8_t b)
+	{
+		unsigned int r = a + b;
+		alu_flags(r, r, false, a ^ b ^ r);
+		return r;
+	}
+
+	uint8_t sub8(uint8_t a, uint8_t b) // and cp, which drops the result
+	{
+		unsigned int r = a - b; // a borrow sets bit 8 along with everything above it
+		alu_flags(r, r, true, a ^ b ^ r);
+		return r;
+	}
+
+	uint8_t inc8(uint8_t v)
+	{
+		uint8_t r = v + 1;
+		alu_flags_keep_c(r, false, v ^ 1 ^ r);
+		return r;
+	}
+
+	uint8_t dec8(uint8_t v)
+	{
+		uint8_t r = v - 1;
+		alu_flags_keep_c(r, true, v ^ 1 ^ r);
+		return r;
+	}
+
+	uint8_t and8(uint8_t a, uint8_t b)
+	{
+		uint8_t r = a & b;
+		alu_flags(r, 0, false, 0x10);
+		return r;
+	}
+
+	uint8_t or8(uint8_t a, uint8_t b)
+	{
+		uint8_t r = a | b;
+		alu_flags(r, 0, false, 0);
+		return r;
+	}
+
+	uint8_t xor8(uint8_t a, uint8_t b)
+	{
+		uint8_t r = a ^ b;
+		alu_flags(r, 0, false, 0);
+		return r;
+	}
 
-	void process_interrupts();
+	void map_pages();
+	void map_cart();
+	void set_write_watch(uint8_t *host_page, uint8_t flag, bool on);
+
+	// IF and IE are plain bitmasks, so the pending check is an AND. The fast
+	// loops in run() don't make it at all: they're left whenever IF, IE or IME
+	// change, and run() only goes back into them with nothing pending.
+	bool interrupt_pending();
+	bool process_interrupts(); // true if it called a handler
+
+	// Handles every event due by now. run() does this on the way; anything
+	// stepping the CPU by hand calls it when cycles reaches events.next().
+	void dispatch_events();
+	void schedule(Scheduler::Event e, uint64_t when);
+
+	// Taken backward jrs call this. A loop that comes round again with every
+	// register as it was, having only read memory that can't change before the
+	// next event, will do the same until then, so its remaining passes are
+	// skipped in one go. See idle.cpp.
+	void loop_branch()
+	{
+		uint16_t head = regs.pc + 1; // NEXT hasn't stepped onto the target yet
+		if(head != loop_head || loop_state == LOOP_NONE)
+		{
+			loop_head = head;
+			loop_state = LOOP_SEEN;
+		}
+		else if(loop_state != LOOP_REJECTED)
+		{
+			idle_loop();
+		}
+	}
+
+	// Save states hold everything that changes while running, so not the ROM
+	// images and not the framebuffer, which the next frame redraws. See
+	// savestate.h for the layout.
+	size_t save_state_size();
+	size_t save_state(uint8_t *buf, size_t size); // bytes written, 0 if buf is too small
+	bool load_state(const uint8_t *buf, size_t size); // false if the state isn't for this machine
+	void save_state_file(std::string path);
+	void load_state_file(std::string path);
+
+	// Hashes of the frame and of RAM, for telling runs apart without keeping
+	// whole states around. The frame is hashed as its shades, or with argb
+	// as ARGB8888, which golden hashes recorded before fb held shades need.
+	void hash_state(uint64_t &fb, uint64_t &ram, bool argb = false);
 
 	uint8_t *vram; // 0x2000
 	uint8_t *wram; // 0x2000
 	uint8_t *hram; // 126 bytes long at ff80-fffe
 
-	uint8_t *bios;
-
+	// Read-only: they point into bios_image and cart_image, which other CPUs
+	// may be sharing, and may be mapped straight from the files.
+	uint8_t *bios; // nullptr if there's no BIOS
 	uint8_t *cart;
 	size_t cart_size;
 
+	std::shared_ptr<const RomImage> bios_image;
+	std::shared_ptr<const RomImage> cart_image;
+
+	// One host pointer per 256-byte page of the address space, pointing at the
+	// start of that page. nullptr means the page has no plain memory behind it
+	// (I/O, HRAM, unmapped) and has to go through read_slow/write_slow. read8
+	// and write8 pick HRAM out of the I/O page before falling back to those.
+	uint8_t *read_map[0x100];
+	uint8_t *write_map[0x100];
+
+	// RAM pages whose writes have to be seen by something else first. Their
+	// write_map entry is nullptr while any WatchFlag is set.
+	uint8_t write_watch[0x100];
+
+	enum WatchFlag
+	{
+		WATCH_CODE = (1 << 0), // blocks were decoded from this page
+		WATCH_TILES = (1 << 1) // vram tile data, which the screen keeps decoded
+	};
+
+	BlockCache *blocks;
+	JitX64 *jit;
+	bool jit_loop_exit; // compiled code left through a taken backward jr, so run_jit() calls loop_branch()
+#ifdef GP_PROFILE
+	Profiler *profiler;
+#endif
+
 	uint64_t cycles;
+	uint64_t run_deadline;
+
+	bool halted; // waiting in HALT for IF & IE to go non-zero
+	uint64_t halted_cycles; // skipped while halted
+	uint64_t idle_cycles; // skipped in idle loops
 
 	bool old_en;
 	bool int_enable_master;
 	uint8_t int_enable;
 	uint8_t int_flags;
 
-	enum InterruptType
+	GBScreen *screen;
+	GBTimer *timer;
+	GBCartridge *cartridge;
+
+	Scheduler events;
+	uint64_t frames; // VBlanks so far
+
+	uint8_t dma_source; // 0xff46
+	bool dma_active; // OAM is busy until the DMA event
+
+	// The serial port, with nothing plugged in: a transfer on the internal
+	// clock sends serial_data and reads back 0xff, and anything on the
+	// external clock never finishes.
+	uint8_t serial_data; // 0xff01
+	uint8_t serial_control; // 0xff02
+
+	// Debug output for test ROMs, which isn't part of the state: every byte
+	// sent out of the serial port, and how many times ld b, b has run.
+	std::string serial_out;
+	uint64_t breakpoints;
+
+	// Why emulation stopped, empty while it can go on: an unknown opcode, or
+	// a read of hardware that isn't emulated. run() and run_frame() return
+	// true once it's set, and it stays set until reset().
+	std::string error;
+
+	enum Button
 	{
-		VBlank,
-		Stat,
-		Timer,
-		Serial,
-		Joypad,
-		NUM_INTERRUPTS
+		BTN_RIGHT = (1 << 0),
+		BTN_LEFT = (1 << 1),
+		BTN_UP = (1 << 2),
+		BTN_DOWN = (1 << 3),
+		BTN_A = (1 << 4),
+		BTN_B = (1 << 5),
+		BTN_SELECT = (1 << 6),
+		BTN_START = (1 << 7)
 	};
 
-	std::map<InterruptType, int> interrupts;
-
-	GBScreen *screen;
+	uint8_t buttons; // Button bits currently held down
+	uint8_t joypad_select; // bits 4-5 of 0xff00
 
 	struct
 	{
@@ -104,11 +380,65 @@ public:
 		uint16_t sp;
 	} regs;
 
+	// What the lazy flags are worked out from; see get_f(). Unused with
+	// GP_EAGER_FLAGS.
+	uint8_t flag_z; // Z is set when this is 0
+	uint16_t flag_c; // C is bit 8
+	bool flag_n;
+	uint8_t flag_h; // H is bit 4
+
+	uint8_t *regnums[8]; // CB opcode register operands, nullptr is (hl)
+
 	enum Flag
 	{
 		C = (1 << 4),
+		H = (1 << 5),
+		N = (1 << 6),
 		Z = (1 << 7)
 	};
+
+private:
+	void init();
+	void power_on();
+	void use_images(std::shared_ptr<const RomImage> new_bios, std::shared_ptr<const RomImage> new_cart);
+
+	size_t state_size;
+	uint64_t cart_hash; // 0 until a save state needs it
+	void write_state(StateWriter &w);
+	void read_state(StateReader &r);
+
+	uint8_t read_slow(uint16_t virt);
+	void write_slow(uint16_t virt, uint8_t v);
+
+	// Sets error from a printf format and leaves the fast loops.
+	void fail(const char *format, ...);
+
+	void schedule_hblank();
+
+	enum LoopState
+	{
+		LOOP_NONE,
+		LOOP_SEEN, // branched back to loop_head once
+		LOOP_WATCHING, // the loop only reads; loop_regs is its last pass
+		LOOP_REJECTED // writes memory or reads something that changes by itself
+	};
+
+	uint16_t loop_head;
+	uint8_t loop_state;
+	decltype(regs) loop_regs;
+	uint64_t loop_start; // cycles when the last pass began
+	uint64_t loop_next_event; // events.next() then
+
+	void idle_loop();
+	bool loop_only_reads();
+	void skip_halt();
+
+	bool run_threaded();
+	bool run_blocks();
+	bool run_jit();
+#ifdef GP_PROFILE
+	bool step_profiled();
+#endif
 };
 
 class CPUException : public std::exception
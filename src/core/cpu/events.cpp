@@ -0,0 +1,76 @@
+#include "cpu.h"
+#include "timer.h"
+
+#define IRQ_TIMER (1 << 2)
+
+void CPU::dispatch_events()
+{
+	while(events.next() <= cycles)
+	{
+		// Each event is handled as of the cycle it was due, not the end of the
+		// instruction that ran past it, so nothing drifts.
+		uint64_t when;
+		switch(events.pop(when))
+		{
+			case Scheduler::LINE:
+				int_flags |= screen->end_line(when);
+				if(screen->scanline == VBLANK_START)
+				{
+					frames++;
+				}
+				events.schedule(Scheduler::LINE, when + CYCLES_PER_LINE);
+				if(screen->scanline < VBLANK_START)
+				{
+					events.schedule(Scheduler::DRAW, when + OAM_CYCLES);
+				}
+				schedule_hblank();
+			break;
+
+			case Scheduler::DRAW:
+				screen->draw_line();
+			break;
+
+			case Scheduler::HBLANK:
+				int_flags |= screen->start_hblank();
+			break;
+
+			case Scheduler::TIMER:
+				int_flags |= IRQ_TIMER;
+				timer->overflow(when);
+				events.schedule(Scheduler::TIMER, timer->next_overflow());
+			break;
+
+			case Scheduler::DMA:
+				dma_active = false;
+			break;
+
+			case Scheduler::SERIAL:
+				serial_out += (char)serial_data;
+				serial_data = 0xff;
+				serial_control &= 0x7f;
+				int_flags |= IRQ_SERIAL;
+			break;
+
+			default:
+			break;
+		}
+	}
+}
+
+// Also cuts short whatever run() is in the middle of, if the event is due
+// before it would have stopped.
+void CPU::schedule(Scheduler::Event e, uint64_t when)
+{
+	events.schedule(e, when);
+	if(when < run_deadline)
+	{
+		run_deadline = when;
+	}
+}
+
+// Mode 0 only needs an event while STAT asks for an interrupt on it.
+void CPU::schedule_hblank()
+{
+	uint64_t when = screen->line_start + OAM_CYCLES + DRAW_CYCLES;
+	schedule(Scheduler::HBLANK, screen->wants_hblank() && when > cycles ? when : Scheduler::NEVER);
+}
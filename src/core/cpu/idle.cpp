@@ -0,0 +1,146 @@
+#include <string.h>
+#include "cpu.h"
+
+// Where the CPU would only be waiting, run() skips ahead: to the next event,
+// or the end of the run if that's sooner, as run_deadline says. Nothing the
+// CPU could see changes before then, so this lands in the same state as
+// executing every instruction would.
+
+// A halted CPU only wakes when IF & IE goes non-zero, which takes an event.
+void CPU::skip_halt()
+{
+	uint64_t target = events.next();
+	if(run_deadline > cycles && run_deadline < target)
+	{
+		target = run_deadline;
+	}
+	if(target <= cycles)
+	{
+		target = cycles + 4; // being stepped by hand past an event
+	}
+
+	halted_cycles += target - cycles;
+	cycles = target;
+}
+
+// Called on the second and later passes of a loop, at its head. The first
+// time, checks what the loop does; after that, once a whole pass has left
+// every register as it was with no event in between, the passes from here on
+// are all the same, so as many as fit before run_deadline are skipped.
+void CPU::idle_loop()
+{
+	regs.af.f = get_f(); // so the flags are compared too
+
+	if(loop_state == LOOP_SEEN)
+	{
+		if(!loop_only_reads())
+		{
+			loop_state = LOOP_REJECTED;
+			return;
+		}
+		loop_state = LOOP_WATCHING;
+	}
+	else if(loop_next_event == events.next() && memcmp(&loop_regs, &regs, sizeof(regs)) == 0)
+	{
+		uint64_t length = cycles - loop_start;
+		uint64_t target = run_deadline < events.next() ? run_deadline : events.next();
+		if(target > cycles)
+		{
+			uint64_t skip = (target - cycles) / length * length;
+			idle_cycles += skip;
+			cycles += skip;
+		}
+	}
+
+	loop_regs = regs;
+	loop_start = cycles;
+	loop_next_event = events.next();
+}
+
+// Is the loop at loop_head a short run of instructions that only change
+// registers and read memory, ending with the jr back? Reads of DIV, TIMA and
+// STAT don't count, since those change with time rather than on events.
+bool CPU::loop_only_reads()
+{
+	uint16_t pc = loop_head;
+	while((uint16_t)(pc - loop_head) < 16)
+	{
+		uint8_t bytes[3];
+		int i = 0;
+		for(; i < 3; i++)
+		{
+			uint8_t *page = read_map[(uint16_t)(pc + i) >> 8];
+			if(page == nullptr)
+			{
+				return false;
+			}
+			bytes[i] = page[(pc + i) & 0xff];
+		}
+
+		int len = 1;
+		int addr = -1; // memory read, if any
+		switch(bytes[0])
+		{
+			case 0x00: // nop
+			case 0x04: case 0x05: case 0x0c: case 0x0d: case 0x15: case 0x1d: case 0x3d: // inc/dec r
+			case 0x17: case 0x2f: // rla, cpl
+			case 0x47: case 0x4f: case 0x57: case 0x5f: case 0x67: // ld r, r
+			case 0x78: case 0x79: case 0x7b: case 0x7c: case 0x7d: case 0x7f:
+			case 0x87: case 0x90: case 0xa1: case 0xa7: case 0xa9: case 0xaf: case 0xb0: case 0xb1: // alu a, r
+			break;
+
+			case 0x06: case 0x0e: case 0x16: case 0x1e: case 0x2e: case 0x3e: // ld r, n
+			case 0xe6: case 0xfe: // and n, cp n
+				len = 2;
+			break;
+
+			case 0x0a: // ld a, (bc)
+				addr = regs.bc.full;
+			break;
+
+			case 0x1a: // ld a, (de)
+				addr = regs.de.full;
+			break;
+
+			case 0x56: case 0x5e: case 0x7e: case 0x86: case 0xbe: // ld r, (hl), add/cp (hl)
+				addr = regs.hl.full;
+			break;
+
+			case 0xf0: // ldh a, (n)
+				len = 2;
+				addr = 0xff00 | bytes[1];
+			break;
+
+			case 0xfa: // ld a, (nn)
+				len = 3;
+				addr = bytes[1] | (bytes[2] << 8);
+			break;
+
+			case 0xcb:
+				len = 2;
+				if((bytes[1] & 7) == 6) // (hl)
+				{
+					if(bytes[1] < 0x40 || bytes[1] >= 0x80) // only bit reads, the rest write it back
+					{
+						return false;
+					}
+					addr = regs.hl.full;
+				}
+			break;
+
+			case 0x18: case 0x20: case 0x28: // jr, jr nz, jr z
+				return (uint16_t)(pc + 2 + (int8_t)bytes[1]) == loop_head; // anything else isn't a simple loop
+
+			default:
+				return false;
+		}
+
+		if(addr == 0xff04 || addr == 0xff05 || addr == 0xff41)
+		{
+			return false;
+		}
+		pc += len;
+	}
+
+	return false;
+}
@@ -0,0 +1,974 @@
+#ifdef GP_JIT
+#include "jit_x64.h"
+#include "blockcache.h"
+#include "cpu.h"
+#include <string.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+#define JIT_MAX_BLOCK_CODE (16 * 1024) // room needed to start compiling another block
+#define JIT_MAX_BLOCK_OPS 64
+#define JIT_HOT_THRESHOLD 2
+
+enum HostReg
+{
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum Cond
+{
+	CC_Z = 0x4,
+	CC_NZ = 0x5
+};
+
+enum AluOp
+{
+	ALU_ADD = 0,
+	ALU_OR = 1,
+	ALU_AND = 4,
+	ALU_SUB = 5,
+	ALU_XOR = 6,
+	ALU_CMP = 7
+};
+
+// Guest register numbering, the same order as CPU::regnums.
+enum GuestReg
+{
+	GB_B, GB_C, GB_D, GB_E, GB_H, GB_L, GB_HL_MEM, GB_A
+};
+
+#define HOST_A R12
+#define HOST_BC R14
+#define HOST_DE R15
+#define HOST_HL RBX
+
+static uint8_t jit_read8(CPU *c, uint16_t virt)
+{
+	return c->read8(virt);
+}
+
+static void jit_write8(CPU *c, uint16_t virt, uint8_t v)
+{
+	c->write8(virt, v);
+}
+
+static uint16_t jit_read16(CPU *c, uint16_t virt)
+{
+	return c->read16(virt);
+}
+
+static void jit_write16(CPU *c, uint16_t virt, uint16_t v)
+{
+	c->write16(virt, v);
+}
+
+// Just enough of an x86-64 assembler for the translations below. Memory
+// operands are always [rbp + disp32], i.e. a member of the CPU.
+class Emitter
+{
+public:
+	Emitter(uint8_t *buf) : start(buf), p(buf) {}
+
+	uint8_t *start;
+	uint8_t *p;
+
+	void byte(uint8_t b) { *p++ = b; }
+	void u16(uint16_t v) { memcpy(p, &v, 2); p += 2; }
+	void u32(uint32_t v) { memcpy(p, &v, 4); p += 4; }
+	void u64(uint64_t v) { memcpy(p, &v, 8); p += 8; }
+
+	void rex(bool w, int reg, int base, bool force = false)
+	{
+		uint8_t r = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+		if(r != 0x40 || force)
+		{
+			byte(r);
+		}
+	}
+
+	void modrm_reg(int reg, int rm) { byte(0xc0 | ((reg & 7) << 3) | (rm & 7)); }
+	void modrm_mem(int reg, int32_t disp) { byte(0x80 | ((reg & 7) << 3) | RBP); u32(disp); }
+
+	void mov_imm(int r, uint32_t imm) { rex(false, 0, r); byte(0xb8 + (r & 7)); u32(imm); }
+	void mov(int dst, int src) { rex(false, src, dst); byte(0x89); modrm_reg(src, dst); }
+	void alu_imm(AluOp op, int r, uint32_t imm) { rex(false, 0, r); byte(0x81); modrm_reg(op, r); u32(imm); }
+	void alu(AluOp op, int dst, int src) { rex(false, src, dst); byte(op * 8 + 1); modrm_reg(src, dst); }
+	void shl(int r, uint8_t n) { rex(false, 0, r); byte(0xc1); modrm_reg(4, r); byte(n); }
+	void shr(int r, uint8_t n) { rex(false, 0, r); byte(0xc1); modrm_reg(5, r); byte(n); }
+	void not_(int r) { rex(false, 0, r); byte(0xf7); modrm_reg(2, r); }
+	void movzx8(int dst, int src) { rex(false, dst, src, src >= 4); byte(0x0f); byte(0xb6); modrm_reg(dst, src); }
+	void movzx16(int dst, int src) { rex(false, dst, src); byte(0x0f); byte(0xb7); modrm_reg(dst, src); }
+
+	void load8(int dst, int32_t disp) { rex(false, dst, RBP); byte(0x0f); byte(0xb6); modrm_mem(dst, disp); }
+	void load16(int dst, int32_t disp) { rex(false, dst, RBP); byte(0x0f); byte(0xb7); modrm_mem(dst, disp); }
+	void store8(int32_t disp, int src) { rex(false, src, RBP, src >= 4); byte(0x88); modrm_mem(src, disp); }
+	void store16(int32_t disp, int src) { byte(0x66); rex(false, src, RBP); byte(0x89); modrm_mem(src, disp); }
+	void store8_imm(int32_t disp, uint8_t imm) { byte(0xc6); modrm_mem(0, disp); byte(imm); }
+	void store16_imm(int32_t disp, uint16_t imm) { byte(0x66); byte(0xc7); modrm_mem(0, disp); u16(imm); }
+	void cmp8_imm(int32_t disp, uint8_t imm) { byte(0x80); modrm_mem(7, disp); byte(imm); }
+	void add64_imm(int32_t disp, uint32_t imm) { byte(0x48); byte(0x81); modrm_mem(0, disp); u32(imm); }
+
+	// mov rax, [rbp + rax*8 + disp]
+	void load_page(int32_t disp) { byte(0x48); byte(0x8b); byte(0x84); byte(0xc5); u32(disp); }
+
+	void call(const void *fn) { byte(0x48); byte(0xb8); u64((uint64_t)fn); byte(0xff); byte(0xd0); }
+
+	uint8_t *jcc(Cond cc) { byte(0x0f); byte(0x80 + cc); u32(0); return p - 4; }
+	uint8_t *jmp() { byte(0xe9); u32(0); return p - 4; }
+	void bind(uint8_t *at) { int32_t rel = (int32_t)(p - (at + 4)); memcpy(at, &rel, 4); }
+};
+
+// Everything needed while translating one block.
+class BlockCompiler
+{
+public:
+	BlockCompiler(CPU *cpu, uint8_t *buf) : e(buf), cpu(cpu), cycles(0)
+	{
+		off_a = member(&cpu->regs.af.a);
+		off_flag_z = member(&cpu->flag_z);
+		off_flag_c = member(&cpu->flag_c);
+		off_flag_n = member(&cpu->flag_n);
+		off_flag_h = member(&cpu->flag_h);
+		off_bc = member(&cpu->regs.bc.full);
+		off_de = member(&cpu->regs.de.full);
+		off_hl = member(&cpu->regs.hl.full);
+		off_sp = member(&cpu->regs.sp);
+		off_pc = member(&cpu->regs.pc);
+		off_cycles = member(&cpu->cycles);
+		off_read_map = member(&cpu->read_map[0]);
+		off_write_map = member(&cpu->write_map[0]);
+		off_loop_exit = member(&cpu->jit_loop_exit);
+	}
+
+	Emitter e;
+	CPU *cpu;
+
+	uint32_t cycles; // accumulated since the start of the block
+	std::vector<uint8_t*> to_epilogue;
+
+	int32_t off_a, off_bc, off_de, off_hl, off_sp, off_pc, off_cycles;
+	int32_t off_flag_z, off_flag_c, off_flag_n, off_flag_h;
+	int32_t off_read_map, off_write_map, off_loop_exit;
+
+	int32_t member(const void *m)
+	{
+		return (int32_t)((const uint8_t*)m - (const uint8_t*)cpu);
+	}
+
+	void prologue()
+	{
+		e.byte(0x53); // push rbx
+		e.byte(0x55); // push rbp
+		e.byte(0x41); e.byte(0x54); // push r12
+		e.byte(0x41); e.byte(0x55); // push r13
+		e.byte(0x41); e.byte(0x56); // push r14
+		e.byte(0x41); e.byte(0x57); // push r15
+		e.byte(0x48); e.byte(0x83); e.byte(0xec); e.byte(0x08); // sub rsp, 8 (realign the stack)
+		e.byte(0x48); e.byte(0x89); e.byte(0xfd); // mov rbp, rdi
+
+		e.load8(HOST_A, off_a);
+		e.load16(HOST_BC, off_bc);
+		e.load16(HOST_DE, off_de);
+		e.load16(HOST_HL, off_hl);
+	}
+
+	void epilogue()
+	{
+		size_t i = 0;
+		for(; i < to_epilogue.size(); i++)
+		{
+			e.bind(to_epilogue[i]);
+		}
+
+		e.store8(off_a, HOST_A);
+		e.store16(off_bc, HOST_BC);
+		e.store16(off_de, HOST_DE);
+		e.store16(off_hl, HOST_HL);
+
+		e.byte(0x48); e.byte(0x83); e.byte(0xc4); e.byte(0x08); // add rsp, 8
+		e.byte(0x41); e.byte(0x5f); // pop r15
+		e.byte(0x41); e.byte(0x5e); // pop r14
+		e.byte(0x41); e.byte(0x5d); // pop r13
+		e.byte(0x41); e.byte(0x5c); // pop r12
+		e.byte(0x5d); // pop rbp
+		e.byte(0x5b); // pop rbx
+		e.byte(0xc3); // ret
+	}
+
+	// Leave the block with pc = next, having spent extra cycles beyond the
+	// ones already accumulated.
+	void exit_to(uint16_t next, uint32_t extra)
+	{
+		e.add64_imm(off_cycles, cycles + extra);
+		e.store16_imm(off_pc, next);
+		to_epilogue.push_back(e.jmp());
+	}
+
+	// Same, with the new pc in eax.
+	void exit_to_eax(uint32_t extra)
+	{
+		e.add64_imm(off_cycles, cycles + extra);
+		e.store16(off_pc, RAX);
+		to_epilogue.push_back(e.jmp());
+	}
+
+	// A taken jr, which tells run_jit() to look for an idle loop if it's
+	// backward, as the interpreter's jrs do.
+	void exit_jr(uint16_t next, int8_t ofs)
+	{
+		if(ofs < 0)
+		{
+			e.store8_imm(off_loop_exit, 1);
+		}
+		exit_to(next, 12);
+	}
+
+	int pair(int g)
+	{
+		return g < GB_D ? HOST_BC : (g < GB_H ? HOST_DE : HOST_HL);
+	}
+
+	// eax = guest register g
+	void get8(int g)
+	{
+		if(g == GB_A)
+		{
+			e.mov(RAX, HOST_A);
+		}
+		else if(g % 2 == 0) // b, d, h
+		{
+			e.mov(RAX, pair(g));
+			e.shr(RAX, 8);
+		}
+		else
+		{
+			e.movzx8(RAX, pair(g));
+		}
+	}
+
+	// guest register g = eax, which must already be 0-255
+	void set8(int g)
+	{
+		if(g == GB_A)
+		{
+			e.mov(HOST_A, RAX);
+		}
+		else if(g % 2 == 0)
+		{
+			e.alu_imm(ALU_AND, pair(g), 0xff);
+			e.mov(RCX, RAX);
+			e.shl(RCX, 8);
+			e.alu(ALU_OR, pair(g), RCX);
+		}
+		else
+		{
+			e.alu_imm(ALU_AND, pair(g), 0xff00);
+			e.alu(ALU_OR, pair(g), RAX);
+		}
+	}
+
+	// Blocks keep the flags the way the interpreter does, in the CPU's lazy
+	// flag_z/c/n/h (see CPU::alu_flags()), so nothing has to be converted on
+	// the way in or out.
+
+	// ecx = 1 if C is set
+	void get_carry()
+	{
+		e.load16(RCX, off_flag_c);
+		e.shr(RCX, 8);
+		e.alu_imm(ALU_AND, RCX, 1);
+	}
+
+	// a + ecx or a - ecx and the flags it leaves, into a unless it's a cp.
+	// Clobbers eax and edx.
+	void add_sub(AluOp op, bool store)
+	{
+		e.mov(RAX, HOST_A);
+		e.alu(op, RAX, RCX);
+		e.store8(off_flag_z, RAX);
+		e.store16(off_flag_c, RAX); // the carry or borrow is in bit 8
+		e.store8_imm(off_flag_n, op == ALU_SUB);
+		e.mov(RDX, HOST_A);
+		e.alu(ALU_XOR, RDX, RCX);
+		e.alu(ALU_XOR, RDX, RAX);
+		e.store8(off_flag_h, RDX);
+		if(store)
+		{
+			e.movzx8(HOST_A, RAX);
+		}
+	}
+
+	// Flags for inc or dec of edx, which came to eax. Clobbers edx.
+	void inc_dec_flags(bool dec)
+	{
+		e.store8(off_flag_z, RAX);
+		e.store8_imm(off_flag_n, dec);
+		e.alu(ALU_XOR, RDX, RAX);
+		e.alu_imm(ALU_XOR, RDX, 1);
+		e.store8(off_flag_h, RDX);
+	}
+
+	// Flags for and, xor and or, from a.
+	void logic_flags(bool is_and)
+	{
+		e.store8(off_flag_z, HOST_A);
+		e.store16_imm(off_flag_c, 0);
+		e.store8_imm(off_flag_n, 0);
+		e.store8_imm(off_flag_h, is_and ? 0x10 : 0);
+	}
+
+	// Flags for a rotate, shift or swap that came to eax, other than C.
+	void shift_flags()
+	{
+		e.store8(off_flag_z, RAX);
+		e.store8_imm(off_flag_n, 0);
+		e.store8_imm(off_flag_h, 0);
+	}
+
+	// fn(cpu, esi, edx), with cpu->cycles brought up to the current
+	// instruction for the duration: timer and LCD registers depend on it.
+	void call_out(const void *fn)
+	{
+		e.byte(0x48); e.byte(0x89); e.byte(0xef); // mov rdi, rbp
+		if(cycles != 0)
+		{
+			e.add64_imm(off_cycles, cycles);
+		}
+		e.call(fn);
+		if(cycles != 0)
+		{
+			e.add64_imm(off_cycles, (uint32_t)-cycles);
+		}
+	}
+
+	// eax = read8(esi)
+	void read8()
+	{
+		e.mov(RAX, RSI);
+		e.shr(RAX, 8);
+		e.load_page(off_read_map);
+		e.byte(0x48); e.byte(0x85); e.byte(0xc0); // test rax, rax
+		uint8_t *slow = e.jcc(CC_Z);
+		e.movzx8(RCX, RSI);
+		e.byte(0x0f); e.byte(0xb6); e.byte(0x04); e.byte(0x08); // movzx eax, byte [rax + rcx]
+		uint8_t *done = e.jmp();
+		e.bind(slow);
+		call_out((const void*)&jit_read8);
+		e.movzx8(RAX, RAX);
+		e.bind(done);
+	}
+
+	// write8(esi, dl)
+	void write8()
+	{
+		e.mov(RAX, RSI);
+		e.shr(RAX, 8);
+		e.load_page(off_write_map);
+		e.byte(0x48); e.byte(0x85); e.byte(0xc0); // test rax, rax
+		uint8_t *slow = e.jcc(CC_Z);
+		e.movzx8(RCX, RSI);
+		e.byte(0x88); e.byte(0x14); e.byte(0x08); // mov [rax + rcx], dl
+		uint8_t *done = e.jmp();
+		e.bind(slow);
+		call_out((const void*)&jit_write8);
+		e.bind(done);
+	}
+
+	// eax = read16(esi)
+	void read16()
+	{
+		call_out((const void*)&jit_read16);
+		e.movzx16(RAX, RAX);
+	}
+
+	// write16(esi, dx)
+	void write16()
+	{
+		call_out((const void*)&jit_write16);
+	}
+
+	// esi = sp -= 2
+	void push_sp()
+	{
+		e.load16(RSI, off_sp);
+		e.alu_imm(ALU_SUB, RSI, 2);
+		e.movzx16(RSI, RSI);
+		e.store16(off_sp, RSI);
+	}
+
+	// esi = sp, sp += 2
+	void pop_sp()
+	{
+		e.load16(RSI, off_sp);
+		e.load16(RCX, off_sp);
+		e.alu_imm(ALU_ADD, RCX, 2);
+		e.store16(off_sp, RCX);
+	}
+
+	// Translate the instruction at pc, whose bytes start at code. Returns
+	// false for an opcode without a translation, true otherwise; *end is set
+	// for instructions that leave the block.
+	bool translate(uint16_t pc, const uint8_t *code, bool *end);
+};
+
+bool BlockCompiler::translate(uint16_t pc, const uint8_t *code, bool *end)
+{
+	uint8_t op = code[0];
+	uint8_t n = code[1];
+	uint16_t nn = code[1] | (code[2] << 8);
+
+	*end = false;
+
+	switch(op)
+	{
+		case 0x00: // nop
+			cycles += 4;
+		break;
+
+		case 0x06: case 0x0e: case 0x16: case 0x1e: case 0x2e: case 0x3e: // ld r, n
+			e.mov_imm(RAX, n);
+			set8(op >> 3);
+			cycles += 8;
+		break;
+
+		case 0x01: // ld bc, nn
+			e.mov_imm(HOST_BC, nn);
+			cycles += 12;
+		break;
+
+		case 0x11: // ld de, nn
+			e.mov_imm(HOST_DE, nn);
+			cycles += 12;
+		break;
+
+		case 0x21: // ld hl, nn
+			e.mov_imm(HOST_HL, nn);
+			cycles += 12;
+		break;
+
+		case 0x31: // ld sp, nn
+			e.store16_imm(off_sp, nn);
+			cycles += 12;
+		break;
+
+		case 0x03: case 0x13: case 0x23: // inc rr
+			e.alu_imm(ALU_ADD, pair((op >> 4) * 2), 1);
+			e.movzx16(pair((op >> 4) * 2), pair((op >> 4) * 2));
+			cycles += 8;
+		break;
+
+		case 0x0b: // dec bc
+			e.alu_imm(ALU_SUB, HOST_BC, 1);
+			e.movzx16(HOST_BC, HOST_BC);
+			cycles += 8;
+		break;
+
+		case 0x04: case 0x0c: case 0x24: // inc r
+			get8(op >> 3);
+			e.mov(RDX, RAX);
+			e.alu_imm(ALU_ADD, RAX, 1);
+			e.alu_imm(ALU_AND, RAX, 0xff);
+			inc_dec_flags(false);
+			set8(op >> 3);
+			cycles += 4;
+		break;
+
+		case 0x05: case 0x0d: case 0x15: case 0x1d: case 0x3d: // dec r
+			get8(op >> 3);
+			e.mov(RDX, RAX);
+			e.alu_imm(ALU_SUB, RAX, 1);
+			e.alu_imm(ALU_AND, RAX, 0xff);
+			inc_dec_flags(true);
+			set8(op >> 3);
+			cycles += 4;
+		break;
+
+		case 0x47: case 0x4f: case 0x57: case 0x5f: case 0x67: // ld r, a
+		case 0x78: case 0x79: case 0x7b: case 0x7c: case 0x7d: case 0x7f: // ld a, r
+			get8(op & 7);
+			set8((op >> 3) & 7);
+			cycles += 4;
+		break;
+
+		case 0x87: // add a, a
+			e.mov(RCX, HOST_A);
+			add_sub(ALU_ADD, true);
+			cycles += 4;
+		break;
+
+		case 0x90: // sub b
+			get8(GB_B);
+			e.mov(RCX, RAX);
+			add_sub(ALU_SUB, true);
+			cycles += 4;
+		break;
+
+		case 0xa1: case 0xa7: case 0xa9: case 0xb0: case 0xb1: // and/xor/or r
+			get8(op & 7);
+			e.alu(op < 0xa8 ? ALU_AND : (op < 0xb0 ? ALU_XOR : ALU_OR), HOST_A, RAX);
+			logic_flags(op < 0xa8);
+			cycles += 4;
+		break;
+
+		case 0xaf: // xor a
+			e.mov_imm(HOST_A, 0);
+			logic_flags(false);
+			cycles += 4;
+		break;
+
+		case 0x2f: // cpl a
+			e.not_(HOST_A);
+			e.alu_imm(ALU_AND, HOST_A, 0xff);
+			e.store8_imm(off_flag_n, 1);
+			e.store8_imm(off_flag_h, 0x10);
+			cycles += 4;
+		break;
+
+		case 0xe6: // and n
+			e.alu_imm(ALU_AND, HOST_A, n);
+			logic_flags(true);
+			cycles += 8;
+		break;
+
+		case 0xfe: // cp n
+			e.mov_imm(RCX, n);
+			add_sub(ALU_SUB, false);
+			cycles += 8;
+		break;
+
+		case 0x19: // add hl, de
+			e.mov(RAX, HOST_HL);
+			e.alu(ALU_ADD, RAX, HOST_DE);
+			e.mov(RCX, RAX);
+			e.shr(RCX, 8);
+			e.store16(off_flag_c, RCX); // the carry out of bit 15
+			e.store8_imm(off_flag_n, 0);
+			e.mov(RDX, HOST_HL);
+			e.alu(ALU_XOR, RDX, HOST_DE);
+			e.alu(ALU_XOR, RDX, RAX);
+			e.shr(RDX, 8);
+			e.store8(off_flag_h, RDX); // and out of bit 11
+			e.movzx16(HOST_HL, RAX);
+			cycles += 12;
+		break;
+
+		case 0x17: // rla
+			get_carry();
+			e.mov(RAX, HOST_A);
+			e.shl(RAX, 1);
+			e.store16(off_flag_c, RAX);
+			e.alu(ALU_OR, RAX, RCX);
+			e.movzx8(HOST_A, RAX);
+			e.store8_imm(off_flag_z, 1); // Z is always clear
+			e.store8_imm(off_flag_n, 0);
+			e.store8_imm(off_flag_h, 0);
+			cycles += 4;
+		break;
+
+		case 0x0a: // ld a, (bc)
+		case 0x1a: // ld a, (de)
+			e.mov(RSI, op == 0x0a ? HOST_BC : HOST_DE);
+			read8();
+			e.mov(HOST_A, RAX);
+			cycles += 8;
+		break;
+
+		case 0x56: case 0x5e: case 0x7e: // ld r, (hl)
+			e.mov(RSI, HOST_HL);
+			read8();
+			set8((op >> 3) & 7);
+			cycles += 8;
+		break;
+
+		case 0x02: // ld (bc), a
+		case 0x12: // ld (de), a
+			e.mov(RSI, op == 0x02 ? HOST_BC : HOST_DE);
+			e.mov(RDX, HOST_A);
+			write8();
+			cycles += 8;
+		break;
+
+		case 0x77: case 0x22: case 0x32: // ld (hl), a / ldi / ldd
+			e.mov(RSI, HOST_HL);
+			e.mov(RDX, HOST_A);
+			write8();
+			if(op != 0x77)
+			{
+				e.alu_imm(op == 0x22 ? ALU_ADD : ALU_SUB, HOST_HL, 1);
+				e.movzx16(HOST_HL, HOST_HL);
+			}
+			cycles += 8;
+		break;
+
+		case 0x36: // ld (hl), n
+			e.mov(RSI, HOST_HL);
+			e.mov_imm(RDX, n);
+			write8();
+			cycles += 12;
+		break;
+
+		case 0x35: // dec (hl)
+			e.mov(RSI, HOST_HL);
+			read8();
+			e.mov(RDX, RAX);
+			e.alu_imm(ALU_SUB, RAX, 1);
+			e.alu_imm(ALU_AND, RAX, 0xff);
+			inc_dec_flags(true);
+			e.mov(RDX, RAX);
+			e.mov(RSI, HOST_HL);
+			write8();
+			cycles += 12;
+		break;
+
+		case 0x86: // add a, (hl)
+		case 0xbe: // cp (hl)
+			e.mov(RSI, HOST_HL);
+			read8();
+			e.mov(RCX, RAX);
+			add_sub(op == 0x86 ? ALU_ADD : ALU_SUB, op == 0x86);
+			cycles += 8;
+		break;
+
+		case 0xea: // ld (nn), a
+			e.mov_imm(RSI, nn);
+			e.mov(RDX, HOST_A);
+			write8();
+			cycles += 16;
+		break;
+
+		case 0xfa: // ld a, (nn)
+			e.mov_imm(RSI, nn);
+			read8();
+			e.mov(HOST_A, RAX);
+			cycles += 16;
+		break;
+
+		case 0xe0: // ld (ff00+n), a
+			e.mov_imm(RSI, 0xff00 + n);
+			e.mov(RDX, HOST_A);
+			write8();
+			cycles += 12;
+		break;
+
+		case 0xf0: // ld a, (ff00+n)
+			e.mov_imm(RSI, 0xff00 + n);
+			read8();
+			e.mov(HOST_A, RAX);
+			cycles += 12;
+		break;
+
+		case 0xe2: // ld (ff00+c), a
+			e.movzx8(RSI, HOST_BC);
+			e.alu_imm(ALU_ADD, RSI, 0xff00);
+			e.mov(RDX, HOST_A);
+			write8();
+			cycles += 8;
+		break;
+
+		case 0x2a: // ld hl, (nn)
+			e.mov_imm(RSI, nn);
+			read16();
+			e.mov(HOST_HL, RAX);
+			cycles += 16;
+		break;
+
+		// push af and pop af are left to the interpreter, which has the code
+		// to put F together from the lazy flags and take it apart again.
+		case 0xc5: case 0xd5: case 0xe5: // push rr
+			push_sp();
+			e.mov(RDX, pair(((op >> 4) - 0xc) * 2));
+			write16();
+			cycles += 16;
+		break;
+
+		case 0xc1: case 0xd1: case 0xe1: // pop rr
+			pop_sp();
+			read16();
+			e.mov(pair(((op >> 4) - 0xc) * 2), RAX);
+			cycles += 12;
+		break;
+
+		case 0xcb:
+		{
+			int g = n & 7;
+			if(g == GB_HL_MEM)
+			{
+				return false;
+			}
+
+			switch(n & 0xf8)
+			{
+				case 0x10: // rl r
+					get_carry();
+					get8(g);
+					e.shl(RAX, 1);
+					e.store16(off_flag_c, RAX);
+					e.alu(ALU_OR, RAX, RCX);
+					e.alu_imm(ALU_AND, RAX, 0xff);
+					shift_flags();
+					set8(g);
+				break;
+
+				case 0x18: // rr r
+					get_carry();
+					e.shl(RCX, 7);
+					get8(g);
+					e.mov(RDX, RAX);
+					e.shl(RDX, 8);
+					e.store16(off_flag_c, RDX);
+					e.shr(RAX, 1);
+					e.alu(ALU_OR, RAX, RCX);
+					shift_flags();
+					set8(g);
+				break;
+
+				case 0x30: // swap r
+					get8(g);
+					e.mov(RCX, RAX);
+					e.shl(RAX, 4);
+					e.shr(RCX, 4);
+					e.alu(ALU_OR, RAX, RCX);
+					e.alu_imm(ALU_AND, RAX, 0xff);
+					e.store16_imm(off_flag_c, 0);
+					shift_flags();
+					set8(g);
+				break;
+
+				default:
+					if(n >= 0x40 && n < 0x80) // bit
+					{
+						get8(g);
+						e.alu_imm(ALU_AND, RAX, 1 << ((n >> 3) & 7));
+						e.store8(off_flag_z, RAX);
+						e.store8_imm(off_flag_n, 0);
+						e.store8_imm(off_flag_h, 0x10);
+					}
+					else if(n < 0x80) // the rest of the rotates and shifts
+					{
+						return false;
+					}
+					// res and set are still no-ops in the interpreter
+				break;
+			}
+			cycles += 8;
+		}
+		break;
+
+		case 0x18: // jr n
+			exit_jr(pc + 2 + (int8_t)n, (int8_t)n);
+			*end = true;
+		break;
+
+		case 0x20: case 0x28: // jr nz / jr z
+		{
+			e.cmp8_imm(off_flag_z, 0); // equal if Z is set
+			uint8_t *not_taken = e.jcc(op == 0x20 ? CC_Z : CC_NZ);
+			exit_jr(pc + 2 + (int8_t)n, (int8_t)n);
+			e.bind(not_taken);
+			exit_to(pc + 2, 8);
+			*end = true;
+		}
+		break;
+
+		case 0xc3: case 0xca: // jp nn (0xca is unconditional in the interpreter too)
+			exit_to(nn, 12);
+			*end = true;
+		break;
+
+		case 0xcd: // call nn
+			push_sp();
+			e.mov_imm(RDX, (uint16_t)(pc + 3));
+			write16();
+			exit_to(nn, 24);
+			*end = true;
+		break;
+
+		case 0xc9: // ret
+			pop_sp();
+			read16();
+			exit_to_eax(16);
+			*end = true;
+		break;
+
+		case 0xe9: // jp (hl)
+			e.mov(RAX, HOST_HL);
+			exit_to_eax(4);
+			*end = true;
+		break;
+
+		default:
+			return false;
+	}
+
+	return true;
+}
+
+JitX64::JitX64(CPU *cpu)
+{
+	this->cpu = cpu;
+
+	// No page is ever writable and executable at once: compile() makes the
+	// pages it's about to write to writable, and executable again after.
+	// Trying that on the first page up front finds out whether the system
+	// lets us make memory executable at all.
+	page_size = sysconf(_SC_PAGESIZE);
+	code_size = JIT_CODE_SIZE;
+	code_used = 0;
+	code_buf = (uint8_t*)mmap(nullptr, code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(code_buf != MAP_FAILED && mprotect(code_buf, page_size, PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(code_buf, code_size);
+		code_buf = (uint8_t*)MAP_FAILED;
+	}
+	if(code_buf == MAP_FAILED)
+	{
+		printf("jit: couldn't map executable memory, interpreting instead\n");
+		code_buf = nullptr;
+	}
+
+	memset(recent_host, 0, sizeof(recent_host));
+	memset(recent, 0, sizeof(recent));
+}
+
+JitX64::~JitX64()
+{
+	flush();
+	if(code_buf != nullptr)
+	{
+		munmap(code_buf, code_size);
+	}
+}
+
+bool JitX64::ok()
+{
+	return code_buf != nullptr;
+}
+
+void JitX64::flush()
+{
+	std::unordered_map<uint8_t*, Page*>::iterator it = pages.begin();
+	for(; it != pages.end(); it++)
+	{
+		delete it->second;
+	}
+	pages.clear();
+
+	memset(recent_host, 0, sizeof(recent_host));
+	memset(recent, 0, sizeof(recent));
+	code_used = 0;
+}
+
+JitX64::BlockFn JitX64::lookup(uint16_t pc)
+{
+	uint8_t p = pc >> 8;
+	uint8_t *host = cpu->read_map[p];
+
+	// Only rom is compiled, so blocks never have to be invalidated.
+	if(host == nullptr || cpu->write_map[p] != nullptr || cpu->write_watch[p] != 0)
+	{
+		return nullptr;
+	}
+
+	if(recent_host[p] != host)
+	{
+		Page *&page = pages[host];
+		if(page == nullptr)
+		{
+			page = new Page;
+			memset(page->entry, 0, sizeof(page->entry));
+		}
+		recent_host[p] = host;
+		recent[p] = page;
+	}
+
+	Entry &ent = recent[p]->entry[pc & 0xff];
+	if(ent.code != nullptr || ent.failed)
+	{
+		return ent.code;
+	}
+
+	if(++ent.hits < JIT_HOT_THRESHOLD)
+	{
+		return nullptr;
+	}
+
+	if(code_size - code_used < JIT_MAX_BLOCK_CODE)
+	{
+		flush();
+		return nullptr;
+	}
+
+	ent.code = compile(host, pc);
+	ent.failed = ent.code == nullptr;
+	return ent.code;
+}
+
+JitX64::BlockFn JitX64::compile(uint8_t *host_page, uint16_t pc)
+{
+	// lookup() left room for JIT_MAX_BLOCK_CODE, and code_size is a whole
+	// number of pages, so these stay inside code_buf. The first page may
+	// hold the end of the last block, which isn't running now.
+	uint8_t *first_page = code_buf + (code_used & ~(page_size - 1));
+	size_t writable = ((code_used + JIT_MAX_BLOCK_CODE + page_size - 1) & ~(page_size - 1)) - (first_page - code_buf);
+	if(mprotect(first_page, writable, PROT_READ | PROT_WRITE) != 0)
+	{
+		return nullptr;
+	}
+
+	BlockCompiler bc(cpu, code_buf + code_used);
+	bc.prologue();
+
+	unsigned int ofs = pc & 0xff;
+	int count = 0;
+	bool end = false;
+
+	while(!end && count < JIT_MAX_BLOCK_OPS)
+	{
+		const uint8_t *code = host_page + ofs;
+		unsigned int len = op_length[code[0]];
+		uint8_t *mark = bc.e.p;
+		uint32_t mark_cycles = bc.cycles;
+
+		if(ofs + len > 0x100 || !bc.translate(pc, code, &end))
+		{
+			bc.e.p = mark; // drop anything emitted before translate gave up
+			bc.cycles = mark_cycles;
+			break;
+		}
+
+		ofs += len;
+		pc += len;
+		count++;
+	}
+
+	if(count == 0)
+	{
+		if(mprotect(first_page, page_size, PROT_READ | PROT_EXEC) != 0)
+		{
+			flush();
+		}
+		return nullptr;
+	}
+
+	if(!end)
+	{
+		bc.exit_to(pc, 0);
+	}
+	bc.epilogue();
+
+	size_t written = ((bc.e.p - code_buf + page_size - 1) & ~(page_size - 1)) - (first_page - code_buf);
+	if(mprotect(first_page, written, PROT_READ | PROT_EXEC) != 0)
+	{
+		flush(); // the blocks before it in first_page can't run either now
+		return nullptr;
+	}
+
+	BlockFn fn = (BlockFn)(void*)bc.e.start;
+	code_used += bc.e.p - bc.e.start;
+	code_used = (code_used + 15) & ~(size_t)15;
+	return fn;
+}
+#endif
@@ -0,0 +1,70 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <unordered_map>
+
+class CPU;
+
+// Translates hot blocks of ROM-resident SM83 code into x86-64 machine code.
+//
+// While a block runs, a/f/bc/de/hl live in r12d/r13d/r14d/r15d/ebx, and
+// rbp points at the CPU. Memory accesses look up read_map/write_map inline
+// and call out to CPU::read8/write8 for pages that need the slow path.
+// Each block adds its cycles and stores pc on the way out, so interrupts and
+// the cycle budget are checked by the caller between blocks. A block leaving
+// through a taken backward jr also sets cpu->jit_loop_exit, and the caller
+// hands that to CPU::loop_branch(), so idle loops are skipped just as they
+// are when interpreted.
+//
+// Blocks end at every branch and go back through run_jit() and lookup(), with
+// no chaining between them, so on branch-heavy code with short blocks the JIT
+// runs slower than threaded dispatch (about 1.3G against 1.75G cycles/s on
+// GamePersonBench's branch mix).
+//
+// Only opcodes with a translation below are compiled; a block ends just
+// before the first one without, and the caller interprets it.
+class JitX64
+{
+public:
+	typedef void (*BlockFn)(CPU *cpu);
+
+	JitX64(CPU *cpu);
+	~JitX64();
+
+	// false if no executable memory could be mapped.
+	bool ok();
+
+	// Compiled code for the block at pc, or nullptr if the caller should
+	// interpret the next instruction instead.
+	BlockFn lookup(uint16_t pc);
+
+	// Drop all compiled code, for when the ROM behind it is replaced.
+	void flush();
+
+private:
+	struct Entry
+	{
+		BlockFn code;
+		uint8_t hits;
+		bool failed;
+	};
+
+	struct Page
+	{
+		Entry entry[0x100];
+	};
+
+	CPU *cpu;
+
+	uint8_t *code_buf;
+	size_t page_size;
+	size_t code_size;
+	size_t code_used;
+
+	std::unordered_map<uint8_t*, Page*> pages;
+	uint8_t *recent_host[0x100];
+	Page *recent[0x100];
+
+	BlockFn compile(uint8_t *host_page, uint16_t pc);
+};
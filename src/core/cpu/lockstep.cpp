@@ -0,0 +1,756 @@
+#include "lockstep.h"
+#ifdef GP_LOCKSTEP_LANES
+#include "cpu.h"
+#include "cartridge.h"
+#include <string.h>
+
+// Only matters for vectors passed across ABI boundaries, and these stay inside this file.
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+typedef LockstepGroup::lane8 lane8;
+typedef LockstepGroup::mask8 mask8;
+typedef LockstepGroup::lane16 lane16;
+typedef LockstepGroup::mask16 mask16;
+typedef LockstepGroup::slane16 slane16;
+
+#define LOCKSTEP_SLICE 0x7000 // cycles per slice, leaving room in left for the last instruction
+
+static inline lane8 sel8(mask8 m, lane8 v, lane8 old)
+{
+	return ((lane8)m & v) | (~(lane8)m & old);
+}
+
+static inline lane16 sel16(mask16 m, lane16 v, lane16 old)
+{
+	return ((lane16)m & v) | (~(lane16)m & old);
+}
+
+static inline lane16 pair(lane8 hi, lane8 lo)
+{
+	return (__builtin_convertvector(hi, lane16) << 8) | __builtin_convertvector(lo, lane16);
+}
+
+static inline lane8 lo8(lane16 v)
+{
+	return __builtin_convertvector(v, lane8);
+}
+
+static inline lane8 hi8(lane16 v)
+{
+	return __builtin_convertvector(v >> 8, lane8);
+}
+
+static inline lane16 wide(lane8 v)
+{
+	return __builtin_convertvector(v, lane16);
+}
+
+static inline bool any(mask8 m)
+{
+	uint64_t w[GP_LOCKSTEP_LANES / 8];
+	memcpy(w, &m, sizeof(m));
+
+	uint64_t x = 0;
+	int i = 0;
+	for(; i < GP_LOCKSTEP_LANES / 8; i++)
+	{
+		x |= w[i];
+	}
+	return x != 0;
+}
+
+static inline int lanes(mask8 m)
+{
+	uint64_t w[GP_LOCKSTEP_LANES / 8];
+	memcpy(w, &m, sizeof(m));
+
+	int n = 0;
+	int i = 0;
+	for(; i < GP_LOCKSTEP_LANES / 8; i++)
+	{
+		n += __builtin_popcountll(w[i]);
+	}
+	return n / 8;
+}
+
+// Index of the first lane set in m, which mustn't be empty.
+static inline int first_lane(mask8 m)
+{
+	uint64_t w[GP_LOCKSTEP_LANES / 8];
+	memcpy(w, &m, sizeof(m));
+
+	int i = 0;
+	for(; w[i] == 0; i++);
+	return i * 8 + __builtin_ctzll(w[i]) / 8;
+}
+
+static inline uint16_t min_lane(lane16 v)
+{
+	uint16_t x[GP_LOCKSTEP_LANES];
+	memcpy(x, &v, sizeof(v));
+
+	uint16_t m = x[0];
+	int i = 1;
+	for(; i < GP_LOCKSTEP_LANES; i++)
+	{
+		m = x[i] < m ? x[i] : m;
+	}
+	return m;
+}
+
+// Flag::Z where v is zero.
+static inline lane8 zero_flag(lane8 v)
+{
+	return (lane8)(v == 0) & (uint8_t)CPU::Flag::Z;
+}
+
+// F after an ALU op, from what CPU::alu_flags() takes: Z where z is zero, C
+// where bit 8 of c is set, N if n is, and H where bit 4 of h is set. Lanes
+// keep F whole rather than lazily: with every lane at once, putting it
+// together is only a few vector instructions.
+static inline lane8 alu_flags(lane8 z, lane16 c, bool n, lane8 h)
+{
+	lane8 f = zero_flag(z) | lo8((c >> 4) & (uint16_t)CPU::Flag::C) | ((h & 0x10) << 1);
+	return n ? f | (uint8_t)CPU::Flag::N : f;
+}
+
+LockstepGroup::LockstepGroup(CPU **cpus, int count)
+{
+	this->count = count;
+	shared_rom = true;
+	vector_instructions = 0;
+	scalar_instructions = 0;
+	a = f = b = c = d = e = h = l = lane8{};
+	sp = pc = lane16{};
+	low_bank = high_bank = lane16{};
+
+	int i = 0;
+	for(; i < GP_LOCKSTEP_LANES; i++)
+	{
+		cpu[i] = i < count ? cpus[i] : nullptr;
+	}
+
+	for(i = 1; i < count; i++)
+	{
+		CPU *first = cpu[0];
+		if(cpu[i]->cart_size != first->cart_size ||
+			(cpu[i]->cart != first->cart && memcmp(cpu[i]->cart, first->cart, first->cart_size) != 0) ||
+			(cpu[i]->bios == nullptr) != (first->bios == nullptr) ||
+			(first->bios != nullptr && memcmp(cpu[i]->bios, first->bios, 256) != 0))
+		{
+			shared_rom = false;
+		}
+	}
+}
+
+int LockstepGroup::size()
+{
+	return count;
+}
+
+void LockstepGroup::load(int i)
+{
+	CPU *cp = cpu[i];
+	a[i] = cp->regs.af.a;
+	f[i] = cp->get_f();
+	b[i] = cp->regs.bc.b;
+	c[i] = cp->regs.bc.c;
+	d[i] = cp->regs.de.d;
+	e[i] = cp->regs.de.e;
+	h[i] = cp->regs.hl.h;
+	l[i] = cp->regs.hl.l;
+	sp[i] = cp->regs.sp;
+	pc[i] = cp->regs.pc;
+	refresh(i);
+}
+
+void LockstepGroup::store(int i)
+{
+	CPU *cp = cpu[i];
+	cp->regs.af.a = a[i];
+	cp->set_f(f[i]);
+	cp->regs.bc.b = b[i];
+	cp->regs.bc.c = c[i];
+	cp->regs.de.d = d[i];
+	cp->regs.de.e = e[i];
+	cp->regs.hl.h = h[i];
+	cp->regs.hl.l = l[i];
+	cp->regs.sp = sp[i];
+	cp->regs.pc = pc[i];
+	cp->cycles = slice_end[i] - left[i];
+}
+
+// Only needed after something that can touch interrupt state, the memory
+// map or the event schedule: a scalar step, or a write to I/O.
+void LockstepGroup::refresh(int i)
+{
+	CPU *cp = cpu[i];
+	ok[i] = (cp->old_en == cp->int_enable_master && !cp->interrupt_pending() && !cp->halted) ? -1 : 0;
+	bios[i] = cp->flags.bios_enabled;
+	low_bank[i] = cp->cartridge->rom_offset(0) / 0x4000;
+	high_bank[i] = cp->cartridge->rom_offset(1) / 0x4000;
+
+	// End the slice early if an event has been brought forward.
+	uint64_t next = cp->events.next();
+	if(next < slice_end[i])
+	{
+		left[i] -= (int16_t)(slice_end[i] - next);
+		slice_end[i] = next;
+	}
+}
+
+bool LockstepGroup::step_lane(int i)
+{
+	CPU *cp = cpu[i];
+	store(i);
+
+	uint64_t before = cp->cycles;
+	cp->run_deadline = slice_end[i]; // how far HALT can skip
+	bool stop = cp->step();
+	left[i] -= (int16_t)(cp->cycles - before);
+	scalar_instructions++;
+
+	load(i);
+	if(stop)
+	{
+		live[i] = 0;
+	}
+	return stop;
+}
+
+// CPU::read8/write8 with the page table lookup inlined.
+inline uint8_t LockstepGroup::read_lane(int i, uint16_t virt)
+{
+	uint8_t *page = cpu[i]->read_map[virt >> 8];
+	if(page != nullptr)
+	{
+		return page[virt & 0xff];
+	}
+	cpu[i]->cycles = slice_end[i] - left[i]; // I/O registers can depend on the time
+	return cpu[i]->read8(virt);
+}
+
+inline uint16_t LockstepGroup::read16_lane(int i, uint16_t virt)
+{
+	return read_lane(i, virt) | (read_lane(i, virt + 1) << 8);
+}
+
+inline void LockstepGroup::write_lane(int i, uint16_t virt, uint8_t v)
+{
+	uint8_t *page = cpu[i]->write_map[virt >> 8];
+	if(page != nullptr)
+	{
+		page[virt & 0xff] = v;
+		return;
+	}
+
+	cpu[i]->cycles = slice_end[i] - left[i];
+	cpu[i]->write8(virt, v);
+	if(virt >= 0xff00 || virt < 0x8000) // I/O or bank switching
+	{
+		refresh(i);
+	}
+}
+
+bool LockstepGroup::run(uint64_t cycle_budget)
+{
+	bool stopped = false;
+
+	int i = 0;
+	for(; i < count; i++)
+	{
+		end[i] = cpu[i]->cycles + cycle_budget;
+	}
+
+	while(true)
+	{
+		bool more = false;
+		for(i = 0; i < count; i++)
+		{
+			// Slices stop at the lane's next event, as CPU::run() does.
+			CPU *cp = cpu[i];
+			if(cp->cycles < end[i] && cp->cycles >= cp->events.next())
+			{
+				cp->dispatch_events();
+			}
+
+			uint64_t cycles = cp->cycles;
+			uint64_t stop = cp->events.next() < end[i] ? cp->events.next() : end[i];
+			uint64_t slice = cycles < stop ? stop - cycles : 0;
+			if(slice > LOCKSTEP_SLICE)
+			{
+				slice = LOCKSTEP_SLICE;
+			}
+			more |= slice != 0;
+
+			slice_end[i] = cycles + slice;
+			left[i] = slice;
+			live[i] = -1;
+			load(i);
+		}
+		for(; i < GP_LOCKSTEP_LANES; i++)
+		{
+			left[i] = 0;
+			live[i] = 0;
+			ok[i] = 0;
+		}
+
+		if(!more)
+		{
+			break;
+		}
+
+		// Opcodes and operands have to come from ROM, where every lane sees the
+		// same bytes as long as it has the same banks mapped.
+		uint16_t rom_start = cpu[0]->read_map[0] != nullptr ? 0 : 0x100;
+		uint16_t rom_end = 0x100;
+		for(; rom_end < 0x8000 && cpu[0]->read_map[rom_end >> 8] != nullptr; rom_end += 0x100);
+
+		while(true)
+		{
+			mask8 active = live & __builtin_convertvector(left > 0, mask8);
+			mask8 vec = {};
+			if(shared_rom)
+			{
+				vec = active & ok & __builtin_convertvector((pc >= rom_start) & (pc < (uint16_t)(rom_end - 2)), mask8);
+			}
+
+			mask8 rest = active & ~vec;
+			bool scalar_step = any(rest);
+			if(scalar_step)
+			{
+				for(i = 0; i < count; i++)
+				{
+					if(rest[i])
+					{
+						stopped |= step_lane(i);
+					}
+				}
+			}
+
+			if(!any(vec))
+			{
+				if(!scalar_step)
+				{
+					break;
+				}
+				continue;
+			}
+
+			// Run the lanes furthest back in the code first, so the ones
+			// waiting further on get caught up with and the group reconverges
+			// after a branch goes different ways.
+			uint16_t lpc = min_lane(sel16(__builtin_convertvector(vec, mask16), pc, lane16{} + 0xffff));
+			mask8 m8 = vec & __builtin_convertvector(pc == lpc, mask8);
+			int leader = first_lane(m8);
+			m8 &= (mask8)(bios == bios[leader]);
+			m8 &= __builtin_convertvector((low_bank == low_bank[leader]) & (high_bank == high_bank[leader]), mask8);
+
+			if(execute(leader, m8))
+			{
+				vector_instructions += lanes(m8);
+			}
+			else
+			{
+				for(i = 0; i < count; i++)
+				{
+					if(m8[i])
+					{
+						stopped |= step_lane(i);
+					}
+				}
+			}
+		}
+
+		for(i = 0; i < count; i++)
+		{
+			if(live[i])
+			{
+				store(i);
+			}
+		}
+
+		if(stopped)
+		{
+			break;
+		}
+	}
+
+	return stopped;
+}
+
+// The same operations as opcodes.inc, for the lanes in m8. Returns false for
+// an opcode that has to be stepped lane by lane instead.
+bool LockstepGroup::execute(int leader, mask8 m8)
+{
+	mask16 m16 = __builtin_convertvector(m8, mask16);
+	uint16_t lpc = pc[leader];
+	uint8_t op = read_lane(leader, lpc);
+	uint8_t imm8 = read_lane(leader, lpc + 1);
+	uint16_t imm16 = read16_lane(leader, lpc + 1);
+	int i;
+	uint8_t bitop;
+	lane8 *r;
+	lane8 t8 = {};
+	lane16 t16 = {};
+
+	lane8 *const regnums[8] = { &b, &c, &d, &e, &h, &l, nullptr, &a }; // as CPU::regnums
+
+#define SET8(reg, v) reg = sel8(m8, lane8{} + (v), reg)
+#define SET16(reg, v) reg = sel16(m16, lane16{} + (v), reg)
+#define SET_F(z, c, n, h) SET8(f, alu_flags(z, c, n, h))
+#define SET_F_KEEP_C(z, n, h) SET8(f, (f & (uint8_t)CPU::Flag::C) | alu_flags(z, lane16{}, n, h))
+#define INC(r) t8 = r + 1; SET_F_KEEP_C(t8, false, r ^ 1 ^ t8); SET8(r, t8)
+#define DEC(r) t8 = r - 1; SET_F_KEEP_C(t8, true, r ^ 1 ^ t8); SET8(r, t8)
+#define ADD(x) t16 = wide(a) + wide(x); SET_F(lo8(t16), t16, false, a ^ (x) ^ lo8(t16)); SET8(a, lo8(t16))
+#define CP(x) t16 = wide(a) - wide(x); SET_F(lo8(t16), t16, true, a ^ (x) ^ lo8(t16))
+#define SUB(x) CP(x); SET8(a, lo8(t16))
+#define LOGIC(v, h) SET8(a, v); SET_F(a, lane16{}, false, lane8{} + (h))
+#define DONE(len, cyc) pc += (lane16)m16 & (uint16_t)(len); left -= m16 & (cyc); return true
+#define JUMP(cyc) left -= m16 & (cyc); return true
+#define EACH_LANE for(i = 0; i < count; i++) if(m8[i])
+#define HL(i) (uint16_t)(h[i] << 8 | l[i])
+
+	switch(op)
+	{
+	case 0x00: // nop
+		DONE(1, 4);
+
+	case 0x01: // ld bc, nn
+		SET8(b, (uint8_t)(imm16 >> 8));
+		SET8(c, (uint8_t)imm16);
+		DONE(3, 12);
+
+	case 0x02: // ld (bc), a
+		EACH_LANE { write_lane(i, b[i] << 8 | c[i], a[i]); }
+		DONE(1, 8);
+
+	case 0x03: // inc bc
+		t16 = pair(b, c) + 1;
+		SET8(b, hi8(t16));
+		SET8(c, lo8(t16));
+		DONE(1, 8);
+
+	case 0x04: INC(b); DONE(1, 4); // inc b
+	case 0x05: DEC(b); DONE(1, 4); // dec b
+	case 0x06: SET8(b, imm8); DONE(2, 8); // ld b, n
+
+	case 0x0a: // ld a, (bc)
+		EACH_LANE { a[i] = read_lane(i, b[i] << 8 | c[i]); }
+		DONE(1, 8);
+
+	case 0x0b: // dec bc
+		t16 = pair(b, c) - 1;
+		SET8(b, hi8(t16));
+		SET8(c, lo8(t16));
+		DONE(1, 8);
+
+	case 0x0c: INC(c); DONE(1, 4); // inc c
+	case 0x0d: DEC(c); DONE(1, 4); // dec c
+	case 0x0e: SET8(c, imm8); DONE(2, 8); // ld c, n
+
+	case 0x11: // ld de, nn
+		SET8(d, (uint8_t)(imm16 >> 8));
+		SET8(e, (uint8_t)imm16);
+		DONE(3, 12);
+
+	case 0x12: // ld (de), a
+		EACH_LANE { write_lane(i, d[i] << 8 | e[i], a[i]); }
+		DONE(1, 8);
+
+	case 0x13: // inc de
+		t16 = pair(d, e) + 1;
+		SET8(d, hi8(t16));
+		SET8(e, lo8(t16));
+		DONE(1, 8);
+
+	case 0x15: DEC(d); DONE(1, 4); // dec d
+	case 0x16: SET8(d, imm8); DONE(2, 8); // ld d, n
+
+	case 0x17: // rla
+		t16 = wide(a) << 1;
+		t8 = lo8(t16) | ((f >> 4) & 1);
+		SET_F(lane8{} + 1, t16, false, lane8{}); // Z is always clear
+		SET8(a, t8);
+		DONE(1, 4);
+
+	case 0x18: // jr n
+		SET16(pc, pc + 2 + (int8_t)imm8);
+		JUMP(12);
+
+	case 0x19: // add hl, de
+		t16 = pair(h, l) + pair(d, e);
+		SET8(f, (f & (uint8_t)CPU::Flag::Z) | lo8(((lane16)(t16 < pair(h, l)) & (uint16_t)CPU::Flag::C) |
+			((pair(h, l) ^ pair(d, e) ^ t16) >> 7 & (uint16_t)CPU::Flag::H))); // carries out of bits 15 and 11
+		SET8(h, hi8(t16));
+		SET8(l, lo8(t16));
+		DONE(1, 12);
+
+	case 0x1a: // ld a, (de)
+		EACH_LANE { a[i] = read_lane(i, d[i] << 8 | e[i]); }
+		DONE(1, 8);
+
+	case 0x1d: DEC(e); DONE(1, 4); // dec e
+	case 0x1e: SET8(e, imm8); DONE(2, 8); // ld e, n
+
+	case 0x20: // jr nz, n
+	case 0x28: // jr z, n
+	{
+		mask8 taken = (mask8)((f & (uint8_t)CPU::Flag::Z) == 0);
+		if(op == 0x28)
+		{
+			taken = ~taken;
+		}
+		taken &= m8;
+		SET16(pc, pc + 2 + ((lane16)__builtin_convertvector(taken, mask16) & (uint16_t)(int8_t)imm8));
+		left -= m16 & 8;
+		left -= __builtin_convertvector(taken, mask16) & 4;
+		return true;
+	}
+
+	case 0x21: // ld hl, nn
+		SET8(h, (uint8_t)(imm16 >> 8));
+		SET8(l, (uint8_t)imm16);
+		DONE(3, 12);
+
+	case 0x22: // ldi (hl), a
+		EACH_LANE { write_lane(i, HL(i), a[i]); }
+		t16 = pair(h, l) + 1;
+		SET8(h, hi8(t16));
+		SET8(l, lo8(t16));
+		DONE(1, 8);
+
+	case 0x23: // inc hl
+		t16 = pair(h, l) + 1;
+		SET8(h, hi8(t16));
+		SET8(l, lo8(t16));
+		DONE(1, 8);
+
+	case 0x24: INC(h); DONE(1, 4); // inc h
+
+	case 0x2a: // ld hl, (nn)
+		EACH_LANE { t16[i] = read16_lane(i, imm16); }
+		SET8(h, hi8(t16));
+		SET8(l, lo8(t16));
+		DONE(3, 16);
+
+	case 0x2e: SET8(l, imm8); DONE(2, 8); // ld l, n
+	case 0x2f: // cpl
+		SET8(a, ~a);
+		SET8(f, (f & (uint8_t)(CPU::Flag::Z | CPU::Flag::C)) | (uint8_t)(CPU::Flag::N | CPU::Flag::H));
+		DONE(1, 4);
+
+	case 0x31: // ld sp, nn
+		SET16(sp, imm16);
+		DONE(3, 12);
+
+	case 0x32: // ldd (hl), a
+		EACH_LANE { write_lane(i, HL(i), a[i]); }
+		t16 = pair(h, l) - 1;
+		SET8(h, hi8(t16));
+		SET8(l, lo8(t16));
+		DONE(1, 8);
+
+	case 0x35: // dec (hl)
+		EACH_LANE { t8[i] = read_lane(i, HL(i)); }
+		SET_F_KEEP_C(t8 - 1, true, t8 ^ 1 ^ (t8 - 1));
+		EACH_LANE { write_lane(i, HL(i), t8[i] - 1); }
+		DONE(1, 12);
+
+	case 0x36: // ld (hl), n
+		EACH_LANE { write_lane(i, HL(i), imm8); }
+		DONE(2, 12);
+
+	case 0x3d: DEC(a); DONE(1, 4); // dec a
+	case 0x3e: SET8(a, imm8); DONE(2, 8); // ld a, n
+
+	case 0x47: SET8(b, a); DONE(1, 4); // ld b, a
+	case 0x4f: SET8(c, a); DONE(1, 4); // ld c, a
+
+	case 0x56: // ld d, (hl)
+		EACH_LANE { d[i] = read_lane(i, HL(i)); }
+		DONE(1, 8);
+
+	case 0x57: SET8(d, a); DONE(1, 4); // ld d, a
+
+	case 0x5e: // ld e, (hl)
+		EACH_LANE { e[i] = read_lane(i, HL(i)); }
+		DONE(1, 8);
+
+	case 0x5f: SET8(e, a); DONE(1, 4); // ld e, a
+	case 0x67: SET8(h, a); DONE(1, 4); // ld h, a
+
+	case 0x77: // ld (hl), a
+		EACH_LANE { write_lane(i, HL(i), a[i]); }
+		DONE(1, 8);
+
+	case 0x78: SET8(a, b); DONE(1, 4); // ld a, b
+	case 0x79: SET8(a, c); DONE(1, 4); // ld a, c
+	case 0x7b: SET8(a, e); DONE(1, 4); // ld a, e
+	case 0x7c: SET8(a, h); DONE(1, 4); // ld a, h
+	case 0x7d: SET8(a, l); DONE(1, 4); // ld a, l
+
+	case 0x7e: // ld a, (hl)
+		EACH_LANE { a[i] = read_lane(i, HL(i)); }
+		DONE(1, 8);
+
+	case 0x7f: DONE(1, 4); // ld a, a
+
+	case 0x86: // add a, (hl)
+		EACH_LANE { t8[i] = read_lane(i, HL(i)); }
+		ADD(t8);
+		DONE(1, 8);
+
+	case 0x87: ADD(a); DONE(1, 4); // add a, a
+	case 0x90: SUB(b); DONE(1, 4); // sub b
+	case 0xa1: LOGIC(a & c, 0x10); DONE(1, 4); // and c
+	case 0xa7: LOGIC(a, 0x10); DONE(1, 4); // and a
+	case 0xa9: LOGIC(a ^ c, 0); DONE(1, 4); // xor c
+	case 0xaf: LOGIC(a ^ a, 0); DONE(1, 4); // xor a
+	case 0xb0: LOGIC(a | b, 0); DONE(1, 4); // or b
+	case 0xb1: LOGIC(a | c, 0); DONE(1, 4); // or c
+
+	case 0xbe: // cp (hl)
+		EACH_LANE { t8[i] = read_lane(i, HL(i)); }
+		CP(t8);
+		DONE(1, 8);
+
+	case 0xc1: // pop bc
+	case 0xd1: // pop de
+	case 0xe1: // pop hl
+	case 0xf1: // pop af
+	{
+		EACH_LANE { t16[i] = read16_lane(i, sp[i]); }
+		lane8 *hi = op == 0xc1 ? &b : op == 0xd1 ? &d : op == 0xe1 ? &h : &a;
+		lane8 *lo = op == 0xc1 ? &c : op == 0xd1 ? &e : op == 0xe1 ? &l : &f;
+		if(op == 0xf1)
+		{
+			t16 &= (uint16_t)0xfff0; // the low bits of F don't exist
+		}
+		SET8(*hi, hi8(t16));
+		SET8(*lo, lo8(t16));
+		SET16(sp, sp + 2);
+		DONE(1, 12);
+	}
+
+	case 0xc3: // jp nn
+	case 0xca:
+		SET16(pc, imm16);
+		JUMP(12);
+
+	case 0xc5: // push bc
+	case 0xd5: // push de
+	case 0xe5: // push hl
+	case 0xf5: // push af
+		t16 = op == 0xc5 ? pair(b, c) : op == 0xd5 ? pair(d, e) : op == 0xe5 ? pair(h, l) : pair(a, f);
+		SET16(sp, sp - 2);
+		EACH_LANE
+		{
+			write_lane(i, sp[i], t16[i]);
+			write_lane(i, sp[i] + 1, t16[i] >> 8);
+		}
+		DONE(1, 16);
+
+	case 0xc9: // ret
+		EACH_LANE { t16[i] = read16_lane(i, sp[i]); }
+		SET16(pc, t16);
+		SET16(sp, sp + 2);
+		JUMP(16);
+
+	case 0xcb: // bit operations
+		bitop = imm8;
+		r = regnums[bitop & 7];
+		if(r == nullptr)
+		{
+			return false;
+		}
+
+		switch(bitop >> 3)
+		{
+		case 0x02: // rl r
+			t16 = wide(*r) << 1;
+			t8 = lo8(t16) | ((f >> 4) & 1);
+			SET_F(t8, t16, false, lane8{});
+			SET8(*r, t8);
+			break;
+		case 0x03: // rr r
+			t8 = (*r >> 1) | ((f & (uint8_t)CPU::Flag::C) << 3);
+			SET_F(t8, wide(*r) << 8, false, lane8{});
+			SET8(*r, t8);
+			break;
+		case 0x06: // swap r
+			t8 = (*r << 4) | (*r >> 4);
+			SET_F(t8, lane16{}, false, lane8{});
+			SET8(*r, t8);
+			break;
+		case 0x08: case 0x09: case 0x0a: case 0x0b: // bit n, r
+		case 0x0c: case 0x0d: case 0x0e: case 0x0f:
+			SET_F_KEEP_C(*r & (uint8_t)(1 << ((bitop >> 3) & 7)), false, lane8{} + 0x10);
+			break;
+		default:
+			if(bitop < 0x80) // res and set are no-ops, everything else is unhandled
+			{
+				return false;
+			}
+			break;
+		}
+		DONE(2, 8);
+
+	case 0xcd: // call nn
+		SET16(sp, sp - 2);
+		EACH_LANE
+		{
+			write_lane(i, sp[i], pc[i] + 3);
+			write_lane(i, sp[i] + 1, (pc[i] + 3) >> 8);
+		}
+		SET16(pc, imm16);
+		JUMP(24);
+
+	case 0xe0: // ld (ff00+n), a
+		EACH_LANE { write_lane(i, 0xff00 + imm8, a[i]); }
+		DONE(2, 12);
+
+	case 0xe2: // ld (ff00+c), a
+		EACH_LANE { write_lane(i, 0xff00 + c[i], a[i]); }
+		DONE(1, 8);
+
+	case 0xe6: LOGIC(a & imm8, 0x10); DONE(2, 8); // and n
+
+	case 0xe9: // jp (hl)
+		SET16(pc, pair(h, l));
+		JUMP(4);
+
+	case 0xea: // ld (nn), a
+		EACH_LANE { write_lane(i, imm16, a[i]); }
+		DONE(3, 16);
+
+	case 0xf0: // ld a, (ff00+n)
+		EACH_LANE { a[i] = read_lane(i, 0xff00 + imm8); }
+		DONE(2, 12);
+
+	case 0xfa: // ld a, (nn)
+		EACH_LANE { a[i] = read_lane(i, imm16); }
+		DONE(3, 16);
+
+	case 0xfe: t8 = lane8{} + imm8; CP(t8); DONE(2, 8); // cp n
+
+	default: // ei/di, rst and anything unhandled go through step()
+		return false;
+	}
+
+#undef SET8
+#undef SET16
+#undef SET_F
+#undef SET_F_KEEP_C
+#undef INC
+#undef DEC
+#undef ADD
+#undef CP
+#undef SUB
+#undef LOGIC
+#undef DONE
+#undef JUMP
+#undef EACH_LANE
+#undef HL
+}
+#endif
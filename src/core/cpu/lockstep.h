@@ -0,0 +1,89 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+class CPU;
+
+// Lanes per group. Each step has a fixed cost in bookkeeping (picking the
+// leading pc, checking banks, fetching the opcode) that only pays for itself
+// with 16 lanes of 16-bit registers in one AVX2 register. At 8 lanes on SSE2
+// the group runs slower than the same CPUs one after another, and so does
+// anything wider than the host's registers, which gets split up element by
+// element. So unless GP_LOCKSTEP_LANES asks for a width, LockstepGroup only
+// exists on AVX2 targets, with 16 lanes.
+#if !defined(GP_LOCKSTEP_LANES) && defined(__GNUC__) && defined(__AVX2__)
+#define GP_LOCKSTEP_LANES 16
+#endif
+
+#ifdef GP_LOCKSTEP_LANES
+static_assert(GP_LOCKSTEP_LANES % 8 == 0, "GP_LOCKSTEP_LANES has to be a multiple of 8");
+
+// Runs several CPUs with identical ROM and BIOS images side by side, with
+// their registers held as vectors, one lane per CPU.
+//
+// Each step takes the lanes at the lowest pc and executes that instruction
+// once for all of them, using masked vector operations for the register and
+// ALU work. Lanes further on wait, so lanes that took different branches
+// line up again at the next common pc. Memory operands go lane by lane through each CPU's
+// own read8/write8, since every CPU has its own RAM and I/O.
+//
+// A lane that is running code out of RAM, is halted or has interrupt work for
+// step() to do is stepped on its own CPU instead, as are lanes at an opcode
+// without a vector form.
+//
+// Only built with GCC and Clang, which have the vector extensions, and only
+// where GP_LOCKSTEP_LANES is defined (see above).
+class LockstepGroup
+{
+public:
+	typedef uint8_t lane8 __attribute__((vector_size(GP_LOCKSTEP_LANES)));
+	typedef int8_t mask8 __attribute__((vector_size(GP_LOCKSTEP_LANES)));
+	typedef uint16_t lane16 __attribute__((vector_size(GP_LOCKSTEP_LANES * 2)));
+	typedef int16_t mask16 __attribute__((vector_size(GP_LOCKSTEP_LANES * 2)));
+	typedef int16_t slane16 __attribute__((vector_size(GP_LOCKSTEP_LANES * 2)));
+
+	// At most GP_LOCKSTEP_LANES CPUs, which stay owned by the caller. If their
+	// images differ, every lane is stepped on its own.
+	LockstepGroup(CPU **cpus, int count);
+
+	// Runs every lane for at least cycle_budget cycles, like CPU::run(), and
+	// leaves the CPUs in the state they would have after that. Returns true if
+	// any lane stopped.
+	bool run(uint64_t cycle_budget);
+
+	int size();
+
+	uint64_t vector_instructions; // lane-instructions executed by vector steps
+	uint64_t scalar_instructions; // lane-instructions executed by CPU::step()
+
+private:
+	CPU *cpu[GP_LOCKSTEP_LANES];
+	int count;
+	bool shared_rom;
+
+	lane8 a, f, b, c, d, e, h, l;
+	lane16 sp, pc;
+
+	// Cycles still to run in the current slice. Slices are kept short enough
+	// for this to be as narrow as pc.
+	slane16 left;
+	uint64_t slice_end[GP_LOCKSTEP_LANES];
+	uint64_t end[GP_LOCKSTEP_LANES];
+
+	mask8 live; // lanes that haven't stopped
+	mask8 ok; // lanes where step() would skip straight to the opcode
+	lane8 bios; // lanes with the BIOS mapped
+	lane16 low_bank, high_bank; // ROM banks mapped at 0x0000 and 0x4000
+
+	void load(int i);
+	void store(int i);
+	void refresh(int i);
+	bool step_lane(int i);
+
+	bool execute(int leader, mask8 m8);
+
+	uint8_t read_lane(int i, uint16_t virt);
+	uint16_t read16_lane(int i, uint16_t virt);
+	void write_lane(int i, uint16_t virt, uint8_t v);
+};
+#endif
@@ -0,0 +1,379 @@
+#ifdef GP_PROFILE
+#include "profiler.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define HOT_PCS 64 // how many of the hottest pcs the report lists
+
+static const char *region_names[Profiler::REGIONS] = { "rom", "vram", "cart_ram", "wram", "oam", "io", "hram" };
+
+Profiler::Profiler(CPU *cpu)
+{
+	this->cpu = cpu;
+	rng = 0x9e3779b9;
+	restart();
+
+	op = IRQ;
+	pc = 0;
+	rom_size = cpu->cart_size;
+	rom_offset = rom_size;
+	accesses = 0;
+
+	memset(op_weight, 0, sizeof(op_weight));
+	memset(reads, 0, sizeof(reads));
+	memset(writes, 0, sizeof(writes));
+	samples = 0;
+	memset(op_samples, 0, sizeof(op_samples));
+	rom_hits = (uint64_t*)calloc(rom_size, sizeof(uint64_t));
+	other_hits = (uint64_t*)calloc(0x10000, sizeof(uint64_t));
+}
+
+Profiler::~Profiler()
+{
+	report();
+	free(rom_hits);
+	free(other_hits);
+}
+
+void Profiler::begin(int op, uint16_t pc)
+{
+	this->op = op;
+	this->pc = pc;
+	uint8_t *page = cpu->read_map[pc >> 8];
+	rom_offset = (uintptr_t)page - (uintptr_t)cpu->cart + (pc & 0xff);
+	if(page == nullptr || rom_offset > rom_size)
+	{
+		rom_offset = rom_size;
+	}
+	accesses = 0;
+}
+
+uint16_t Profiler::read(uint16_t virt, int bytes)
+{
+	if(accesses < MAX_ACCESSES)
+	{
+		access[accesses].write = false;
+		access[accesses].slot = access_slot(virt);
+		access[accesses].bytes = bytes;
+		accesses++;
+	}
+	return virt;
+}
+
+uint16_t Profiler::write(uint16_t virt, int bytes)
+{
+	if(accesses < MAX_ACCESSES)
+	{
+		access[accesses].write = true;
+		access[accesses].slot = access_slot(virt);
+		access[accesses].bytes = bytes;
+		accesses++;
+	}
+	return virt;
+}
+
+void Profiler::end(uint64_t start, unsigned length)
+{
+	while(due < cpu->cycles)
+	{
+		if(due >= start && due - start < length)
+		{
+			take_sample(length);
+		}
+		schedule();
+	}
+}
+
+void Profiler::restart()
+{
+	due = cpu->cycles + MAX_INSTRUCTION_CYCLES;
+	schedule();
+}
+
+void Profiler::take_sample(unsigned length)
+{
+	double weight = 1.0 / length;
+	samples++;
+	op_samples[op]++;
+	op_weight[op] += weight;
+
+	int i = 0;
+	for(; i < accesses; i++)
+	{
+		(access[i].write ? writes : reads)[access[i].slot] += access[i].bytes * weight;
+	}
+
+	if(op == IRQ)
+	{
+		return; // not at pc
+	}
+	else if(rom_offset < rom_size)
+	{
+		rom_hits[rom_offset]++;
+	}
+	else
+	{
+		other_hits[pc]++; // BIOS, RAM and anything else that isn't cartridge ROM
+	}
+}
+
+// A random gap, so code that loops in step with the gap doesn't get sampled
+// at the same pc every time.
+void Profiler::schedule()
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	due += 1 + rng % (2 * SAMPLE_INTERVAL - 1);
+}
+
+Profiler::Region Profiler::region(int slot)
+{
+	if(slot < 0x80)
+	{
+		return ROM;
+	}
+	else if(slot < 0xa0)
+	{
+		return VRAM;
+	}
+	else if(slot < 0xc0)
+	{
+		return CART_RAM;
+	}
+	else if(slot < 0xfe)
+	{
+		return WRAM;
+	}
+	else if(slot == 0xfe)
+	{
+		return OAM; // and the unusable area after it
+	}
+	return slot == 0x100 ? HRAM : IO;
+}
+
+// Everything reported so far, one entry per CPU, written out at exit.
+static std::mutex report_lock;
+static std::vector<std::string> reports;
+
+static bool csv_output()
+{
+	const char *path = getenv("GP_PROFILE_OUT");
+	size_t len = path != nullptr ? strlen(path) : 0;
+	return len >= 4 && !strcmp(path + len - 4, ".csv");
+}
+
+static void write_reports()
+{
+	const char *path = getenv("GP_PROFILE_OUT");
+	if(path == nullptr)
+	{
+		path = "gameperson-profile.json";
+	}
+
+	FILE *f = fopen(path, "w");
+	if(f == nullptr)
+	{
+		printf("couldn't write profile to '%s'\n", path);
+		return;
+	}
+
+	bool csv = csv_output();
+	fputs(csv ? "cpu,section,name,count,cycles\n" : "[\n", f);
+	size_t i = 0;
+	for(; i < reports.size(); i++)
+	{
+		fputs(reports[i].c_str(), f);
+		if(!csv)
+		{
+			fputs(i + 1 < reports.size() ? ",\n" : "\n", f);
+		}
+	}
+	if(!csv)
+	{
+		fputs("]\n", f);
+	}
+	fclose(f);
+}
+
+static void append(std::string &s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(std::string &s, const char *fmt, ...)
+{
+	char buf[256];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	s += buf;
+}
+
+static std::string op_name(int op)
+{
+	std::string s;
+	if(op == Profiler::IRQ)
+	{
+		s = "irq";
+	}
+	else
+	{
+		append(s, op >= 0x100 ? "cb %02x" : "%02x", op & 0xff);
+	}
+	return s;
+}
+
+struct HotPC
+{
+	int bank; // -1 outside the cartridge ROM
+	uint16_t pc;
+	uint64_t samples;
+
+	bool operator<(const HotPC &o) const
+	{
+		return samples > o.samples;
+	}
+};
+
+void Profiler::report()
+{
+	double instructions = 0;
+	std::vector<int> ops;
+	int op = 0;
+	for(; op < OPS; op++)
+	{
+		if(op_samples[op] != 0)
+		{
+			ops.push_back(op);
+			instructions += op != IRQ ? op_weight[op] * SAMPLE_INTERVAL : 0;
+		}
+	}
+	std::sort(ops.begin(), ops.end(), [this](int a, int b) { return op_weight[a] > op_weight[b]; });
+
+	std::vector<HotPC> hot;
+	size_t offset = 0;
+	for(; offset < rom_size; offset++)
+	{
+		if(rom_hits[offset] != 0)
+		{
+			int bank = offset >> 14;
+			hot.push_back(HotPC{ bank, (uint16_t)((bank != 0 ? 0x4000 : 0) + (offset & 0x3fff)), rom_hits[offset] });
+		}
+	}
+	int pc = 0;
+	for(; pc < 0x10000; pc++)
+	{
+		if(other_hits[pc] != 0)
+		{
+			hot.push_back(HotPC{ -1, (uint16_t)pc, other_hits[pc] });
+		}
+	}
+	size_t shown = std::min(hot.size(), (size_t)HOT_PCS);
+	std::partial_sort(hot.begin(), hot.begin() + shown, hot.end());
+
+	double region_reads[REGIONS] = {}, region_writes[REGIONS] = {};
+	int slot = 0;
+	for(; slot < 0x101; slot++)
+	{
+		region_reads[region(slot)] += reads[slot] * SAMPLE_INTERVAL;
+		region_writes[region(slot)] += writes[slot] * SAMPLE_INTERVAL;
+	}
+
+	std::lock_guard<std::mutex> lock(report_lock);
+	if(reports.empty())
+	{
+		atexit(write_reports);
+	}
+
+	// Estimates are rounded. Cycles are estimated too, other than the totals.
+	unsigned long long n = reports.size();
+	bool csv = csv_output();
+	std::string s;
+	size_t i;
+	if(csv)
+	{
+		append(s, "%llu,summary,cycles,,%llu\n", n, (unsigned long long)cpu->cycles);
+		append(s, "%llu,summary,halted_cycles,,%llu\n", n, (unsigned long long)cpu->halted_cycles);
+		append(s, "%llu,summary,idle_cycles,,%llu\n", n, (unsigned long long)cpu->idle_cycles);
+		append(s, "%llu,summary,instructions,%.0f,\n", n, instructions);
+		append(s, "%llu,summary,samples,%llu,\n", n, (unsigned long long)samples);
+	}
+	else
+	{
+		append(s, "{\"cycles\": %llu, \"halted_cycles\": %llu, \"idle_cycles\": %llu, \"instructions\": %.0f, \"samples\": %llu,\n",
+			(unsigned long long)cpu->cycles, (unsigned long long)cpu->halted_cycles, (unsigned long long)cpu->idle_cycles,
+			instructions, (unsigned long long)samples);
+		s += " \"opcodes\": [";
+	}
+
+	for(i = 0; i < ops.size(); i++)
+	{
+		op = ops[i];
+		double count = op_weight[op] * SAMPLE_INTERVAL;
+		unsigned long long cycles = op_samples[op] * SAMPLE_INTERVAL;
+		if(csv)
+		{
+			append(s, "%llu,opcode,%s,%.0f,%llu\n", n, op_name(op).c_str(), count, cycles);
+		}
+		else
+		{
+			append(s, "%s\n  {\"op\": \"%s\", \"samples\": %llu, \"count\": %.0f, \"cycles\": %llu}", i != 0 ? "," : "",
+				op_name(op).c_str(), (unsigned long long)op_samples[op], count, cycles);
+		}
+	}
+
+	if(!csv)
+	{
+		s += "],\n \"regions\": {";
+	}
+	for(i = 0; i < REGIONS; i++)
+	{
+		if(csv)
+		{
+			append(s, "%llu,reads,%s,%.0f,\n", n, region_names[i], region_reads[i]);
+			append(s, "%llu,writes,%s,%.0f,\n", n, region_names[i], region_writes[i]);
+		}
+		else
+		{
+			append(s, "%s\n  \"%s\": {\"reads\": %.0f, \"writes\": %.0f}", i != 0 ? "," : "", region_names[i],
+				region_reads[i], region_writes[i]);
+		}
+	}
+
+	if(!csv)
+	{
+		s += "},\n \"hot_pcs\": [";
+	}
+	for(i = 0; i < shown; i++)
+	{
+		std::string bank = csv ? "" : "null";
+		if(hot[i].bank >= 0)
+		{
+			bank.clear();
+			append(bank, "%d", hot[i].bank);
+		}
+
+		unsigned long long cycles = hot[i].samples * SAMPLE_INTERVAL;
+		if(csv)
+		{
+			append(s, "%llu,hot_pc,%s%s%04x,,%llu\n", n, bank.c_str(), hot[i].bank >= 0 ? ":" : "", hot[i].pc, cycles);
+		}
+		else
+		{
+			append(s, "%s\n  {\"bank\": %s, \"pc\": \"%04x\", \"samples\": %llu, \"cycles\": %llu}", i != 0 ? "," : "",
+				bank.c_str(), hot[i].pc, (unsigned long long)hot[i].samples, cycles);
+		}
+	}
+	if(!csv)
+	{
+		s += "]}";
+	}
+	reports.push_back(s);
+}
+
+#endif
@@ -0,0 +1,123 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#include "cpu.h"
+
+// Where emulated time goes, to show which opcodes and memory regions are
+// worth a fast path. Only built with GP_PROFILE.
+//
+// Counting every instruction would keep the CPU in step() and slow it down by
+// a third or more, so the profiler samples instead: every SAMPLE_INTERVAL
+// cycles on average, at a random cycle, it notes the instruction running then,
+// its pc (by ROM bank), its opcode, its length and the memory it accessed.
+// run() stops its fast paths a little before each sample is due and steps up
+// to it through step_profiled(), which is the only place anything is counted;
+// step() hands over to it too, for callers that single-step.
+// Longer instructions are sampled more often, in proportion to their length,
+// and the report scales each sample back down by it.
+//
+// So every number in the report but the cycle totals is an estimate. Idle
+// loops that run() skips count as though they'd run; HALT counts as nothing.
+// JIT-compiled code only stops between blocks, so with GP_JIT the samples it
+// runs past are dropped, and blocks that run long are under-counted.
+//
+// Each CPU adds its numbers to the report when it's destroyed, and the report
+// is written at exit to $GP_PROFILE_OUT (gameperson-profile.json if unset),
+// as CSV if the name ends in .csv and as JSON otherwise.
+class Profiler
+{
+public:
+	enum Region
+	{
+		ROM,
+		VRAM,
+		CART_RAM,
+		WRAM, // and its mirror
+		OAM, // and the unusable fea0-feff after it
+		IO, // and IE
+		HRAM,
+		REGIONS
+	};
+
+	enum
+	{
+		IRQ = 0x200, // taking an interrupt, counted like an opcode of its own
+		OPS
+	};
+
+	Profiler(CPU *cpu);
+	~Profiler();
+
+	// step() and run() go through step_profiled() from here on for the next
+	// sample: no instruction that starts before this cycle can still be
+	// running when the sample is due.
+	uint64_t window()
+	{
+		return due - MAX_INSTRUCTION_CYCLES;
+	}
+
+	// An instruction at pc is about to run in step_profiled(). op is 0x100 +
+	// the second byte for 0xcb-prefixed opcodes.
+	void begin(int op, uint16_t pc);
+
+	// Memory accesses by the instruction since begin(). Each returns virt.
+	uint16_t read(uint16_t virt, int bytes);
+	uint16_t write(uint16_t virt, int bytes);
+
+	// What step_profiled() did, which started at cycle start: length cycles
+	// of the instruction or interrupt from begin(), or nothing at all if
+	// length is 0. Either way, cpu->cycles has moved on past everything it
+	// skipped, and any samples that came due in there are dropped.
+	void end(uint64_t start, unsigned length);
+
+	// A save state was loaded, which may have moved time backwards.
+	void restart();
+
+private:
+	enum
+	{
+		SAMPLE_INTERVAL = 4096, // cycles between samples, on average
+		MAX_INSTRUCTION_CYCLES = 24, // CALL; taking an interrupt is 20
+		MAX_ACCESSES = 4 // by one instruction, with 16-bit accesses counting once
+	};
+
+	CPU *cpu;
+	uint64_t due; // the cycle the next sample is taken at
+	uint32_t rng;
+
+	// The instruction since begin(), and its accesses so far.
+	int op;
+	uint16_t pc;
+	size_t rom_offset; // of pc, or cart_size if it's outside the cartridge ROM
+	int accesses;
+	struct
+	{
+		bool write;
+		uint16_t slot;
+		uint8_t bytes;
+	} access[MAX_ACCESSES];
+
+	// Summed over samples, each weighted by one over its length: times
+	// SAMPLE_INTERVAL, that's an estimated count.
+	double op_weight[OPS];
+	double reads[0x101]; // bytes per page, with HRAM in a slot of its own after page 0xff
+	double writes[0x101];
+
+	uint64_t samples;
+	uint64_t op_samples[OPS];
+	size_t rom_size; // the cartridge's when this was made, which a reset may change since
+	uint64_t *rom_hits; // samples by ROM offset; calloc'd, so banks that never run cost no memory
+	uint64_t *other_hits; // samples outside the cartridge ROM, by pc
+
+	static int access_slot(uint16_t virt)
+	{
+		return (virt >> 8) + (virt >= 0xff80 && virt != 0xffff);
+	}
+
+	static Region region(int slot);
+
+	void take_sample(unsigned length);
+	void schedule();
+	void report();
+};
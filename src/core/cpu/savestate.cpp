@@ -0,0 +1,214 @@
+#include "cpu.h"
+#include "blockcache.h"
+#include "cartridge.h"
+#include "pixels.h"
+#include "profiler.h"
+#include "savestate.h"
+#include "timer.h"
+#include "util.h"
+#include <string.h>
+#include <fstream>
+#include <vector>
+
+void CPU::write_state(StateWriter &w)
+{
+	// The big buffers go first, where they stay aligned: unaligned copies of
+	// them take several times as long.
+	w.put(vram, 0x2000);
+	w.put(wram, 0x2000);
+	w.put(hram, 126);
+
+	regs.af.f = get_f();
+	w.put(regs.af.full);
+	w.put(regs.bc.full);
+	w.put(regs.de.full);
+	w.put(regs.hl.full);
+	w.put(regs.pc);
+	w.put(regs.sp);
+	w.put(cycles);
+
+	w.put(old_en);
+	w.put(halted);
+	w.put(int_enable_master);
+	w.put(int_enable);
+	w.put(int_flags);
+
+	w.put(buttons);
+	w.put(joypad_select);
+	w.put(flags.bios_enabled);
+
+	w.put(frames);
+	w.put(dma_source);
+	w.put(dma_active);
+	w.put(serial_data);
+	w.put(serial_control);
+	events.save_state(w);
+	timer->save_state(w);
+	screen->save_state(w);
+	cartridge->save_state(w);
+}
+
+void CPU::read_state(StateReader &r)
+{
+	r.get(vram, 0x2000);
+	r.get(wram, 0x2000);
+	r.get(hram, 126);
+
+	r.get(regs.af.full);
+	set_f(regs.af.f);
+	r.get(regs.bc.full);
+	r.get(regs.de.full);
+	r.get(regs.hl.full);
+	r.get(regs.pc);
+	r.get(regs.sp);
+	r.get(cycles);
+
+	r.get(old_en);
+	r.get(halted);
+	r.get(int_enable_master);
+	r.get(int_enable);
+	r.get(int_flags);
+
+	r.get(buttons);
+	r.get(joypad_select);
+	r.get(flags.bios_enabled);
+
+	r.get(frames);
+	r.get(dma_source);
+	r.get(dma_active);
+	r.get(serial_data);
+	r.get(serial_control);
+	events.load_state(r);
+	timer->load_state(r);
+	screen->load_state(r);
+	cartridge->load_state(r);
+}
+
+size_t CPU::save_state_size()
+{
+	return state_size;
+}
+
+size_t CPU::save_state(uint8_t *buf, size_t size)
+{
+	if(size < state_size)
+	{
+		return 0;
+	}
+
+	if(cart_hash == 0)
+	{
+		cart_hash = util::hash_buffer(cart, cart_size);
+	}
+
+	SaveStateHeader header;
+	header.magic = SAVE_STATE_MAGIC;
+	header.version = SAVE_STATE_VERSION;
+	header.size = state_size;
+	header.flags = flags.bios_enabled ? SaveStateHeader::NEEDS_BIOS : 0;
+	header.cart_hash = cart_hash;
+	memcpy(buf, &header, sizeof(header));
+
+	StateWriter w(buf + sizeof(header));
+	write_state(w);
+	return state_size;
+}
+
+bool CPU::load_state(const uint8_t *buf, size_t size)
+{
+	if(size < sizeof(SaveStateHeader))
+	{
+		return false;
+	}
+
+	if(cart_hash == 0)
+	{
+		cart_hash = util::hash_buffer(cart, cart_size);
+	}
+
+	SaveStateHeader header;
+	memcpy(&header, buf, sizeof(header));
+	if(header.magic != SAVE_STATE_MAGIC || header.version != SAVE_STATE_VERSION ||
+		header.size != state_size || size < state_size || header.cart_hash != cart_hash ||
+		((header.flags & SaveStateHeader::NEEDS_BIOS) && bios == nullptr))
+	{
+		return false;
+	}
+
+	StateReader r(buf + sizeof(header));
+	read_state(r);
+
+	// RAM was replaced behind the write watches, so blocks decoded from it
+	// may be stale. That includes the cartridge RAM banks map_cart() is about
+	// to switch away from.
+	if(blocks != nullptr)
+	{
+		int p = 0;
+		for(; p < 0x100; p++)
+		{
+			if(write_watch[p] & WATCH_CODE)
+			{
+				blocks->invalidate(read_map[p]);
+				set_write_watch(read_map[p], WATCH_CODE, false);
+			}
+		}
+	}
+	map_cart();
+
+	run_deadline = 0;
+	loop_state = LOOP_NONE;
+#ifdef GP_PROFILE
+	profiler->restart();
+#endif
+	return true;
+}
+
+void CPU::save_state_file(std::string path)
+{
+	std::vector<uint8_t> buf(state_size);
+	save_state(buf.data(), buf.size());
+
+	std::ofstream f(path, std::ios::binary);
+	f.write((char*)buf.data(), buf.size());
+	if(!f.good())
+	{
+		throw util::LoadException("couldn't write save state '" + path + "'");
+	}
+}
+
+void CPU::load_state_file(std::string path)
+{
+	uint8_t *buf;
+	size_t size = util::load_buffer(path, buf);
+	bool ok = load_state(buf, size);
+	delete[] buf;
+
+	if(!ok)
+	{
+		throw util::LoadException("save state '" + path + "' is for a different cartridge or version");
+	}
+}
+
+void CPU::hash_state(uint64_t &fb, uint64_t &ram, bool argb)
+{
+	if(argb)
+	{
+		// As the screen kept the frame when the first golden hashes were
+		// recorded. FNV-1a goes byte by byte, so a line at a time hashes the same.
+		uint32_t line[160];
+		fb = util::hash_buffer(nullptr, 0);
+		int y = 0;
+		for(; y < 144; y++)
+		{
+			pixels::convert(*screen->kernels, pixels::ARGB8888, screen->fb + y * 160, line, 160);
+			fb = util::hash_buffer((uint8_t*)line, sizeof(line), fb);
+		}
+	}
+	else
+	{
+		fb = util::hash_buffer(screen->fb, 160 * 144);
+	}
+	ram = util::hash_buffer(wram, 0x2000);
+	ram = util::hash_buffer(vram, 0x2000, ram);
+	ram = util::hash_buffer(hram, 126, ram);
+}
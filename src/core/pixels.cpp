@@ -0,0 +1,296 @@
+#include "pixels.h"
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define GP_PIXELS_X86
+#include <immintrin.h>
+#endif
+
+static void decode_tile_c(const uint8_t *data, uint8_t *out)
+{
+	int y = 0;
+	for(; y < 8; y++)
+	{
+		uint8_t lo = data[y * 2];
+		uint8_t hi = data[y * 2 + 1];
+		int x = 0;
+		for(; x < 8; x++)
+		{
+			out[y * 8 + x] = ((lo >> (7 - x)) & 1) | (((hi >> (7 - x)) & 1) << 1);
+		}
+	}
+}
+
+template<typename T> static void expand_c(const uint8_t *indices, const T *palette, T *out, size_t count)
+{
+	size_t i = 0;
+	for(; i < count; i++)
+	{
+		out[i] = palette[indices[i]];
+	}
+}
+
+static const pixels::Kernels kernels_c = { "c", decode_tile_c, expand_c<uint8_t>, expand_c<uint16_t>, expand_c<uint32_t> };
+
+#ifdef GP_PIXELS_X86
+
+// Each row's plane byte is spread over 8 bytes, then tested against one bit
+// per byte, leftmost pixel in bit 7.
+
+__attribute__((target("sse2")))
+static void decode_tile_sse2(const uint8_t *data, uint8_t *out)
+{
+	const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+	const __m128i one = _mm_set1_epi8(1);
+
+	__m128i v = _mm_loadu_si128((const __m128i*)data);
+	__m128i lo = _mm_and_si128(v, _mm_set1_epi16(0xff));
+	__m128i hi = _mm_srli_epi16(v, 8);
+	__m128i planes = _mm_packus_epi16(lo, hi); // lo0..lo7 hi0..hi7
+
+	__m128i p2 = _mm_unpacklo_epi8(planes, planes); // each byte twice, lo plane
+	__m128i q2 = _mm_unpackhi_epi8(planes, planes); // hi plane
+	__m128i p4[2] = { _mm_unpacklo_epi16(p2, p2), _mm_unpackhi_epi16(p2, p2) }; // rows 0-3, 4-7
+	__m128i q4[2] = { _mm_unpacklo_epi16(q2, q2), _mm_unpackhi_epi16(q2, q2) };
+
+	int i = 0;
+	for(; i < 2; i++)
+	{
+		__m128i l[2] = { _mm_unpacklo_epi32(p4[i], p4[i]), _mm_unpackhi_epi32(p4[i], p4[i]) }; // two rows each
+		__m128i h[2] = { _mm_unpacklo_epi32(q4[i], q4[i]), _mm_unpackhi_epi32(q4[i], q4[i]) };
+
+		int j = 0;
+		for(; j < 2; j++)
+		{
+			__m128i c0 = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(l[j], bits), bits), one);
+			__m128i c1 = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(h[j], bits), bits), _mm_add_epi8(one, one));
+			_mm_storeu_si128((__m128i*)(out + i * 32 + j * 16), _mm_or_si128(c0, c1));
+		}
+	}
+}
+
+// No variable shuffles in SSE2, so select each colour by comparing the index
+// against it.
+__attribute__((target("sse2")))
+static void expand8_sse2(const uint8_t *indices, const uint8_t *palette, uint8_t *out, size_t count)
+{
+	__m128i c[4];
+	int k = 0;
+	for(; k < 4; k++)
+	{
+		c[k] = _mm_set1_epi8((char)palette[k]);
+	}
+
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(indices + i));
+		__m128i p = _mm_and_si128(_mm_cmpeq_epi8(v, _mm_setzero_si128()), c[0]);
+		p = _mm_or_si128(p, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(1)), c[1]));
+		p = _mm_or_si128(p, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(2)), c[2]));
+		p = _mm_or_si128(p, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(3)), c[3]));
+		_mm_storeu_si128((__m128i*)(out + i), p);
+	}
+	expand_c(indices + i, palette, out + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static void expand16_sse2(const uint8_t *indices, const uint16_t *palette, uint16_t *out, size_t count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i c[4];
+	int k = 0;
+	for(; k < 4; k++)
+	{
+		c[k] = _mm_set1_epi16((short)palette[k]);
+	}
+
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(indices + i));
+		int j = 0;
+		for(; j < 2; j++)
+		{
+			__m128i d = j ? _mm_unpackhi_epi8(v, zero) : _mm_unpacklo_epi8(v, zero);
+			__m128i p = _mm_and_si128(_mm_cmpeq_epi16(d, zero), c[0]);
+			p = _mm_or_si128(p, _mm_and_si128(_mm_cmpeq_epi16(d, _mm_set1_epi16(1)), c[1]));
+			p = _mm_or_si128(p, _mm_and_si128(_mm_cmpeq_epi16(d, _mm_set1_epi16(2)), c[2]));
+			p = _mm_or_si128(p, _mm_and_si128(_mm_cmpeq_epi16(d, _mm_set1_epi16(3)), c[3]));
+			_mm_storeu_si128((__m128i*)(out + i + j * 8), p);
+		}
+	}
+	expand_c(indices + i, palette, out + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static void expand32_sse2(const uint8_t *indices, const uint32_t *palette, uint32_t *out, size_t count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i c[4];
+	int k = 0;
+	for(; k < 4; k++)
+	{
+		c[k] = _mm_set1_epi32(palette[k]);
+	}
+
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(indices + i));
+		__m128i w[2] = { _mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero) };
+
+		int j = 0;
+		for(; j < 4; j++)
+		{
+			__m128i d = (j & 1) ? _mm_unpackhi_epi16(w[j >> 1], zero) : _mm_unpacklo_epi16(w[j >> 1], zero);
+			__m128i p = _mm_and_si128(_mm_cmpeq_epi32(d, _mm_setzero_si128()), c[0]);
+			p = _mm_or_si128(p, _mm_and_si128(_mm_cmpeq_epi32(d, _mm_set1_epi32(1)), c[1]));
+			p = _mm_or_si128(p, _mm_and_si128(_mm_cmpeq_epi32(d, _mm_set1_epi32(2)), c[2]));
+			p = _mm_or_si128(p, _mm_and_si128(_mm_cmpeq_epi32(d, _mm_set1_epi32(3)), c[3]));
+			_mm_storeu_si128((__m128i*)(out + i + j * 4), p);
+		}
+	}
+	expand_c(indices + i, palette, out + i, count - i);
+}
+
+static const pixels::Kernels kernels_sse2 = { "sse2", decode_tile_sse2, expand8_sse2, expand16_sse2, expand32_sse2 };
+
+// With byte shuffles, four rows at a time: each 128-bit half picks its two
+// rows' plane bytes straight out of the tile data.
+__attribute__((target("avx2")))
+static void decode_tile_avx2(const uint8_t *data, uint8_t *out)
+{
+	const __m256i bits = _mm256_set1_epi64x(0x0102040810204080LL);
+	const __m256i one = _mm256_set1_epi8(1);
+
+	__m256i v = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)data));
+
+	int i = 0;
+	for(; i < 2; i++)
+	{
+		// rows 4i, 4i+1 in the low half and 4i+2, 4i+3 in the high half
+		char r = i * 8;
+		__m256i lo_sel = _mm256_setr_epi8(
+			r, r, r, r, r, r, r, r, r + 2, r + 2, r + 2, r + 2, r + 2, r + 2, r + 2, r + 2,
+			r + 4, r + 4, r + 4, r + 4, r + 4, r + 4, r + 4, r + 4, r + 6, r + 6, r + 6, r + 6, r + 6, r + 6, r + 6, r + 6);
+		__m256i hi_sel = _mm256_add_epi8(lo_sel, one);
+
+		__m256i l = _mm256_shuffle_epi8(v, lo_sel);
+		__m256i h = _mm256_shuffle_epi8(v, hi_sel);
+		__m256i c0 = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(l, bits), bits), one);
+		__m256i c1 = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(h, bits), bits), _mm256_add_epi8(one, one));
+		_mm256_storeu_si256((__m256i*)(out + i * 32), _mm256_or_si256(c0, c1));
+	}
+}
+
+// Byte palettes are a shuffle per 32 pixels. 16-bit ones are split into
+// their low and high bytes, shuffled separately and interleaved again.
+__attribute__((target("avx2")))
+static void expand8_avx2(const uint8_t *indices, const uint8_t *palette, uint8_t *out, size_t count)
+{
+	uint32_t entries;
+	memcpy(&entries, palette, 4);
+	__m256i table = _mm256_set1_epi32(entries);
+
+	size_t i = 0;
+	for(; i + 32 <= count; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(indices + i));
+		_mm256_storeu_si256((__m256i*)(out + i), _mm256_shuffle_epi8(table, v));
+	}
+	expand_c(indices + i, palette, out + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void expand16_avx2(const uint8_t *indices, const uint16_t *palette, uint16_t *out, size_t count)
+{
+	const __m128i lo = _mm_set1_epi32(
+		(palette[0] & 0xff) | (palette[1] & 0xff) << 8 | (palette[2] & 0xff) << 16 | (uint32_t)(palette[3] & 0xff) << 24);
+	const __m128i hi = _mm_set1_epi32(
+		palette[0] >> 8 | (palette[1] >> 8) << 8 | (palette[2] >> 8) << 16 | (uint32_t)(palette[3] >> 8) << 24);
+
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(indices + i));
+		__m128i l = _mm_shuffle_epi8(lo, v);
+		__m128i h = _mm_shuffle_epi8(hi, v);
+		_mm256_storeu_si256((__m256i*)(out + i), _mm256_setr_m128i(_mm_unpacklo_epi8(l, h), _mm_unpackhi_epi8(l, h)));
+	}
+	expand_c(indices + i, palette, out + i, count - i);
+}
+
+// The palette fits in one register, so it's a plain permute per 8 pixels.
+__attribute__((target("avx2")))
+static void expand32_avx2(const uint8_t *indices, const uint32_t *palette, uint32_t *out, size_t count)
+{
+	__m256i table = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)palette));
+
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8)
+	{
+		__m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(indices + i)));
+		_mm256_storeu_si256((__m256i*)(out + i), _mm256_permutevar8x32_epi32(table, idx));
+	}
+	expand_c(indices + i, palette, out + i, count - i);
+}
+
+static const pixels::Kernels kernels_avx2 = { "avx2", decode_tile_avx2, expand8_avx2, expand16_avx2, expand32_avx2 };
+
+#endif
+
+std::vector<const pixels::Kernels*> pixels::available()
+{
+	std::vector<const Kernels*> k;
+	k.push_back(&kernels_c);
+#ifdef GP_PIXELS_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2"))
+	{
+		k.push_back(&kernels_sse2);
+	}
+	if(__builtin_cpu_supports("avx2"))
+	{
+		k.push_back(&kernels_avx2);
+	}
+#endif
+	return k;
+}
+
+const pixels::Kernels &pixels::best()
+{
+	static const Kernels *k = available().back();
+	return *k;
+}
+
+const pixels::Format pixels::ARGB8888 = { "argb8888", 4, { 0xffffffff, 0xffaaaaaa, 0xff888888, 0xff000000 } };
+const pixels::Format pixels::RGB565 = { "rgb565", 2, { 0xffff, 0xad55, 0x8c51, 0x0000 } };
+const pixels::Format pixels::GRAY8 = { "gray8", 1, { 0xff, 0xaa, 0x88, 0x00 } };
+
+void pixels::convert(const Kernels &k, const Format &format, const uint8_t *shades, void *out, size_t count)
+{
+	int i = 0;
+	if(format.bytes == 1)
+	{
+		uint8_t palette[4];
+		for(; i < 4; i++)
+		{
+			palette[i] = format.shades[i];
+		}
+		k.expand8(shades, palette, (uint8_t*)out, count);
+	}
+	else if(format.bytes == 2)
+	{
+		uint16_t palette[4];
+		for(; i < 4; i++)
+		{
+			palette[i] = format.shades[i];
+		}
+		k.expand16(shades, palette, (uint16_t*)out, count);
+	}
+	else
+	{
+		k.expand32(shades, format.shades, (uint32_t*)out, count);
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// Pixel conversion kernels for the screen, with vector versions picked at run
+// time from what the CPU supports.
+namespace pixels
+{
+	// 16 bytes of 2bpp tile data (low plane, high plane, per row) to 64 colour
+	// indices, row by row.
+	typedef void (*DecodeTileFn)(const uint8_t *data, uint8_t *out);
+
+	// count indices (0-3) to 8, 16 or 32-bit values through a 4-entry palette.
+	typedef void (*Expand8Fn)(const uint8_t *indices, const uint8_t *palette, uint8_t *out, size_t count);
+	typedef void (*Expand16Fn)(const uint8_t *indices, const uint16_t *palette, uint16_t *out, size_t count);
+	typedef void (*Expand32Fn)(const uint8_t *indices, const uint32_t *palette, uint32_t *out, size_t count);
+
+	struct Kernels
+	{
+		const char *name;
+		DecodeTileFn decode_tile;
+		Expand8Fn expand8;
+		Expand16Fn expand16;
+		Expand32Fn expand32;
+	};
+
+	// The fastest set this CPU can run.
+	const Kernels &best();
+
+	// Every set built in that this CPU can run, plain C first.
+	std::vector<const Kernels*> available();
+
+	// What the screen's shades (0 lightest to 3 darkest) turn into when a
+	// frame is shown or saved: bytes per pixel, and the pixel for each shade.
+	// Any other colouring of the same sizes is just another Format.
+	struct Format
+	{
+		const char *name;
+		int bytes; // 1, 2 or 4
+		uint32_t shades[4];
+	};
+
+	extern const Format ARGB8888;
+	extern const Format RGB565;
+	extern const Format GRAY8;
+
+	// count shades to pixels of format at out.
+	void convert(const Kernels &k, const Format &format, const uint8_t *shades, void *out, size_t count);
+}
@@ -0,0 +1,306 @@
+#include "rewind.h"
+#include "cpu.h"
+#include <string.h>
+
+// A delta is a list of (skip, length, bytes) runs, with skip and length as
+// LEB128 varints, ended by a run with length 0. Applying it XORs the bytes
+// into the state at the given positions; with old == nullptr the XOR is
+// against zero, which stores new as it is.
+
+static inline uint8_t *put_varint(uint8_t *o, size_t v)
+{
+	while(v >= 0x80)
+	{
+		*o++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*o++ = (uint8_t)v;
+	return o;
+}
+
+static inline const uint8_t *get_varint(const uint8_t *i, size_t &v)
+{
+	v = 0;
+	int shift = 0;
+	uint8_t b;
+	do
+	{
+		b = *i++;
+		v |= (size_t)(b & 0x7f) << shift;
+		shift += 7;
+	} while(b & 0x80);
+	return i;
+}
+
+static inline uint64_t word(const uint8_t *p, size_t pos)
+{
+	uint64_t w;
+	memcpy(&w, p + pos, 8);
+	return w;
+}
+
+// Runs of fewer equal bytes than this are carried inside a literal; a new
+// run header costs about as much.
+#define MIN_SKIP 8
+
+static size_t encode(const uint8_t *old, const uint8_t *cur, size_t size, uint8_t *out)
+{
+	uint8_t *o = out;
+	size_t pos = 0;
+	while(pos < size)
+	{
+		size_t start = pos;
+		if(old != nullptr)
+		{
+			while(pos + 8 <= size && word(old, pos) == word(cur, pos)) pos += 8;
+			while(pos < size && old[pos] == cur[pos]) pos++;
+		}
+		else
+		{
+			while(pos + 8 <= size && word(cur, pos) == 0) pos += 8;
+			while(pos < size && cur[pos] == 0) pos++;
+		}
+		if(pos == size)
+		{
+			break;
+		}
+
+		size_t lit = pos;
+		size_t same = 0;
+		for(; pos < size && same < MIN_SKIP; pos++)
+		{
+			uint8_t x = old != nullptr ? old[pos] ^ cur[pos] : cur[pos];
+			same = x == 0 ? same + 1 : 0;
+		}
+		pos -= same;
+
+		o = put_varint(o, lit - start);
+		o = put_varint(o, pos - lit);
+		if(old != nullptr)
+		{
+			size_t i = lit;
+			for(; i < pos; i++)
+			{
+				*o++ = old[i] ^ cur[i];
+			}
+		}
+		else
+		{
+			memcpy(o, cur + lit, pos - lit);
+			o += pos - lit;
+		}
+	}
+	o = put_varint(o, 0);
+	o = put_varint(o, 0);
+	return o - out;
+}
+
+static void apply(const uint8_t *in, uint8_t *state)
+{
+	while(true)
+	{
+		size_t skip, len;
+		in = get_varint(in, skip);
+		in = get_varint(in, len);
+		if(len == 0)
+		{
+			break;
+		}
+
+		state += skip;
+		size_t i = 0;
+		for(; i < len; i++)
+		{
+			state[i] ^= in[i];
+		}
+		state += len;
+		in += len;
+	}
+}
+
+// Literal runs are at least one byte longer than the run before them, so a
+// delta can't be bigger than this.
+static size_t max_encoded(size_t size)
+{
+	return size * 2 + 16;
+}
+
+RewindBuffer::RewindBuffer(CPU *cpu, size_t capacity, unsigned int max_frames, unsigned int keyframe_interval)
+	: cpu(cpu), keyframe_interval(keyframe_interval), records(max_frames)
+{
+	state_size = cpu->save_state_size();
+	head = new uint8_t[state_size];
+	next = new uint8_t[state_size];
+	scratch = new uint8_t[max_encoded(state_size) * 2];
+
+	// Always room for at least one frame with a keyframe.
+	ring_size = capacity < max_encoded(state_size) * 2 ? max_encoded(state_size) * 2 : capacity;
+	ring = new uint8_t[ring_size];
+
+	clear();
+}
+
+RewindBuffer::~RewindBuffer()
+{
+	delete[] head;
+	delete[] next;
+	delete[] scratch;
+	delete[] ring;
+}
+
+void RewindBuffer::clear()
+{
+	have_head = false;
+	frame = 0;
+	write_offset = 0;
+	used = 0;
+	first = 0;
+	count = 0;
+}
+
+unsigned int RewindBuffer::frames()
+{
+	return count;
+}
+
+size_t RewindBuffer::memory_used()
+{
+	return used;
+}
+
+size_t RewindBuffer::capacity()
+{
+	return ring_size;
+}
+
+RewindBuffer::Record &RewindBuffer::newest()
+{
+	return records[(first + count - 1) % records.size()];
+}
+
+RewindBuffer::Record &RewindBuffer::oldest()
+{
+	return records[first];
+}
+
+void RewindBuffer::drop_oldest()
+{
+	Record &r = oldest();
+	used -= r.delta_size + r.key_size;
+	first = (first + 1) % records.size();
+	count--;
+}
+
+void RewindBuffer::drop_newest()
+{
+	Record &r = newest();
+	used -= r.delta_size + r.key_size;
+	write_offset = r.offset;
+	count--;
+	frame--;
+}
+
+// Room for size bytes at write_offset, dropping old records in the way.
+// Records are written one after another, so the free space is from
+// write_offset up to the oldest record.
+uint8_t *RewindBuffer::reserve(size_t size)
+{
+	if(count == records.size())
+	{
+		drop_oldest();
+	}
+
+	if(write_offset + size > ring_size)
+	{
+		// Wrap; the tail of the ring goes unused this time round.
+		while(count > 0 && oldest().offset >= write_offset)
+		{
+			drop_oldest();
+		}
+		write_offset = 0;
+	}
+
+	while(count > 0 && oldest().offset >= write_offset && oldest().offset < write_offset + size)
+	{
+		drop_oldest();
+	}
+
+	return ring + write_offset;
+}
+
+void RewindBuffer::push()
+{
+	if(!have_head)
+	{
+		cpu->save_state(head, state_size);
+		have_head = true;
+		frame = 1;
+		return;
+	}
+
+	cpu->save_state(next, state_size);
+
+	// Encoded to the side first: reserving the worst case in the ring would
+	// throw away far more old frames than the usual few hundred bytes need.
+	bool key = keyframe_interval != 0 && frame % keyframe_interval == 0;
+	Record r;
+	r.delta_size = encode(next, head, state_size, scratch);
+	r.key_size = key ? encode(nullptr, next, state_size, scratch + r.delta_size) : 0;
+
+	memcpy(reserve(r.delta_size + r.key_size), scratch, r.delta_size + r.key_size);
+	r.offset = write_offset;
+
+	records[(first + count) % records.size()] = r;
+	count++;
+	write_offset += r.delta_size + r.key_size;
+	used += r.delta_size + r.key_size;
+	frame++;
+
+	uint8_t *t = head;
+	head = next;
+	next = t;
+}
+
+bool RewindBuffer::step_back()
+{
+	return seek_back(1);
+}
+
+bool RewindBuffer::seek_back(unsigned int n)
+{
+	if(n == 0 || n > count)
+	{
+		return false;
+	}
+	size_t target = count - n;
+
+	// The oldest keyframe among the records being dropped is the closest
+	// one to the target; without one, walk back from the newest frame.
+	size_t i = target;
+	for(; i < count; i++)
+	{
+		if(records[(first + i) % records.size()].key_size != 0)
+		{
+			break;
+		}
+	}
+
+	if(i < count)
+	{
+		Record &r = records[(first + i) % records.size()];
+		memset(head, 0, state_size);
+		apply(ring + r.offset + r.delta_size, head);
+		while(count > i + 1)
+		{
+			drop_newest();
+		}
+	}
+
+	while(count > target)
+	{
+		apply(ring + newest().offset, head);
+		drop_newest();
+	}
+	cpu->load_state(head, state_size);
+	return true;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class CPU;
+
+// Frame history for rewinding, in a fixed amount of memory.
+//
+// push() records the machine once per frame. The newest state is kept whole;
+// each frame before it is stored as the XOR of it and the frame after,
+// run-length encoded, so stepping back one frame only has to apply one delta
+// and anything that didn't change costs next to nothing. Every
+// keyframe_interval frames the state is also stored whole (RLE against
+// zero), so seek_back() over long distances doesn't have to walk every delta.
+//
+// Records live in a byte ring; once it or the record table is full, the
+// oldest frames are dropped.
+class RewindBuffer
+{
+public:
+	RewindBuffer(CPU *cpu, size_t capacity, unsigned int max_frames = 60 * 60 * 10, unsigned int keyframe_interval = 60);
+	~RewindBuffer();
+
+	// Record the machine's current state as the newest frame.
+	void push();
+
+	// Restore the frame before the newest one and forget the newest. false
+	// (and nothing changed) if there is no history left.
+	bool step_back();
+
+	// step_back() frames times, but going through the nearest keyframe.
+	bool seek_back(unsigned int frames);
+
+	void clear();
+
+	unsigned int frames(); // how far back step_back() can go
+	size_t memory_used(); // bytes of the ring holding records
+	size_t capacity();
+
+private:
+	struct Record
+	{
+		size_t offset;
+		uint32_t delta_size; // the previous frame XOR this one
+		uint32_t key_size; // this frame, or 0 if it isn't a keyframe
+	};
+
+	CPU *cpu;
+	size_t state_size;
+	unsigned int keyframe_interval;
+
+	uint8_t *head; // state of the newest frame
+	uint8_t *next;
+	uint8_t *scratch; // push() encodes here
+	bool have_head;
+	unsigned int frame; // frames pushed since the last clear
+
+	uint8_t *ring;
+	size_t ring_size;
+	size_t write_offset;
+	size_t used;
+
+	std::vector<Record> records; // a ring too, oldest at first
+	size_t first;
+	size_t count;
+
+	Record &newest();
+	Record &oldest();
+	uint8_t *reserve(size_t size);
+	void drop_oldest();
+	void drop_newest();
+};
@@ -0,0 +1,131 @@
+#include "romimage.h"
+#include "util.h"
+#include <string.h>
+#include <map>
+#include <mutex>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define GP_ROM_MMAP
+
+namespace
+{
+	// Open images by file identity, so the same file reached through
+	// different paths is still only mapped once.
+	typedef std::pair<uint64_t, uint64_t> FileId;
+
+	std::mutex open_lock;
+	std::map<FileId, std::weak_ptr<const RomImage> > open_images;
+}
+#endif
+
+RomImage::RomImage() : bytes(nullptr), length(0), mapped(false)
+{
+}
+
+RomImage::~RomImage()
+{
+#ifdef GP_ROM_MMAP
+	if(mapped)
+	{
+		munmap((void*)bytes, length);
+	}
+#endif
+}
+
+std::shared_ptr<const RomImage> RomImage::copy(const uint8_t *data, size_t size)
+{
+	std::shared_ptr<RomImage> image(new RomImage());
+	image->owned.assign(data, data + size);
+	image->bytes = image->owned.data();
+	image->length = size;
+	return image;
+}
+
+std::shared_ptr<const RomImage> RomImage::wrap(const uint8_t *data, size_t size)
+{
+	std::shared_ptr<RomImage> image(new RomImage());
+	image->bytes = data;
+	image->length = size;
+	return image;
+}
+
+#ifdef GP_ROM_MMAP
+std::shared_ptr<const RomImage> RomImage::open(const std::string &path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0)
+	{
+		if(fd >= 0)
+		{
+			close(fd);
+		}
+		throw util::LoadException("couldn't open file '" + path + "'");
+	}
+	if(st.st_size == 0)
+	{
+		close(fd);
+		throw util::LoadException("file '" + path + "' is empty");
+	}
+
+	FileId id((uint64_t)st.st_dev, (uint64_t)st.st_ino);
+	std::lock_guard<std::mutex> hold(open_lock);
+
+	std::shared_ptr<const RomImage> image = open_images[id].lock();
+	if(image)
+	{
+		close(fd);
+		return image;
+	}
+
+	int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE; // fault it all in now rather than while running
+#endif
+	void *p = mmap(nullptr, st.st_size, PROT_READ, flags, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED)
+	{
+		throw util::LoadException("couldn't map file '" + path + "'");
+	}
+	madvise(p, st.st_size, MADV_WILLNEED);
+
+	std::shared_ptr<RomImage> mapping(new RomImage());
+	mapping->bytes = (const uint8_t*)p;
+	mapping->length = st.st_size;
+	mapping->mapped = true;
+
+	open_images[id] = mapping;
+
+	// Drop entries for images that have since been unmapped.
+	std::map<FileId, std::weak_ptr<const RomImage> >::iterator it = open_images.begin();
+	while(it != open_images.end())
+	{
+		if(it->second.expired())
+		{
+			it = open_images.erase(it);
+		}
+		else
+		{
+			it++;
+		}
+	}
+
+	return mapping;
+}
+#else
+// Without mmap, every open reads its own copy.
+std::shared_ptr<const RomImage> RomImage::open(const std::string &path)
+{
+	uint8_t *buf;
+	size_t size = util::load_buffer(path, buf);
+	std::shared_ptr<const RomImage> image = copy(buf, size);
+	delete[] buf;
+	return image;
+}
+#endif
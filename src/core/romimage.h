@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A read-only ROM or BIOS image that any number of CPUs can share.
+//
+// Files are mapped rather than read, so their pages come straight from the
+// page cache and are shared with every other process that has the same file
+// open. Within a process, opening a file that's already open hands back the
+// same image, and it's unmapped once the last CPU using it lets go.
+class RomImage
+{
+public:
+	~RomImage();
+
+	// Throws util::LoadException if the file can't be opened or is empty.
+	static std::shared_ptr<const RomImage> open(const std::string &path);
+
+	// An image holding its own copy of data.
+	static std::shared_ptr<const RomImage> copy(const uint8_t *data, size_t size);
+
+	// An image that reads data where it is. The caller keeps it alive and
+	// unchanged for as long as any CPU is using the image.
+	static std::shared_ptr<const RomImage> wrap(const uint8_t *data, size_t size);
+
+	const uint8_t *data() const { return bytes; }
+	size_t size() const { return length; }
+
+private:
+	RomImage();
+
+	const uint8_t *bytes;
+	size_t length;
+	bool mapped;
+	std::vector<uint8_t> owned; // where bytes points for copies
+
+	RomImage(const RomImage &) = delete;
+	RomImage &operator=(const RomImage &) = delete;
+};
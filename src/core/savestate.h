@@ -0,0 +1,70 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// A save state is a SaveStateHeader followed by every field of the machine
+// in a fixed order, in host byte order and without padding. Anything that
+// changes the order or the fields has to bump SAVE_STATE_VERSION.
+#define SAVE_STATE_MAGIC 0x54535047 // "GPST"
+#define SAVE_STATE_VERSION 7
+
+struct SaveStateHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size; // of the whole state, header included
+	uint32_t flags;
+	uint64_t cart_hash; // util::hash_buffer of the cartridge the state was saved from
+
+	enum Flags
+	{
+		NEEDS_BIOS = (1 << 0) // saved while the BIOS was still mapped
+	};
+};
+
+// Appends fields to a state buffer. With a null buffer it only counts, which
+// is how the size of a state is worked out.
+class StateWriter
+{
+public:
+	StateWriter(uint8_t *buf) : p(buf), size(0) {}
+
+	template<typename T> void put(const T &v)
+	{
+		put((const uint8_t*)&v, sizeof(T));
+	}
+
+	void put(const uint8_t *src, size_t n)
+	{
+		if(p != nullptr)
+		{
+			memcpy(p + size, src, n);
+		}
+		size += n;
+	}
+
+	uint8_t *p;
+	size_t size;
+};
+
+// Reads fields back in the order StateWriter wrote them. The caller checks
+// the header (and so the size) first.
+class StateReader
+{
+public:
+	StateReader(const uint8_t *buf) : p(buf) {}
+
+	template<typename T> void get(T &v)
+	{
+		get((uint8_t*)&v, sizeof(T));
+	}
+
+	void get(uint8_t *dst, size_t n)
+	{
+		memcpy(dst, p, n);
+		p += n;
+	}
+
+	const uint8_t *p;
+};
@@ -0,0 +1,128 @@
+#include "scheduler.h"
+#include "savestate.h"
+
+Scheduler::Scheduler()
+{
+	size = 0;
+	int i = 0;
+	for(; i < NUM_EVENTS; i++)
+	{
+		pos[i] = -1;
+	}
+}
+
+// Ties go to the lower event number, so the order never depends on the
+// order things were scheduled in.
+bool Scheduler::before(const Entry &a, const Entry &b)
+{
+	return a.when < b.when || (a.when == b.when && a.event < b.event);
+}
+
+void Scheduler::place(int i, Entry e)
+{
+	heap[i] = e;
+	pos[e.event] = i;
+}
+
+void Scheduler::sift_up(int i)
+{
+	Entry e = heap[i];
+	while(i > 0 && before(e, heap[(i - 1) / 2]))
+	{
+		place(i, heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	place(i, e);
+}
+
+void Scheduler::sift_down(int i)
+{
+	Entry e = heap[i];
+	while(true)
+	{
+		int child = i * 2 + 1;
+		if(child >= size)
+		{
+			break;
+		}
+		if(child + 1 < size && before(heap[child + 1], heap[child]))
+		{
+			child++;
+		}
+		if(!before(heap[child], e))
+		{
+			break;
+		}
+		place(i, heap[child]);
+		i = child;
+	}
+	place(i, e);
+}
+
+void Scheduler::remove(int i)
+{
+	pos[heap[i].event] = -1;
+	size--;
+	if(i != size)
+	{
+		Event moved = heap[size].event;
+		place(i, heap[size]);
+		sift_down(i);
+		sift_up(pos[moved]);
+	}
+}
+
+void Scheduler::schedule(Event e, uint64_t when)
+{
+	if(pos[e] != -1)
+	{
+		remove(pos[e]);
+	}
+	if(when == NEVER)
+	{
+		return;
+	}
+
+	Entry entry = { when, e };
+	place(size, entry);
+	size++;
+	sift_up(size - 1);
+}
+
+void Scheduler::cancel(Event e)
+{
+	schedule(e, NEVER);
+}
+
+uint64_t Scheduler::when(Event e)
+{
+	return pos[e] != -1 ? heap[pos[e]].when : NEVER;
+}
+
+Scheduler::Event Scheduler::pop(uint64_t &when)
+{
+	Event e = heap[0].event;
+	when = heap[0].when;
+	remove(0);
+	return e;
+}
+
+void Scheduler::save_state(StateWriter &w)
+{
+	int i = 0;
+	for(; i < NUM_EVENTS; i++)
+	{
+		w.put(when((Event)i));
+	}
+}
+
+void Scheduler::load_state(StateReader &r)
+{
+	int i = 0;
+	for(; i < NUM_EVENTS; i++)
+	{
+		uint64_t t;
+		r.get(t);
+		schedule((Event)i, t);
+	}
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <stdint.h>
+
+class StateWriter;
+class StateReader;
+
+// Hardware events keyed on the CPU's cycle counter. The CPU runs straight up
+// to next() and handles whatever is due there, so nothing has to be polled
+// per instruction.
+//
+// Every kind of event is scheduled at most once, which keeps the heap at
+// NUM_EVENTS entries; scheduling one again moves it.
+class Scheduler
+{
+public:
+	enum Event
+	{
+		LINE, // the end of a scanline: LY moves on, VBlank starts at 144
+		DRAW, // mode 3 starts on a visible line, which is drawn then
+		HBLANK, // mode 0 starts, only while STAT wants an interrupt for it
+		TIMER, // TIMA overflows
+		DMA, // the OAM DMA transfer is done
+		SERIAL, // a byte has gone out of the serial port
+		NUM_EVENTS
+	};
+
+	static const uint64_t NEVER = ~0ULL;
+
+	Scheduler();
+
+	void schedule(Event e, uint64_t when); // NEVER cancels
+	void cancel(Event e);
+	uint64_t when(Event e); // NEVER if it isn't scheduled
+
+	// The cycle the earliest event is due at.
+	uint64_t next()
+	{
+		return size > 0 ? heap[0].when : NEVER;
+	}
+
+	// Takes the earliest event off, which the caller reschedules if it repeats.
+	Event pop(uint64_t &when);
+
+	void save_state(StateWriter &w);
+	void load_state(StateReader &r);
+
+private:
+	struct Entry
+	{
+		uint64_t when;
+		Event event;
+	};
+
+	Entry heap[NUM_EVENTS];
+	int pos[NUM_EVENTS]; // index into heap, or -1
+	int size;
+
+	bool before(const Entry &a, const Entry &b);
+	void place(int i, Entry e);
+	void sift_up(int i);
+	void sift_down(int i);
+	void remove(int i);
+};
@@ -1,4 +1,6 @@
 #include "screen.h"
+#include "savestate.h"
+#include "pixels.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <fstream>
@@ -7,7 +9,20 @@
 GBScreen::GBScreen(uint8_t *vram)
 {
 	this->vram = vram;
-	fb = (uint32_t*)malloc(144 * 160 * 4); // argb8
+	kernels = &pixels::best();
+	skip_render = false;
+	fb = (uint8_t*)malloc(144 * 160);
+	reset();
+}
+
+void GBScreen::reset()
+{
+	memset(fb, 0, 144 * 160);
+
+	display_enable = tilemap_select = window_enable = tiledata_select = false;
+	bgtile_select = obj_size = obj_enable = bg_display = false;
+	stat = 0;
+	coincidence = false;
 
 	lcdc = 0;
 	scroll_y = scroll_x = 0;
@@ -20,12 +35,12 @@ GBScreen::GBScreen(uint8_t *vram)
 	memset(sp0_palette, 0, sizeof(sp0_palette));
 	memset(sp1_palette, 0, sizeof(sp1_palette));
 
-	shades[3] = 0xff000000;
-	shades[2] = 0xff888888;
-	shades[1] = 0xffaaaaaa;
-	shades[0] = 0xffffffff;
-
 	scanline = 0;
+	line_start = 0;
+	lyc = 0;
+	memset(oam, 0, sizeof(oam));
+
+	invalidate_tiles();
 }
 
 GBScreen::~GBScreen()
@@ -33,59 +48,71 @@ GBScreen::~GBScreen()
 	free(fb);
 }
 
-void GBScreen::refresh()
+void GBScreen::tile_written(uint16_t offset)
 {
-	memset(fb, 0xff, 160*144*4);
+	tile_dirty[offset / 16] = true;
+}
 
-	if(display_enable)
+void GBScreen::invalidate_tiles()
+{
+	memset(tile_dirty, 1, sizeof(tile_dirty));
+}
+
+const uint8_t *GBScreen::tile(int n)
+{
+	if(tile_dirty[n])
 	{
-		if(bg_display)
-		{
-			uint8_t *bgtilemap = vram + (bgtile_select ? 0x1c00 : 0x1800);
-			uint8_t *bgdata = vram + (tiledata_select ? 0 : 0x800);
-
-			int x = 0;
-			int y = 0;
-			int i = 0;
-			int j = 0;
-			int k = 0;
-
-			int bg_x = scroll_x / 8;
-			int bg_y = scroll_y / 8;
-
-			if(tiledata_select)	// 0x8000 onwards
-			{
-				for(y = bg_y; y < bg_y+18; y++)
-				{
-					for(x = bg_x; x < bg_x + 20; x++)
-					{
-						int idx = bgtilemap[(y%32) * 32 + (x%32)] * 16;
-						for(i = 0; i < 8; i++)
-						{
-							for(j = 0, k = 7; j < 8; j++, k--)
-							{
-								int rx = (x%32)*8 + k - scroll_x;
-								int ry = (y%32)*8 + i - scroll_y;
-								int c = ((bgdata[idx] & (1 << j)) != 0) | ( ((bgdata[idx + 1] & (1 << j)) != 0) << 1); 
-								if(c != 0)
-								{
-									fb[(ry%160) * 160 + rx%160] = bg_palette[c];
-								}
-							}
-							idx += 2;
-						}
-					}
-				}
-			}
-			else	// 0x8800 onwards
-			{
-				printf("don't currently handle high tiledata...");
-			}
-		}
+		kernels->decode_tile(vram + n * 16, tile_pixels[n]);
+		tile_dirty[n] = false;
+	}
+	return tile_pixels[n];
+}
+
+// Draws line y of the frame with the registers as they are now.
+void GBScreen::render_line(int y)
+{
+	uint8_t *line = fb + y * 160;
+	int x = 0;
+
+	if(!display_enable || !bg_display)
+	{
+		memset(line, 0, 160);
+		return;
+	}
+
+	uint8_t *bgtilemap = vram + (bgtile_select ? 0x1c00 : 0x1800);
+	int bg_y = (y + scroll_y) & 0xff;
+	uint8_t *row = bgtilemap + (bg_y / 8) * 32;
+
+	int tx = scroll_x / 8;
+	uint8_t *out = line_indices + 8 - (scroll_x & 7);
+	for(x = 0; x < 168; x += 8, tx++)
+	{
+		uint8_t n = row[tx & 31];
+		const uint8_t *src = tile(tiledata_select ? n : 256 + (int8_t)n) + (bg_y & 7) * 8; // 0x8000 onwards, or signed around 0x9000
+		memcpy(out + x, src, 8);
 	}
+
+	kernels->expand8(line_indices + 8, bg_palette, line, 160);
 }
 
-uint8_t GBScreen::read(uint16_t virt)
+void GBScreen::convert(const pixels::Format &format, void *out)
+{
+	pixels::convert(*kernels, format, fb, out, 160 * 144);
+}
+
+// The whole frame at once, for when the machine state has been replaced
+// under the screen (save states, rewinding).
+void GBScreen::refresh()
+{
+	int y = 0;
+	for(; y < VBLANK_START; y++)
+	{
+		render_line(y);
+	}
+}
+
+uint8_t GBScreen::read(uint16_t virt, uint64_t now)
 {
 	uint16_t val = virt - 0xff40;
 	switch(val)
@@ -95,7 +122,7 @@ uint8_t GBScreen::read(uint16_t virt)
 		break;
 
 		case 1:
-			return (stat << 3) | mode | ((int)coincidence << 2);
+			return 0x80 | (stat << 3) | ((int)coincidence << 2) | mode_at(now);
 		break;
 
 		case 2:
@@ -107,40 +134,51 @@ uint8_t GBScreen::read(uint16_t virt)
 		break;
 
 		case 4:
-			return scanline; // hack
+			return display_enable ? scanline : 0;
+		break;
+
+		case 5:
+			return lyc;
 		break;
 
 		case 7:
 			return bg_palette_reg;
 		break;
 
-		default:
-			printf("unimplemented lcd register read %02x\n", val);
-			exit(0);
+		case 8:
+			return sp0_palette_reg;
+		break;
+
+		case 9:
+			return sp1_palette_reg;
+		break;
+
+		default: // WY and WX are the CPU's to fail, the rest aren't there
+			return 0xff;
 		break;
 	}
 }
 
 void GBScreen::build_bg_palette()
 {
-	bg_palette[3] = shades[(bg_palette_reg & (3 << 6)) >> 6];
-	bg_palette[2] = shades[(bg_palette_reg & (3 << 4)) >> 4];
-	bg_palette[1] = shades[(bg_palette_reg & (3 << 2)) >> 2];
-	bg_palette[0] = shades[(bg_palette_reg & 3)];
+	bg_palette[3] = (bg_palette_reg & (3 << 6)) >> 6;
+	bg_palette[2] = (bg_palette_reg & (3 << 4)) >> 4;
+	bg_palette[1] = (bg_palette_reg & (3 << 2)) >> 2;
+	bg_palette[0] = bg_palette_reg & 3;
 }
 
 void GBScreen::build_sp0_palette()
 {
-	sp0_palette[3] = shades[(sp0_palette_reg & (3 << 6)) >> 6];
-	sp0_palette[2] = shades[(sp0_palette_reg & (3 << 4)) >> 4];
-	sp0_palette[1] = shades[(sp0_palette_reg & (3 << 2)) >> 2];
+	sp0_palette[3] = (sp0_palette_reg & (3 << 6)) >> 6;
+	sp0_palette[2] = (sp0_palette_reg & (3 << 4)) >> 4;
+	sp0_palette[1] = (sp0_palette_reg & (3 << 2)) >> 2;
 }
 
 void GBScreen::build_sp1_palette()
 {
-	sp1_palette[3] = shades[(sp1_palette_reg & (3 << 6)) >> 6];
-	sp1_palette[2] = shades[(sp1_palette_reg & (3 << 4)) >> 4];
-	sp1_palette[1] = shades[(sp1_palette_reg & (3 << 2)) >> 2];
+	sp1_palette[3] = (sp1_palette_reg & (3 << 6)) >> 6;
+	sp1_palette[2] = (sp1_palette_reg & (3 << 4)) >> 4;
+	sp1_palette[1] = (sp1_palette_reg & (3 << 2)) >> 2;
 }
 
 void GBScreen::write(uint16_t virt, uint8_t v)
@@ -162,22 +200,22 @@ void GBScreen::write(uint16_t virt, uint8_t v)
 		break;
 
 		case 1:
-			stat = v >> 3;
+			stat = (v >> 3) & 0xf;
 		break;
 
 		case 2:
 			scroll_y = v;
-			refresh();
 		break;
 
 		case 3:
 			scroll_x = v;
-			refresh();
 		break;
 
-		case 4: // lcd line
-			printf("uh\n");
-			exit(0);
+		case 4: // LY is read only
+		break;
+
+		case 5:
+			lyc = v;
 		break;
 
 		case 7:
@@ -199,27 +237,114 @@ void GBScreen::write(uint16_t virt, uint8_t v)
 		case 0x0b:
 		break;
 
-		default:
-			printf("unimplemented lcd register write %02x\n", val);
-			exit(0);
+		default: // not there
 		break;
 	}
 }
 
-void GBScreen::start_frame()
+uint8_t GBScreen::mode_at(uint64_t now)
 {
-	scanline = 0;
+	if(!display_enable)
+	{
+		return 0;
+	}
+	if(scanline >= VBLANK_START)
+	{
+		return 1;
+	}
+
+	uint64_t t = now - line_start;
+	return t < OAM_CYCLES ? 2 : t < OAM_CYCLES + DRAW_CYCLES ? 3 : 0;
+}
+
+bool GBScreen::wants_hblank()
+{
+	return display_enable && scanline < VBLANK_START && (stat & (1 << 0));
 }
 
-void GBScreen::step()
+uint8_t GBScreen::start_hblank()
 {
-	if(scanline != VBLANK_END)
+	return wants_hblank() ? IRQ_STAT : 0;
+}
+
+// What a line shows is fixed as mode 3 starts, as though every pixel were
+// drawn then: a write made in HBlank or OAM search shows on the line being
+// started, one made during mode 3 only from the next line.
+void GBScreen::draw_line()
+{
+	if(scanline < VBLANK_START && !skip_render)
 	{
-		scanline++;
+		render_line(scanline);
 	}
 }
 
-void GBScreen::process_interrupts()
+uint8_t GBScreen::end_line(uint64_t now)
 {
-	// Stuff.
-}
\ No newline at end of file
+	scanline = (scanline + 1) % LINES_PER_FRAME;
+	line_start = now;
+	coincidence = scanline == lyc;
+
+	if(!display_enable)
+	{
+		return 0;
+	}
+
+	uint8_t irq = 0;
+	if(scanline == VBLANK_START)
+	{
+		irq |= IRQ_VBLANK;
+		if(stat & (1 << 1))
+		{
+			irq |= IRQ_STAT;
+		}
+	}
+	else if(scanline < VBLANK_START && (stat & (1 << 2)))
+	{
+		irq |= IRQ_STAT;
+	}
+	if(coincidence && (stat & (1 << 3)))
+	{
+		irq |= IRQ_STAT;
+	}
+	return irq;
+}
+
+void GBScreen::save_state(StateWriter &w)
+{
+	w.put(lcdc);
+	w.put(stat);
+	w.put(coincidence);
+	w.put(scroll_x);
+	w.put(scroll_y);
+	w.put(bg_palette_reg);
+	w.put(sp0_palette_reg);
+	w.put(sp1_palette_reg);
+	w.put(ct);
+	w.put(scanline);
+	w.put(line_start);
+	w.put(lyc);
+	w.put(oam, sizeof(oam));
+}
+
+void GBScreen::load_state(StateReader &r)
+{
+	r.get(lcdc);
+	r.get(stat);
+	r.get(coincidence);
+	r.get(scroll_x);
+	r.get(scroll_y);
+	r.get(bg_palette_reg);
+	r.get(sp0_palette_reg);
+	r.get(sp1_palette_reg);
+	r.get(ct);
+	r.get(scanline);
+	r.get(line_start);
+	r.get(lyc);
+	r.get(oam, sizeof(oam));
+
+	write(0xff40, lcdc); // unpack the lcdc bits
+	invalidate_tiles(); // vram was replaced along with everything else
+	build_bg_palette();
+	build_sp0_palette();
+	build_sp1_palette();
+}
@@ -1,27 +1,66 @@
 #pragma once
 #include <stdint.h>
 
+class StateWriter;
+class StateReader;
+namespace pixels { struct Kernels; struct Format; }
+
 #define VBLANK_START 144
 #define VBLANK_END 153
+#define CYCLES_PER_LINE 456
+#define LINES_PER_FRAME 154
+#define OAM_CYCLES 80 // mode 2 at the start of each visible line
+#define DRAW_CYCLES 172 // mode 3 after it, then mode 0 to the end of the line
+
+// Interrupt bits of IF that the screen raises.
+#define IRQ_VBLANK (1 << 0)
+#define IRQ_STAT (1 << 1)
+
+#define NUM_TILES 384 // 0x8000-0x97ff
 
 class GBScreen
 {
 public:
 	GBScreen(uint8_t *vram);
-	GBScreen(uint8_t *vram, uint32_t *fb_data);
 	~GBScreen();
 
+	void reset(); // to how it is at power on
+
 	uint8_t *vram;
-	uint32_t *fb;
+
+	// The frame as one shade per pixel, 0 (lightest) to 3, with the palette
+	// registers already applied. Colours only come into it when something
+	// wants to show or save the frame, through convert().
+	uint8_t *fb;
+	void convert(const pixels::Format &format, void *out);
+
+	const pixels::Kernels *kernels; // pixels::best() unless a benchmark says otherwise
+
+	// While set, draw_line() leaves fb alone and only keeps the registers and
+	// timing going, for frames nobody is going to see. Not part of the state.
+	bool skip_render;
 
 	void refresh();
-	uint8_t read(uint16_t virt);
+	void render_line(int y);
+	uint8_t read(uint16_t virt, uint64_t now);
 	void write(uint16_t virt, uint8_t v);
 
-	void start_frame();
-	void step();
+	// Timing, driven by the CPU's scheduler. The screen runs whether or not
+	// it's switched on, it just shows nothing and raises no interrupts.
+	// end_line() and start_hblank() return the IF bits to raise.
+	uint8_t end_line(uint64_t now); // LY moves on
+	void draw_line(); // mode 3 starts on a visible line
+	uint8_t start_hblank();
+	bool wants_hblank(); // does STAT want an interrupt when mode 0 starts?
+	uint8_t mode_at(uint64_t now);
+
+	// Tile data at vram + offset has changed. The CPU calls this for writes to
+	// 0x8000-0x97ff; anything writing vram directly calls invalidate_tiles().
+	void tile_written(uint16_t offset);
+	void invalidate_tiles();
 
-	void process_interrupts();
+	void save_state(StateWriter &w);
+	void load_state(StateReader &r);
 
 	bool display_enable;
 	bool tilemap_select;
@@ -40,20 +79,32 @@ public:
 	uint8_t sp0_palette_reg;
 	uint8_t sp1_palette_reg;
 
-	uint32_t bg_palette[4];
-	uint32_t sp0_palette[3];
-	uint32_t sp1_palette[3];
+	// The shade for each colour index.
+	uint8_t bg_palette[4];
+	uint8_t sp0_palette[4]; // colour 0 is transparent, so [0] is unused
+	uint8_t sp1_palette[4];
 	uint8_t ct;
 
-	uint32_t shades[4];
-
 	uint8_t scanline;
+	uint64_t line_start; // the cycle the current line started at
+	uint8_t lyc;
 
-	uint8_t stat;
-	uint8_t mode;
+	uint8_t stat; // interrupt enables, STAT bits 3-6 shifted down
 	bool coincidence;
 
+	uint8_t oam[0xa0];
+
 private:
+	// Tiles decoded to one colour index per pixel, row by row, on first use
+	// after they change.
+	uint8_t tile_pixels[NUM_TILES][64];
+	bool tile_dirty[NUM_TILES];
+	const uint8_t *tile(int n);
+
+	// The line being drawn as colour indices, with room for the parts of
+	// tiles scrolled off either end.
+	uint8_t line_indices[8 + 160 + 8];
+
 	void build_bg_palette();
 	void build_sp0_palette();
 	void build_sp1_palette();
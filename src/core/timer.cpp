@@ -0,0 +1,106 @@
+#include "timer.h"
+#include "scheduler.h"
+#include "savestate.h"
+
+GBTimer::GBTimer()
+{
+	div_base = tima_base = 0;
+	tima = tma = tac = 0;
+}
+
+// Cycles per TIMA tick for each TAC clock select.
+uint64_t GBTimer::period()
+{
+	static const uint64_t periods[4] = { 1024, 16, 64, 256 };
+	return periods[tac & 3];
+}
+
+uint8_t GBTimer::tima_at(uint64_t now)
+{
+	if(!(tac & 4))
+	{
+		return tima;
+	}
+	uint64_t p = period();
+	return tima + (now - div_base) / p - (tima_base - div_base) / p;
+}
+
+void GBTimer::latch(uint64_t now)
+{
+	tima = tima_at(now);
+	tima_base = now;
+}
+
+uint8_t GBTimer::read(uint16_t virt, uint64_t now)
+{
+	switch(virt)
+	{
+		case 0xff04:
+			return (now - div_base) >> 8;
+		case 0xff05:
+			return tima_at(now);
+		case 0xff06:
+			return tma;
+		default:
+			return tac | 0xf8;
+	}
+}
+
+void GBTimer::write(uint16_t virt, uint8_t v, uint64_t now)
+{
+	switch(virt)
+	{
+		case 0xff04: // any write resets it
+			latch(now);
+			div_base = now;
+		break;
+
+		case 0xff05:
+			latch(now);
+			tima = v;
+		break;
+
+		case 0xff06:
+			tma = v;
+		break;
+
+		default:
+			latch(now);
+			tac = v & 7;
+		break;
+	}
+}
+
+uint64_t GBTimer::next_overflow()
+{
+	if(!(tac & 4))
+	{
+		return Scheduler::NEVER;
+	}
+	uint64_t p = period();
+	return div_base + ((tima_base - div_base) / p + (256 - tima)) * p;
+}
+
+void GBTimer::overflow(uint64_t when)
+{
+	tima = tma;
+	tima_base = when;
+}
+
+void GBTimer::save_state(StateWriter &w)
+{
+	w.put(div_base);
+	w.put(tima_base);
+	w.put(tima);
+	w.put(tma);
+	w.put(tac);
+}
+
+void GBTimer::load_state(StateReader &r)
+{
+	r.get(div_base);
+	r.get(tima_base);
+	r.get(tima);
+	r.get(tma);
+	r.get(tac);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+
+class StateWriter;
+class StateReader;
+
+// DIV, TIMA, TMA and TAC (0xff04-0xff07). Nothing here counts per cycle:
+// the registers are worked out from the cycle counter when read, and the
+// CPU schedules an event for the next TIMA overflow.
+class GBTimer
+{
+public:
+	GBTimer();
+
+	uint8_t read(uint16_t virt, uint64_t now);
+	void write(uint16_t virt, uint8_t v, uint64_t now);
+
+	// The cycle TIMA next overflows at, or Scheduler::NEVER while stopped.
+	uint64_t next_overflow();
+
+	// TIMA overflowed at when, so it starts again from TMA.
+	void overflow(uint64_t when);
+
+	void save_state(StateWriter &w);
+	void load_state(StateReader &r);
+
+private:
+	uint64_t div_base; // the cycle DIV was last reset at; TIMA ticks in step with it
+	uint64_t tima_base; // the cycle tima was last brought up to date at
+	uint8_t tima;
+	uint8_t tma;
+	uint8_t tac;
+
+	uint64_t period();
+	uint8_t tima_at(uint64_t now);
+	void latch(uint64_t now);
+};
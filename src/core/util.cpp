@@ -21,4 +21,15 @@ size_t util::load_buffer(std::string name, uint8_t *&buff)
 	f.close();
 
 	return s;
-}
\ No newline at end of file
+}
+
+uint64_t util::hash_buffer(const uint8_t *buff, size_t size, uint64_t h)
+{
+	size_t i = 0;
+	for(; i < size; i++)
+	{
+		h ^= buff[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
@@ -6,6 +6,7 @@
 namespace util
 {
 	size_t load_buffer(std::string name, uint8_t *&buff);
+	uint64_t hash_buffer(const uint8_t *buff, size_t size, uint64_t h = 0xcbf29ce484222325ULL); // FNV-1a
 
 	class LoadException : public std::exception
 	{
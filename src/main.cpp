@@ -1,15 +1,104 @@
-/*#include "cpu.h"
+// Headless runner: runs one cartridge for a number of frames with no window,
+// then prints how fast it went and hashes of the framebuffer and RAM. It only
+// links the core, so nothing graphical gets loaded at startup.
+//
+// usage: GamePersonHeadless [-b bios | -n] [-o state file] rom frames
+//
+// -n runs without a boot ROM, starting at 0x100 in the state it would have
+// left behind. -o saves the state once the frames have run.
 
-int main(int argc, char ** argv)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+
+#include "cpu.h"
+#include "romimage.h"
+#include "util.h"
+
+int main(int argc, char **argv)
 {
-	CPU c;
-	int i = 0;
+	std::string bios = "gb.bios";
+	const char *state = nullptr;
+	const char *rom = nullptr;
+	const char *frames_arg = nullptr;
+
+	int i = 1;
+	for(; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "-b") && i + 1 < argc)
+		{
+			bios = argv[++i];
+		}
+		else if(!strcmp(argv[i], "-n"))
+		{
+			bios = "";
+		}
+		else if(!strcmp(argv[i], "-o") && i + 1 < argc)
+		{
+			state = argv[++i];
+		}
+		else if(rom == nullptr)
+		{
+			rom = argv[i];
+		}
+		else
+		{
+			frames_arg = argv[i];
+		}
+	}
+
+	if(frames_arg == nullptr)
+	{
+		printf("usage: %s [-b bios | -n] [-o state file] rom frames\n", argv[0]);
+		return 1;
+	}
+	unsigned long frames = strtoul(frames_arg, nullptr, 10);
+
+	CPU *c;
+	try
+	{
+		c = new CPU(bios.empty() ? nullptr : RomImage::open(bios), RomImage::open(rom));
+	}
+	catch(util::LoadException &e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	unsigned long run = 0;
+	for(; run < frames; run++)
+	{
+		if(c->run_frame())
+		{
+			fprintf(stderr, "emulation stopped after %lu frames: %s\n", run, c->error.c_str());
+			break;
+		}
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	uint64_t fb, ram;
+	c->hash_state(fb, ram);
+
+	printf("%lu frames in %.3fs (%.1f fps) fb=%016llx ram=%016llx\n", run, seconds,
+		seconds > 0 ? run / seconds : 0.0, (unsigned long long)fb, (unsigned long long)ram);
 
-	for(; i < 0x100000; i++)
+	int status = run == frames ? 0 : 1;
+	if(state != nullptr)
 	{
-		c.step();
+		try
+		{
+			c->save_state_file(state);
+		}
+		catch(util::LoadException &e)
+		{
+			fprintf(stderr, "%s\n", e.what());
+			status = 1;
+		}
 	}
 
-	return 0;
+	delete c;
+	return status;
 }
-*/
\ No newline at end of file
@@ -1,53 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <string>
 #include <thread>
 #include <SDL2/SDL.h>
 #include "cpu.h"
+#include "pixels.h"
+#include "rewind.h"
+#include "romimage.h"
+#include "util.h"
+#include "spscqueue.h"
+#include "triplebuffer.h"
 
-int main(int argc, char ** argv)
+// Emulation runs on its own thread and never waits on the display: finished
+// frames go out through a triple buffer, and the main thread sends input back
+// through a queue whenever it changes.
+//
+// usage: GamePerson [-s N] [-b bios | -n] [rom]
+//
+// The BIOS and ROM default to gb.bios and cart.bin; -n starts without a boot
+// ROM, at 0x100 in the state it would have left. Holding tab fast-forwards
+// as fast as the host allows. Only some frames are drawn then: every Nth with
+// -s, otherwise as many as the display shows.
+
+struct Frame
 {
-	CPU *c = new CPU();
-	SDL_Init(SDL_INIT_VIDEO);
-	SDL_Window *win = SDL_CreateWindow("GamePerson", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 160, 144, 0);
-	SDL_Renderer *sdlRenderer = SDL_CreateRenderer(win, -1, 0);
+	uint8_t shades[160 * 144]; // as GBScreen::fb has them
+};
 
-	SDL_Texture *screen_tex = SDL_CreateTexture(sdlRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 160, 144);
-	SDL_SetRenderDrawColor(sdlRenderer, 0, 0, 0, 255);
-	int i = 0;
+struct Input
+{
+	uint8_t buttons; // same bits as CPU::buttons
+	bool rewind;
+	bool turbo;
+};
+
+struct Shared
+{
+	TripleBuffer<Frame> frames;
+	SpscQueue<Input, 64> input;
+	std::atomic<bool> quit; // set by the main thread
+	std::atomic<bool> stopped; // set by the emulation thread
+	std::atomic<unsigned int> speed; // emulated time per real time, in hundredths
+};
 
-	bool run = true;
+static void emulate(CPU *c, Shared *shared, unsigned int skip)
+{
+	// Hold backspace to rewind, a frame per pass.
+	RewindBuffer rewind(c, 32 << 20);
+	bool rewinding = false;
+	bool turbo = false;
 
-	SDL_Event ev;
+	// Paced to the real machine's frame rate, about 59.7 per second.
+	const std::chrono::steady_clock::duration frame_time = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		std::chrono::duration<double>((double)CYCLES_PER_LINE * LINES_PER_FRAME / CYCLES_PER_SECOND));
+	std::chrono::steady_clock::time_point next_frame = std::chrono::steady_clock::now();
 
-	while(run)
+	// In turbo, frames are drawn at the display's rate, or every skip'th.
+	std::chrono::steady_clock::time_point next_draw = next_frame;
+	uint64_t turbo_frames = 0;
+
+	std::chrono::steady_clock::time_point speed_start = next_frame;
+	unsigned int speed_frames = 0;
+
+	while(!shared->quit.load(std::memory_order_relaxed))
 	{
-		c->screen->start_frame();
+		Input in;
+		while(shared->input.pop(in))
+		{
+			c->buttons = in.buttons;
+			rewinding = in.rewind;
+			turbo = in.turbo;
+		}
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		bool draw = true;
 
-		for(i = 0; i < 10000; i++)
+		if(rewinding)
+		{
+			if(rewind.step_back())
+			{
+				c->screen->refresh(); // the framebuffer isn't part of the state
+			}
+		}
+		else
 		{
-			if(i % 10000/VBLANK_END == 0)
+			if(turbo)
 			{
-				c->screen->step();
+				draw = skip ? turbo_frames++ % skip == 0 : now >= next_draw;
+				if(draw)
+				{
+					next_draw = now + frame_time;
+				}
 			}
-			if(c->step())
+
+			c->screen->skip_render = !draw;
+			if(c->run_frame())
 			{
-				run = false;
+				fprintf(stderr, "emulation stopped: %s\n", c->error.c_str());
 				break;
 			}
+
+			rewind.push();
+			speed_frames++;
 		}
 
+		if(draw)
+		{
+			memcpy(shared->frames.write_buffer().shades, c->screen->fb, sizeof (Frame::shades));
+			shared->frames.publish();
+		}
+
+		now = std::chrono::steady_clock::now();
+		if(now - speed_start >= std::chrono::milliseconds(500))
+		{
+			shared->speed.store((unsigned int)(100 * speed_frames * frame_time.count() / (now - speed_start).count()), std::memory_order_relaxed);
+			speed_start = now;
+			speed_frames = 0;
+		}
+
+		if(turbo && !rewinding)
+		{
+			next_frame = now;
+			continue;
+		}
+
+		next_frame += frame_time;
+		if(now < next_frame)
+		{
+			std::this_thread::sleep_until(next_frame);
+		}
+		else
+		{
+			next_frame = now; // running behind; don't rush to catch up
+		}
+	}
+
+	shared->stopped.store(true, std::memory_order_relaxed);
+}
+
+static Input read_input(const Uint8 *keys)
+{
+	static const SDL_Scancode mapping[8] = {
+		SDL_SCANCODE_RIGHT, SDL_SCANCODE_LEFT, SDL_SCANCODE_UP, SDL_SCANCODE_DOWN,
+		SDL_SCANCODE_Z, SDL_SCANCODE_X, SDL_SCANCODE_RSHIFT, SDL_SCANCODE_RETURN
+	};
+
+	Input in;
+	in.buttons = 0;
+	int i = 0;
+	for(; i < 8; i++)
+	{
+		if(keys[mapping[i]])
+		{
+			in.buttons |= 1 << i;
+		}
+	}
+	in.rewind = keys[SDL_SCANCODE_BACKSPACE] != 0;
+	in.turbo = keys[SDL_SCANCODE_TAB] != 0;
+	return in;
+}
+
+int main(int argc, char ** argv)
+{
+	unsigned int skip = 0;
+	std::string bios = "gb.bios";
+	std::string rom = "cart.bin";
+
+	int i = 1;
+	for(; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "-s") && i + 1 < argc)
+		{
+			skip = atoi(argv[++i]);
+		}
+		else if(!strcmp(argv[i], "-b") && i + 1 < argc)
+		{
+			bios = argv[++i];
+		}
+		else if(!strcmp(argv[i], "-n"))
+		{
+			bios = "";
+		}
+		else
+		{
+			rom = argv[i];
+		}
+	}
+
+	CPU *c;
+	try
+	{
+		c = new CPU(bios.empty() ? nullptr : RomImage::open(bios), RomImage::open(rom));
+	}
+	catch(util::LoadException &e)
+	{
+		printf("%s\n", e.what());
+		return 1;
+	}
+
+	SDL_Init(SDL_INIT_VIDEO);
+	SDL_Window *win = SDL_CreateWindow("GamePerson", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 160, 144, 0);
+	// Waiting for vsync only holds up this thread now, not emulation.
+	SDL_Renderer *sdlRenderer = SDL_CreateRenderer(win, -1, SDL_RENDERER_PRESENTVSYNC);
+
+	SDL_Texture *screen_tex = SDL_CreateTexture(sdlRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 160, 144);
+	SDL_SetRenderDrawColor(sdlRenderer, 0, 0, 0, 255);
+
+	Shared *shared = new Shared();
+	shared->quit = false;
+	shared->stopped = false;
+	shared->speed = 100;
+	std::thread emulation(emulate, c, shared, skip);
+
+	const Uint8 *keys = SDL_GetKeyboardState(NULL);
+	Input sent;
+	sent.buttons = 0;
+	sent.rewind = false;
+	sent.turbo = false;
+	unsigned int shown_speed = 0;
+
+	SDL_Event ev;
+
+	while(!shared->stopped.load(std::memory_order_relaxed))
+	{
+		bool run = true;
 		while(SDL_PollEvent(&ev))
 		{
 			if(ev.type == SDL_QUIT)
 			{
-				break;
+				run = false;
 			}
 		}
+		if(!run)
+		{
+			break;
+		}
 
-		SDL_UpdateTexture(screen_tex, NULL, c->screen->fb, 160 * sizeof (Uint32));
-		SDL_RenderClear(sdlRenderer);
-		SDL_RenderCopy(sdlRenderer, screen_tex, NULL, NULL);
-		SDL_RenderPresent(sdlRenderer);
+		// If the queue is full, this is simply tried again next pass.
+		Input in = read_input(keys);
+		if((in.buttons != sent.buttons || in.rewind != sent.rewind || in.turbo != sent.turbo) && shared->input.push(in))
+		{
+			sent = in;
+		}
+
+		unsigned int speed = shared->speed.load(std::memory_order_relaxed);
+		if(speed != shown_speed)
+		{
+			char title[64];
+			snprintf(title, sizeof(title), "GamePerson - %u.%02ux", speed / 100, speed % 100);
+			SDL_SetWindowTitle(win, title);
+			shown_speed = speed;
+		}
+
+		if(shared->frames.update())
+		{
+			// Shades only become colours here, straight into the texture.
+			void *tex_pixels;
+			int pitch;
+			if(SDL_LockTexture(screen_tex, NULL, &tex_pixels, &pitch) == 0)
+			{
+				const uint8_t *shades = shared->frames.read_buffer().shades;
+				int y = 0;
+				for(; y < 144; y++)
+				{
+					pixels::convert(pixels::best(), pixels::ARGB8888, shades + y * 160, (uint8_t*)tex_pixels + y * pitch, 160);
+				}
+				SDL_UnlockTexture(screen_tex);
+			}
+			SDL_RenderClear(sdlRenderer);
+			SDL_RenderCopy(sdlRenderer, screen_tex, NULL, NULL);
+			SDL_RenderPresent(sdlRenderer);
+		}
+		else
+		{
+			SDL_Delay(1);
+		}
 	}
 
+	shared->quit.store(true, std::memory_order_relaxed);
+	emulation.join();
+	delete shared;
+
 	SDL_DestroyTexture(screen_tex);
 	SDL_DestroyRenderer(sdlRenderer);
 	SDL_DestroyWindow(win);
@@ -55,4 +291,4 @@ int main(int argc, char ** argv)
 	delete c;
 
 	SDL_Quit();
-}
\ No newline at end of file
+}
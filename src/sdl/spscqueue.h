@@ -0,0 +1,52 @@
+#pragma once
+#include <stddef.h>
+#include <atomic>
+
+// Fixed-size ring for passing values from one producer thread to one
+// consumer thread. Both ends finish in a bounded number of steps: push()
+// fails rather than waiting when the ring is full, and pop() fails when it's
+// empty.
+template<typename T, size_t N>
+class SpscQueue
+{
+public:
+	static_assert(N && (N & (N - 1)) == 0, "SpscQueue size has to be a power of two");
+
+	SpscQueue() : head(0), tail(0) {}
+
+	// Producer side.
+	bool push(const T &v)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		if(t - head.load(std::memory_order_acquire) == N)
+		{
+			return false;
+		}
+		slots[t & (N - 1)] = v;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side.
+	bool pop(T &v)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		if(h == tail.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+		v = slots[h & (N - 1)];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	T slots[N];
+	// Padded onto separate cache lines so the two threads don't bounce one
+	// between them.
+	char pad0[64];
+	std::atomic<size_t> head;
+	char pad1[64 - sizeof (std::atomic<size_t>)];
+	std::atomic<size_t> tail;
+	char pad2[64 - sizeof (std::atomic<size_t>)];
+};
@@ -0,0 +1,56 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+// Hands whole values from one producer thread to one consumer thread without
+// either of them waiting. The producer fills its back slot and publishes it;
+// the consumer picks up the most recently published slot, skipping any it
+// was too slow to see. Three slots mean the producer always has one to fill
+// that the consumer isn't reading.
+template<typename T>
+class TripleBuffer
+{
+public:
+	TripleBuffer() : middle(1), back(0), front(2) {}
+
+	// Producer side: the slot to fill in next.
+	T &write_buffer()
+	{
+		return slots[back];
+	}
+
+	// Producer side: make write_buffer() the newest value and take a fresh
+	// slot to fill.
+	void publish()
+	{
+		back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+	}
+
+	// Consumer side: switch read_buffer() to the newest published value.
+	// Returns false, keeping the old one, if nothing has been published since
+	// the last call.
+	bool update()
+	{
+		if(!(middle.load(std::memory_order_relaxed) & FRESH))
+		{
+			return false;
+		}
+		front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+		return true;
+	}
+
+	// Consumer side: the value picked up by the last update().
+	const T &read_buffer()
+	{
+		return slots[front];
+	}
+
+private:
+	static const uint8_t INDEX = 3;
+	static const uint8_t FRESH = 4;
+
+	T slots[3];
+	std::atomic<uint8_t> middle; // slot index, plus FRESH if the consumer hasn't taken it
+	uint8_t back; // only touched by the producer
+	uint8_t front; // only touched by the consumer
+};